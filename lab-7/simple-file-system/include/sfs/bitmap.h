@@ -0,0 +1,62 @@
+// bitmap.h: Packed allocation bitmap
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Number of bits summarized by one free count
+#define BITMAP_REGION_BITS 4096
+#define BITMAP_WORD_BITS 64
+
+typedef struct Bitmap {
+    uint64_t *Words;      // One bit per item, set when the item is in use
+    size_t Bits;          // Number of items
+    size_t Regions;       // Number of regions
+    uint32_t *RegionFree; // Free items per region
+    size_t Free;          // Free items overall
+} Bitmap;
+
+// Allocate a bitmap with every item free
+// @param	map	    Bitmap to initialize
+// @param	bits	    Number of items
+void bitmapInit(Bitmap *map, size_t bits);
+
+// Release the memory held by a bitmap
+void bitmapDestroy(Bitmap *map);
+
+// Number of words backing a bitmap
+size_t bitmapWords(Bitmap *map);
+
+// Replace the contents of a bitmap with previously saved words
+// @param	map	    Initialized bitmap to load into
+// @param	words	    bitmapWords(map) words, as found in map->Words
+void bitmapLoad(Bitmap *map, const uint64_t *words);
+
+// Mark as used every item that is in use in another bitmap of the same size
+void bitmapMerge(Bitmap *map, Bitmap *other);
+
+// Return whether or not an item is in use
+bool bitmapTest(Bitmap *map, size_t bit);
+
+// Find the lowest free item at or after "from"
+// @return	Item found, or -1 if every item from "from" on is in use
+ssize_t bitmapFind(Bitmap *map, size_t from);
+
+// Find the lowest item in use at or after "from"
+// @return	Item found, or -1 if every item from "from" on is free
+ssize_t bitmapFindUsed(Bitmap *map, size_t from);
+
+// Mark an item as used
+void bitmapSet(Bitmap *map, size_t bit);
+
+// Mark an item as free
+void bitmapClear(Bitmap *map, size_t bit);
+
+// Mark "count" items, starting at "start", as used
+void bitmapSetRange(Bitmap *map, size_t start, size_t count);
+
+// Mark "count" items, starting at "start", as free
+void bitmapClearRange(Bitmap *map, size_t start, size_t count);
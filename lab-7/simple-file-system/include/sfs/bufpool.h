@@ -0,0 +1,40 @@
+// bufpool.h: Pool of aligned block buffers
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Number of buffers kept by the pool of a direct disk
+#define BUFFER_POOL_DEFAULT_BUFFERS 1024
+
+typedef struct BufferPool {
+    char *Memory;         // Pooled buffers, BLOCK_SIZE apart and BLOCK_SIZE aligned
+    size_t Capacity;      // Number of pooled buffers
+    char **Free;          // Pooled buffers not handed out, as a stack
+    size_t Available;     // Number of buffers on the stack
+    size_t Takes;         // Number of buffers handed out
+    size_t Overflows;     // Number of buffers allocated because the pool was empty
+    pthread_mutex_t Lock; // Held while the stack is looked at or changed
+} BufferPool;
+
+// Allocate a pool of aligned block buffers
+// @param	pool	    Pool to initialize
+// @param	capacity    Number of buffers to keep
+void bufferPoolInit(BufferPool *pool, size_t capacity);
+
+// Release the memory held by a pool, every buffer must have been given back
+void bufferPoolDestroy(BufferPool *pool);
+
+// Take a BLOCK_SIZE buffer aligned to BLOCK_SIZE; with a NULL pool, or once
+// the pool is empty, the buffer is allocated
+char *bufferPoolTake(BufferPool *pool);
+
+// Give back a buffer taken from the same pool
+void bufferPoolGive(BufferPool *pool, char *buffer);
+
+// Return whether or not a buffer may be used for direct transfers
+bool bufferAligned(const void *buffer);
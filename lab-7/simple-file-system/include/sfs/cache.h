@@ -0,0 +1,46 @@
+// cache.h: Write-back block cache
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Default number of blocks held by the cache
+#define CACHE_DEFAULT_BLOCKS 64
+
+#define CACHE_EMPTY -1
+
+typedef struct CacheEntry {
+    int Block;       // Block number held by this entry (CACHE_EMPTY if unused)
+    int Next;        // Next entry in the same hash bucket (CACHE_EMPTY if last)
+    bool Dirty;      // Whether or not the block must be written back
+    bool Referenced; // CLOCK reference bit
+    char *Data;      // Block contents
+} CacheEntry;
+
+typedef struct BlockCache {
+    Disk *Backing;       // Disk the cache reads from and writes back to
+    size_t Capacity;     // Number of entries
+    size_t Buckets;      // Number of hash buckets
+    int *Heads;          // First entry of each hash bucket
+    CacheEntry *Entries; // Cache entries
+    char *Memory;        // Backing memory for entry data
+    size_t Hand;         // CLOCK hand
+    size_t Hits;         // Number of lookups served from the cache
+    size_t Misses;       // Number of lookups that went to the backing disk
+    size_t Evictions;    // Number of entries replaced
+    size_t WriteBacks;   // Number of dirty blocks written to the backing disk
+    pthread_mutex_t Lock; // Held while the entries are looked at or changed
+} BlockCache;
+
+// Wrap a disk with a block cache
+// @param	self	    Disk to initialize as the cache front end
+// @param	backing	    Disk to cache
+// @param	capacity    Number of blocks to keep in memory
+void CacheDiskConstructor(Disk *self, Disk *backing, size_t capacity);
+
+// Return the cache state of a disk built with CacheDiskConstructor
+BlockCache *cacheOf(Disk *self);
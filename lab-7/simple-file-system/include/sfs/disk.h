@@ -4,16 +4,26 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 // Number of bytes per block
 #define BLOCK_SIZE 4096
 
+// Maximum number of blocks moved by one vectored transfer
+#define MAX_RUN_BLOCKS 1024
+
+// Size of the huge pages a memory disk may be backed by
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 typedef struct Disk {
     int FileDescriptor; // File descriptor of disk image
     size_t Blocks;      // Number of blocks in disk image
     size_t Reads;       // Number of reads performed
     size_t Writes;      // Number of writes performed
     size_t Mounts;      // Number of mounts
+    void *Private;      // Backend specific state (i.e. block cache)
+    struct BufferPool *Buffers; // Aligned buffers transfers should use (NULL if any will do)
 
     // Check parameters
     // @param	blocknum    Block to operate on
@@ -49,4 +59,77 @@ typedef struct Disk {
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
     void (*writeDisk)(struct Disk *self, int blocknum, char *data);
+
+    // Write back any buffered blocks to stable storage
+    void (*flush)(struct Disk *self);
+
+    // Read consecutive blocks from disk
+    // @param	blocknum    First block to read from
+    // @param	iov	    One BLOCK_SIZE buffer per block to read into
+    // @param	count	    Number of blocks (at most MAX_RUN_BLOCKS)
+    void (*readBlocks)(struct Disk *self, int blocknum, struct iovec *iov, int count);
+
+    // Write consecutive blocks to disk
+    // @param	blocknum    First block to write to
+    // @param	iov	    One BLOCK_SIZE buffer per block to write from
+    // @param	count	    Number of blocks (at most MAX_RUN_BLOCKS)
+    void (*writeBlocks)(struct Disk *self, int blocknum, struct iovec *iov, int count);
+
+    // Queue an asynchronous read of consecutive blocks
+    // @param	blocknum    First block to read from
+    // @param	iov	    Buffers to read into, must stay valid until waited on
+    // @param	count	    Number of blocks (at most MAX_RUN_BLOCKS)
+    // @return	Ticket to pass to waitDisk, 0 if the request is already done
+    ssize_t (*readDiskAsync)(struct Disk *self, int blocknum, struct iovec *iov, int count);
+
+    // Queue an asynchronous write of consecutive blocks
+    // @param	blocknum    First block to write to
+    // @param	iov	    Buffers to write from, must stay valid until waited on
+    // @param	count	    Number of blocks (at most MAX_RUN_BLOCKS)
+    // @return	Ticket to pass to waitDisk, 0 if the request is already done
+    ssize_t (*writeDiskAsync)(struct Disk *self, int blocknum, struct iovec *iov, int count);
+
+    // Submit queued requests and wait for them to complete
+    // @param	ticket	    Request to wait for, along with every request queued
+    //			    before it; -1 waits for every request
+    void (*waitDisk)(struct Disk *self, ssize_t ticket);
+
+    // Return a disk that may be read from several threads at once: the disk
+    // itself, the disk below a front end that is not, or NULL if there is none.
+    // Flush first, so blocks buffered by a front end are visible through it.
+    struct Disk *(*concurrent)(struct Disk *self);
 } Disk;
+
+// Initialize a disk backed by an image file
+// @param	self	    Disk to initialize
+void DiskConstructor(Disk *self);
+
+// Initialize a disk that maps the whole image file into memory
+// @param	self	    Disk to initialize
+void MmapDiskConstructor(Disk *self);
+
+// Initialize a disk that bypasses the host page cache with O_DIRECT
+// @param	self	    Disk to initialize
+void DirectDiskConstructor(Disk *self);
+
+// Initialize a disk that batches block transfers through io_uring
+// @param	self	    Disk to initialize
+void UringDiskConstructor(Disk *self);
+
+// Initialize a disk held in anonymous memory, starting from the contents of
+// the image file passed to open when there is one
+// @param	self	    Disk to initialize
+// @param	hugePages   Whether or not to back the memory with huge pages
+void MemoryDiskConstructor(Disk *self, bool hugePages);
+
+// Replace the contents of a memory disk with those of an image file
+// @param	self	    Disk built with MemoryDiskConstructor
+// @param	path	    Path to disk image
+// @return	Whether or not the image could be read
+bool loadMemoryDisk(Disk *self, const char *path);
+
+// Write the contents of a memory disk to an image file
+// @param	self	    Disk built with MemoryDiskConstructor
+// @param	path	    Path to disk image
+// @return	Whether or not the whole image reached stable storage
+bool saveMemoryDisk(Disk *self, const char *path);
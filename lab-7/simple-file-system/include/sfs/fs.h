@@ -12,6 +12,33 @@
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
 
+// Extent inode format: extents held by an inode and by an extent tree block,
+// and the most levels below the root of an extent tree
+#define EXTENTS_PER_INODE 3
+#define EXTENTS_PER_BLOCK 511
+#define EXTENT_MAX_DEPTH 2
+
+// SuperBlock flags
+#define SUPER_EXTENTS 0x1 // Inodes hold extents instead of block pointers
+
+// Readahead windows, in blocks, and the number of inodes streamed at once
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_DEFAULT_BLOCKS 64
+#define READAHEAD_STREAMS 8
+
+// Most file blocks held in memory awaiting allocation, and the number of
+// inodes with such blocks at once
+#define DELAYED_DEFAULT_BLOCKS 4096
+#define DELAYED_FILES 16
+
+// Blocks per allocation group; smaller images are a single group
+#define ALLOC_GROUP_BLOCKS 32768
+
+// Free blocks a writing thread keeps on top of the run it asked for, and the
+// number of refills, by any thread, after which an unused magazine goes back
+#define MAGAZINE_DEFAULT_BLOCKS 64
+#define MAGAZINE_IDLE_REFILLS 256
+
 #define OCCUPIED 1
 #define FREE 0
 
@@ -20,35 +47,134 @@ typedef struct SuperBlock { // Superblock structure
     uint32_t Blocks;        // Number of blocks in file system
     uint32_t InodeBlocks;   // Number of blocks reserved for inodes
     uint32_t Inodes;        // Number of inodes in file system
+    uint32_t BitmapStart;   // First block of the allocation bitmaps (0 if none)
+    uint32_t BitmapBlocks;  // Number of blocks holding the allocation bitmaps
+    uint32_t Clean;         // Whether or not the bitmaps were saved on unmount
+    uint32_t Flags;         // Format flags (SUPER_*)
 } SuperBlock;
 
+typedef struct Extent { // Run of consecutive blocks
+    uint32_t Start;     // First block (child tree block in an index node)
+    uint32_t Length;    // Number of file blocks covered
+} Extent;
+
 typedef struct Inode {
-    uint32_t Valid;                      // Whether or not inode is valid
-    uint32_t Size;                       // Size of file
-    uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
-    uint32_t Indirect;                   // Indirect pointer
-    uint32_t DoubleIndirect;             // Double Indirect pointer
+    uint32_t Valid;                          // Whether or not inode is valid
+    uint32_t Size;                           // Size of file
+    union {
+        struct {
+            uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+            uint32_t Indirect;                   // Indirect pointer
+            uint32_t DoubleIndirect;             // Double Indirect pointer
+        };
+        struct {
+            Extent Extents[EXTENTS_PER_INODE];   // First extents of the file
+            uint32_t ExtentTree;                 // Root of the extent tree holding the rest
+        };
+    };
 } Inode;
 
+typedef struct ExtentNode {             // Extent tree block
+    uint32_t Count;                     // Number of entries in use
+    uint32_t Depth;                     // Levels below this one (0 in a leaf)
+    Extent Entries[EXTENTS_PER_BLOCK];  // Extents in a leaf, children otherwise
+} ExtentNode;
+
 typedef union Block {
     SuperBlock Super;                      // Superblock
     Inode Inodes[INODES_PER_BLOCK];        // Inode block
     uint32_t Pointers[POINTERS_PER_BLOCK]; // Pointer block
+    ExtentNode Node;                       // Extent tree block
     char Data[BLOCK_SIZE];                 // Data block
 } Block;
 
+typedef struct PointerBlock { // Pointer block held by a file handle
+    uint32_t Number;            // Block held (0 if none)
+    bool Dirty;                 // Whether or not it must be written back
+    Block Data;                 // Block contents
+} PointerBlock;
+
+typedef struct FileHandle {      // Open file
+    size_t Inumber;              // Inode the handle was opened on
+    Inode Inode;                 // Inode contents
+    size_t Position;             // Offset of the next read or write
+    PointerBlock Indirect;       // Indirect block of the inode, or extent tree root
+    PointerBlock DoubleIndirect; // Double indirect block of the inode, or extent tree node one level down
+    PointerBlock Level;          // Last indirect block used below the double indirect block, or extent tree node two levels down
+    struct FileHandle *Next;     // Next open handle
+} FileHandle;
+
+// State of a file system instance, private to fs.c
+typedef struct FileSystemState FileSystemState;
+
 typedef struct FileSystem {
+    FileSystemState *State; // Mounted image, caches and settings of this instance
+
+    // Release the state of the instance, unmounting its disk first
+    void (*FileSystemDestructor)(struct FileSystem *self);
+
+    void (*debug)(struct FileSystem *self, Disk *disk);
+    bool (*format)(struct FileSystem *self, Disk *disk);
+
+    bool (*mount)(struct FileSystem *self, Disk *disk);
+    bool (*unmount)(struct FileSystem *self, Disk *disk);
+
+    ssize_t (*create)(struct FileSystem *self);
+    bool (*removeInode)(struct FileSystem *self, size_t inumber);
+    ssize_t (*stat)(struct FileSystem *self, size_t inumber);
+
+    // Batched inode operations that read and write each inode block once.
+    // createMany fills "inumbers" with up to "count" new inodes, statMany sets
+    // "sizes" to -1 for invalid inodes; all return the number of inodes handled.
+    ssize_t (*createMany)(struct FileSystem *self, size_t count, size_t *inumbers);
+    ssize_t (*removeMany)(struct FileSystem *self, size_t *inumbers, size_t count);
+    ssize_t (*statMany)(struct FileSystem *self, size_t *inumbers, size_t count, ssize_t *sizes);
+
+    ssize_t (*readInode)(struct FileSystem *self, size_t inumber, char *data, size_t length, size_t offset);
+    ssize_t (*writeInode)(struct FileSystem *self, size_t inumber, char *data, size_t length, size_t offset);
+
+    FileHandle *(*open)(struct FileSystem *self, size_t inumber);
+    ssize_t (*read)(struct FileSystem *self, FileHandle *handle, char *data, size_t length);
+    ssize_t (*write)(struct FileSystem *self, FileHandle *handle, char *data, size_t length);
+    bool (*seek)(struct FileSystem *self, FileHandle *handle, size_t position);
+    bool (*close)(struct FileSystem *self, FileHandle *handle);
+
+} FileSystem;
+
+// Initialize the file system operations and an unmounted instance
+void FileSystemConstructor(FileSystem *self);
+
+// Set the number of threads that scan the inode blocks when mounting an
+// image without saved bitmaps (0 uses one per processor)
+void setMountThreads(FileSystem *self, size_t threads);
+
+// Set the number of inodes cached while an image is mounted
+// (0 caches up to INODE_CACHE_DEFAULT_ENTRIES)
+void setInodeCacheCapacity(FileSystem *self, size_t entries);
+
+// Return the inode cache of the mounted file system (NULL if none)
+struct InodeCache *getInodeCache(FileSystem *self);
+
+// Set the most block translation extents cached while an image is mounted
+// (0 uses MAP_CACHE_DEFAULT_EXTENTS)
+void setMapCacheExtents(FileSystem *self, size_t extents);
+
+// Return the block translation cache of the mounted file system (NULL if none)
+struct MapCache *getMapCache(FileSystem *self);
 
-    void (*debug)(Disk *disk);
-    bool (*format)(Disk *disk);
+// Set the largest window prefetched for sequential reads (0 disables readahead)
+void setReadaheadBlocks(FileSystem *self, size_t blocks);
 
-    bool (*mount)(Disk *disk);
+// Choose whether format writes inodes that hold extents instead of block pointers
+void setExtentInodes(FileSystem *self, bool enabled);
 
-    ssize_t (*create)();
-    bool (*removeInode)(size_t inumber);
-    ssize_t (*stat)(size_t inumber);
+// Set the most written file blocks kept in memory before blocks are allocated
+// for them (0 allocates blocks as every write arrives)
+void setDelayedBlocks(FileSystem *self, size_t blocks);
 
-    ssize_t (*readInode)(size_t inumber, char *data, size_t length, size_t offset);
-    ssize_t (*writeInode)(size_t inumber, char *data, size_t length, size_t offset);
+// Set the most free blocks a writing thread keeps for its next writes
+// (0 takes every run from the shared free map)
+void setMagazineBlocks(FileSystem *self, size_t blocks);
 
-} FileSystem;
\ No newline at end of file
+// Print the inode table and the free block map of the mounted file system
+void printBitmaps(FileSystem *self);
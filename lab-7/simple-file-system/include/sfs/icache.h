@@ -0,0 +1,73 @@
+// icache.h: Write-back inode cache
+
+#pragma once
+
+#include "sfs/fs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Most inodes cached when no capacity is set before mounting
+#define INODE_CACHE_DEFAULT_ENTRIES 1024
+
+#define INODE_CACHE_EMPTY -1
+
+typedef struct InodeCacheEntry {
+    ssize_t Inumber; // Inode held by this entry (INODE_CACHE_EMPTY if unused)
+    int Next;        // Next entry in the same hash bucket (INODE_CACHE_EMPTY if last)
+    bool Dirty;      // Whether or not the inode must be written back
+    bool Referenced; // CLOCK reference bit
+    Inode Inode;     // Inode contents
+} InodeCacheEntry;
+
+typedef struct InodeCache {
+    size_t Capacity;          // Number of entries
+    size_t Buckets;           // Number of hash buckets
+    int *Heads;               // First entry of each hash bucket
+    InodeCacheEntry *Entries; // Cache entries
+    size_t Hand;              // CLOCK hand
+    size_t Hits;              // Number of lookups served from the cache
+    size_t Misses;            // Number of lookups that had to read the inode
+    size_t Evictions;         // Number of entries replaced
+    size_t WriteBacks;        // Number of dirty inodes written back
+    pthread_mutex_t Lock;     // Held by every cache operation
+
+    // Store dirty inodes, sorted by inode number
+    // @param	context	    Context given to inodeCacheInit
+    // @param	inumbers    Inode numbers
+    // @param	inodes	    Inode contents, in the same order
+    // @param	count	    Number of inodes
+    void (*writeBack)(void *context, size_t *inumbers, Inode **inodes, size_t count);
+    void *Context;
+} InodeCache;
+
+// Order two size_t inode numbers, for qsort
+int compareInumbers(const void *a, const void *b);
+
+// Allocate an empty inode cache
+// @param	cache	    Cache to initialize
+// @param	capacity    Number of inodes to keep in memory
+// @param	writeBack   Function that stores dirty inodes
+// @param	context	    First argument of every writeBack call
+void inodeCacheInit(InodeCache *cache, size_t capacity,
+                    void (*writeBack)(void *context, size_t *inumbers, Inode **inodes, size_t count),
+                    void *context);
+
+// Release the memory held by an inode cache, without writing anything back
+void inodeCacheDestroy(InodeCache *cache);
+
+// Copy a cached inode into "inode"
+// @return	Whether or not the inode was cached
+bool inodeCacheLookup(InodeCache *cache, size_t inumber, Inode *inode);
+
+// Cache the contents of an inode, replacing any cached copy
+// @param	dirty	    Whether or not the inode differs from its stored copy
+void inodeCacheUpdate(InodeCache *cache, size_t inumber, Inode *inode, bool dirty);
+
+// Replace the cached copy of an inode that was just stored, if there is one,
+// and mark it clean
+void inodeCacheRefresh(InodeCache *cache, size_t inumber, Inode *inode);
+
+// Write back every dirty inode
+void inodeCacheFlush(InodeCache *cache);
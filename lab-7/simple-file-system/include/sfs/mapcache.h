@@ -0,0 +1,68 @@
+// mapcache.h: Per-inode cache of file block to disk block translations
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Most extents held across all inodes when no cap is set before mounting
+#define MAP_CACHE_DEFAULT_EXTENTS 65536
+
+#define MAP_CACHE_EMPTY -1
+
+typedef struct MapExtent {
+    uint32_t Logical;  // First file block
+    uint32_t Physical; // Disk block holding it
+    uint32_t Length;   // Number of consecutive blocks
+} MapExtent;
+
+typedef struct MapEntry {
+    ssize_t Inumber;    // Inode described by this entry (MAP_CACHE_EMPTY if unused)
+    int Next;           // Next entry in the same hash bucket (MAP_CACHE_EMPTY if last)
+    bool Referenced;    // CLOCK reference bit
+    MapExtent *Extents; // Extents sorted by file block, never overlapping
+    size_t Count;       // Number of extents
+    size_t Allocated;   // Room in Extents
+} MapEntry;
+
+typedef struct MapCache {
+    size_t Capacity;    // Number of inodes that can be described
+    size_t Buckets;     // Number of hash buckets
+    int *Heads;         // First entry of each hash bucket
+    MapEntry *Entries;  // Cache entries
+    size_t Hand;        // CLOCK hand
+    size_t MaxExtents;  // Most extents held across all entries
+    size_t Extents;     // Extents held across all entries
+    size_t Hits;        // Number of lookups translated entirely from the cache
+    size_t Misses;      // Number of lookups that had to walk the pointer blocks
+    size_t Evictions;   // Number of inodes dropped to stay under MaxExtents
+    pthread_mutex_t Lock; // Held by every cache operation
+} MapCache;
+
+// Allocate an empty translation cache
+// @param	cache	    Cache to initialize
+// @param	capacity    Number of inodes that can be described
+// @param	maxExtents  Most extents held across all inodes
+void mapCacheInit(MapCache *cache, size_t capacity, size_t maxExtents);
+
+// Release the memory held by a translation cache
+void mapCacheDestroy(MapCache *cache);
+
+// Translate file blocks of an inode, stopping at the first one not cached
+// @param	first	    First file block
+// @param	count	    Number of file blocks
+// @param	blocks	    Disk block of each translated file block
+// @return	Number of file blocks translated
+size_t mapCacheLookup(MapCache *cache, size_t inumber, size_t first, size_t count, uint32_t *blocks);
+
+// Record the disk blocks of consecutive file blocks of an inode
+// @param	first	    First file block
+// @param	blocks	    Disk block of each file block
+// @param	count	    Number of file blocks
+void mapCacheInsert(MapCache *cache, size_t inumber, size_t first, uint32_t *blocks, size_t count);
+
+// Forget the translations of an inode from file block "from" on
+void mapCacheInvalidate(MapCache *cache, size_t inumber, size_t from);
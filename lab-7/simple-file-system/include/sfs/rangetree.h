@@ -0,0 +1,51 @@
+// rangetree.h: Index of free block extents
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+typedef struct RangeNode {
+    uint32_t Start;           // First free block
+    uint32_t Length;          // Number of free blocks
+    uint32_t MaxLength;       // Longest extent in this subtree
+    uint32_t Priority;        // Heap priority keeping the tree balanced
+    struct RangeNode *Left;   // Extents that start before this one
+    struct RangeNode *Right;  // Extents that start after this one
+} RangeNode;
+
+typedef struct RangeTree {
+    RangeNode *Root;    // Extents ordered by start
+    size_t Count;       // Number of extents
+    size_t Free;        // Number of free blocks across all extents
+    uint32_t Seed;      // State of the priority generator
+} RangeTree;
+
+// Start an empty tree
+void rangeTreeInit(RangeTree *tree);
+
+// Release every extent of a tree
+void rangeTreeDestroy(RangeTree *tree);
+
+// Add free blocks, merging them with the extents they touch
+// @param	start	    First block, must not be free already
+// @param	length	    Number of blocks
+void rangeTreeInsert(RangeTree *tree, uint32_t start, uint32_t length);
+
+// Take blocks out of the free extent that holds them all
+// @return	false if the blocks are not all free in one extent
+bool rangeTreeRemove(RangeTree *tree, uint32_t start, uint32_t length);
+
+// Take up to "want" contiguous blocks, starting in [first, limit), as close
+// after "goal" as possible
+// @param	goal	    Block the run should start at, or after
+// @param	first	    First block the run may start at
+// @param	limit	    Block the run must start before
+// @param	want	    Number of blocks wanted
+// @param	got	    Set to the number of blocks taken, fewer than "want"
+//                          only when no free extent in the range is long enough
+// @return	First block taken, or -1 if no free extent starts in the range
+ssize_t rangeTreeAlloc(RangeTree *tree, uint32_t goal, uint32_t first, uint32_t limit,
+                       size_t want, size_t *got);
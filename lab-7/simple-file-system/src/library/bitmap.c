@@ -0,0 +1,183 @@
+// bitmap.c: Packed allocation bitmap
+
+#include "sfs/bitmap.h"
+
+#include <string.h>
+
+/**
+ * Items are packed 64 to a word, so a free item is found by skipping full
+ * words and taking the count of trailing zeros of the inverted word. Every
+ * region of BITMAP_REGION_BITS items keeps a free count so full regions are
+ * skipped without touching their words. Allocation itself is left to the
+ * caller, which finds free items here and marks them.
+ */
+
+void bitmapInit(Bitmap *map, size_t bits) {
+    size_t words = (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+
+    map->Bits = bits;
+    map->Words = calloc(words > 0 ? words : 1, sizeof(uint64_t));
+    map->Regions = (bits + BITMAP_REGION_BITS - 1) / BITMAP_REGION_BITS;
+    map->RegionFree = calloc(map->Regions > 0 ? map->Regions : 1, sizeof(uint32_t));
+    map->Free = bits;
+
+    for (size_t r = 0; r < map->Regions; r++) {
+        size_t end = (r + 1) * BITMAP_REGION_BITS;
+        map->RegionFree[r] = (end > bits ? bits : end) - r * BITMAP_REGION_BITS;
+    }
+
+    // Bits past the end of the last word are never handed out
+    if (bits % BITMAP_WORD_BITS != 0) {
+        map->Words[words - 1] = ~0ULL << (bits % BITMAP_WORD_BITS);
+    }
+}
+
+void bitmapDestroy(Bitmap *map) {
+    free(map->Words);
+    free(map->RegionFree);
+    memset(map, 0, sizeof(Bitmap));
+}
+
+size_t bitmapWords(Bitmap *map) {
+    return (map->Bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+// Recompute the free counts from the words
+void recountBitmap(Bitmap *map) {
+    size_t wordsPerRegion = BITMAP_REGION_BITS / BITMAP_WORD_BITS;
+    size_t count = bitmapWords(map);
+
+    // Padding bits are set, so every word contributes 64 minus its population
+    map->Free = 0;
+    for (size_t r = 0; r < map->Regions; r++) {
+        size_t end = (r + 1) * wordsPerRegion;
+        uint32_t free = 0;
+        for (size_t w = r * wordsPerRegion; w < end && w < count; w++) {
+            free += BITMAP_WORD_BITS - __builtin_popcountll(map->Words[w]);
+        }
+        map->RegionFree[r] = free;
+        map->Free += free;
+    }
+}
+
+void bitmapLoad(Bitmap *map, const uint64_t *words) {
+    size_t count = bitmapWords(map);
+    if (count == 0) return;
+
+    memcpy(map->Words, words, count * sizeof(uint64_t));
+    if (map->Bits % BITMAP_WORD_BITS != 0) {
+        map->Words[count - 1] |= ~0ULL << (map->Bits % BITMAP_WORD_BITS);
+    }
+
+    recountBitmap(map);
+}
+
+void bitmapMerge(Bitmap *map, Bitmap *other) {
+    size_t count = bitmapWords(map);
+    for (size_t w = 0; w < count; w++) {
+        map->Words[w] |= other->Words[w];
+    }
+
+    recountBitmap(map);
+}
+
+bool bitmapTest(Bitmap *map, size_t bit) {
+    if (bit >= map->Bits) return false;
+    return (map->Words[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+ssize_t bitmapFind(Bitmap *map, size_t from) {
+    size_t wordsPerRegion = BITMAP_REGION_BITS / BITMAP_WORD_BITS;
+    size_t words = (map->Bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+
+    size_t word = from / BITMAP_WORD_BITS;
+    // Ignore the bits of the first word that lie before "from"
+    uint64_t skip = (1ULL << (from % BITMAP_WORD_BITS)) - 1;
+
+    while (word < words) {
+        size_t region = word / wordsPerRegion;
+        if (map->RegionFree[region] == 0) {
+            word = (region + 1) * wordsPerRegion;
+            skip = 0;
+            continue;
+        }
+
+        uint64_t available = ~(map->Words[word] | skip);
+        if (available != 0) {
+            return word * BITMAP_WORD_BITS + __builtin_ctzll(available);
+        }
+        skip = 0;
+        word++;
+    }
+
+    return -1;
+}
+
+ssize_t bitmapFindUsed(Bitmap *map, size_t from) {
+    size_t words = bitmapWords(map);
+    if (from >= map->Bits) return -1;
+
+    size_t word = from / BITMAP_WORD_BITS;
+    uint64_t used = map->Words[word] & (~0ULL << (from % BITMAP_WORD_BITS));
+    while (used == 0 && ++word < words) used = map->Words[word];
+    if (used == 0) return -1;
+
+    // Padding bits past the last item are set but never in use
+    size_t bit = word * BITMAP_WORD_BITS + __builtin_ctzll(used);
+    return bit < map->Bits ? (ssize_t)bit : -1;
+}
+
+void bitmapSet(Bitmap *map, size_t bit) {
+    if (bit >= map->Bits || bitmapTest(map, bit)) return;
+
+    map->Words[bit / BITMAP_WORD_BITS] |= 1ULL << (bit % BITMAP_WORD_BITS);
+    map->RegionFree[bit / BITMAP_REGION_BITS]--;
+    map->Free--;
+}
+
+void bitmapClear(Bitmap *map, size_t bit) {
+    if (bit >= map->Bits || !bitmapTest(map, bit)) return;
+
+    map->Words[bit / BITMAP_WORD_BITS] &= ~(1ULL << (bit % BITMAP_WORD_BITS));
+    map->RegionFree[bit / BITMAP_REGION_BITS]++;
+    map->Free++;
+}
+
+// Bits of the word holding "bit" that lie in [bit, end)
+uint64_t rangeMask(size_t bit, size_t end) {
+    size_t word = bit / BITMAP_WORD_BITS;
+    uint64_t mask = ~0ULL << (bit % BITMAP_WORD_BITS);
+    if (end < (word + 1) * BITMAP_WORD_BITS)
+        mask &= (1ULL << (end % BITMAP_WORD_BITS)) - 1;
+    return mask;
+}
+
+void bitmapSetRange(Bitmap *map, size_t start, size_t count) {
+    size_t end = start + count > map->Bits ? map->Bits : start + count;
+
+    // A word never straddles two regions, so its change counts against one
+    for (size_t bit = start; bit < end; bit = (bit / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS) {
+        uint64_t *word = &map->Words[bit / BITMAP_WORD_BITS];
+        uint64_t taken = rangeMask(bit, end) & ~*word;
+        size_t changed = __builtin_popcountll(taken);
+
+        *word |= taken;
+        map->RegionFree[bit / BITMAP_REGION_BITS] -= changed;
+        map->Free -= changed;
+    }
+}
+
+void bitmapClearRange(Bitmap *map, size_t start, size_t count) {
+    size_t end = start + count > map->Bits ? map->Bits : start + count;
+
+    for (size_t bit = start; bit < end; bit = (bit / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS) {
+        uint64_t *word = &map->Words[bit / BITMAP_WORD_BITS];
+        uint64_t released = rangeMask(bit, end) & *word;
+        size_t changed = __builtin_popcountll(released);
+        if (changed == 0) continue;
+
+        *word &= ~released;
+        map->RegionFree[bit / BITMAP_REGION_BITS] += changed;
+        map->Free += changed;
+    }
+}
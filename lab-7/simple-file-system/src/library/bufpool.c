@@ -0,0 +1,72 @@
+// bufpool.c: Pool of aligned block buffers
+
+#include "sfs/bufpool.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Direct transfers need buffers aligned to the device's logical block size,
+ * which BLOCK_SIZE alignment covers. The pool carves its buffers out of one
+ * aligned allocation and keeps the free ones on a stack, so taking and giving
+ * back a buffer is a push or pop under the pool lock. A pool never makes its
+ * caller wait: once every buffer is out, further buffers are allocated on
+ * their own and freed when given back, which Overflows counts.
+ */
+
+void bufferPoolInit(BufferPool *pool, size_t capacity) {
+    memset(pool, 0, sizeof(BufferPool));
+    pool->Capacity = capacity;
+    if (capacity > 0 && posix_memalign((void **)&pool->Memory, BLOCK_SIZE, capacity * BLOCK_SIZE) != 0) {
+        pool->Memory = NULL;
+        pool->Capacity = 0;
+    }
+    pool->Free = malloc(pool->Capacity * sizeof(char *));
+    for (size_t i = 0; i < pool->Capacity; i++) {
+        pool->Free[pool->Available++] = pool->Memory + (pool->Capacity - 1 - i) * BLOCK_SIZE;
+    }
+    pthread_mutex_init(&pool->Lock, NULL);
+}
+
+void bufferPoolDestroy(BufferPool *pool) {
+    pthread_mutex_destroy(&pool->Lock);
+    free(pool->Free);
+    free(pool->Memory);
+    memset(pool, 0, sizeof(BufferPool));
+}
+
+bool pooledBuffer(BufferPool *pool, char *buffer) {
+    return buffer >= pool->Memory && buffer < pool->Memory + pool->Capacity * BLOCK_SIZE;
+}
+
+char *bufferPoolTake(BufferPool *pool) {
+    char *buffer = NULL;
+    if (pool != NULL) {
+        pthread_mutex_lock(&pool->Lock);
+        pool->Takes++;
+        if (pool->Available > 0)
+            buffer = pool->Free[--pool->Available];
+        else
+            pool->Overflows++;
+        pthread_mutex_unlock(&pool->Lock);
+    }
+
+    if (buffer == NULL && posix_memalign((void **)&buffer, BLOCK_SIZE, BLOCK_SIZE) != 0)
+        return NULL;
+    return buffer;
+}
+
+void bufferPoolGive(BufferPool *pool, char *buffer) {
+    if (pool == NULL || !pooledBuffer(pool, buffer)) {
+        free(buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->Lock);
+    pool->Free[pool->Available++] = buffer;
+    pthread_mutex_unlock(&pool->Lock);
+}
+
+bool bufferAligned(const void *buffer) {
+    return (uintptr_t)buffer % BLOCK_SIZE == 0;
+}
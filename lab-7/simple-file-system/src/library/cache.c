@@ -0,0 +1,422 @@
+// cache.c: Write-back block cache
+
+#include "sfs/cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * The cache is a Disk front end: it exposes the same interface as the disk it
+ * wraps, so the file system talks to it without knowing it is there. Entries
+ * are found through a chained hash table and replaced with the CLOCK
+ * algorithm. Writes only mark the entry dirty; dirty blocks reach the backing
+ * disk when they are evicted or when the cache is flushed.
+ *
+ * The cache lock is held for every synchronous transfer, misses included, so
+ * several threads may share one cache. Asynchronous transfers only hold it
+ * while they deal with cached blocks and hand their misses to the backing
+ * disk after letting go of it, so bulk data moves in parallel.
+ */
+
+BlockCache *cacheOf(Disk *self) {
+    return (BlockCache *)self->Private;
+}
+
+int lookupEntry(BlockCache *cache, int blocknum) {
+    int idx = cache->Heads[blocknum % cache->Buckets];
+    while (idx != CACHE_EMPTY) {
+        if (cache->Entries[idx].Block == blocknum) return idx;
+        idx = cache->Entries[idx].Next;
+    }
+    return CACHE_EMPTY;
+}
+
+void unlinkEntry(BlockCache *cache, int idx) {
+    int *link = &cache->Heads[cache->Entries[idx].Block % cache->Buckets];
+    while (*link != CACHE_EMPTY) {
+        if (*link == idx) {
+            *link = cache->Entries[idx].Next;
+            break;
+        }
+        link = &cache->Entries[*link].Next;
+    }
+    cache->Entries[idx].Block = CACHE_EMPTY;
+    cache->Entries[idx].Next = CACHE_EMPTY;
+}
+
+void writeBackEntry(BlockCache *cache, int idx) {
+    CacheEntry *entry = &cache->Entries[idx];
+    if (!entry->Dirty) return;
+
+    cache->Backing->writeDisk(cache->Backing, entry->Block, entry->Data);
+    entry->Dirty = false;
+    cache->WriteBacks++;
+}
+
+/**
+ * @brief Find an entry for "blocknum" using the CLOCK algorithm. A dirty
+ * victim is written back before it is reused.
+ *
+ * @param cache block cache
+ * @param blocknum block number the entry will hold
+ * @return int index of the claimed entry
+ */
+int claimEntry(BlockCache *cache, int blocknum) {
+    int idx;
+    while (true) {
+        idx = cache->Hand;
+        cache->Hand = (cache->Hand + 1) % cache->Capacity;
+
+        CacheEntry *entry = &cache->Entries[idx];
+        if (entry->Block == CACHE_EMPTY) break;
+
+        if (entry->Referenced) {
+            entry->Referenced = false;
+            continue;
+        }
+
+        writeBackEntry(cache, idx);
+        unlinkEntry(cache, idx);
+        cache->Evictions++;
+        break;
+    }
+
+    CacheEntry *entry = &cache->Entries[idx];
+    size_t bucket = blocknum % cache->Buckets;
+    entry->Block = blocknum;
+    entry->Next = cache->Heads[bucket];
+    entry->Dirty = false;
+    entry->Referenced = true;
+    cache->Heads[bucket] = idx;
+
+    return idx;
+}
+
+int compareBlocks(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+void flushCache(Disk *self) {
+    BlockCache *cache = cacheOf(self);
+    pthread_mutex_lock(&cache->Lock);
+
+    // Write dirty blocks back in ascending block order
+    int *dirty = malloc(cache->Capacity * sizeof(int));
+    size_t ndirty = 0;
+    for (size_t i = 0; i < cache->Capacity; i++) {
+        if (cache->Entries[i].Block != CACHE_EMPTY && cache->Entries[i].Dirty)
+            dirty[ndirty++] = cache->Entries[i].Block;
+    }
+    qsort(dirty, ndirty, sizeof(int), compareBlocks);
+
+    // Consecutive dirty blocks go back in one vectored write
+    struct iovec *iov = malloc(MAX_RUN_BLOCKS * sizeof(struct iovec));
+    size_t start = 0;
+    while (start < ndirty) {
+        size_t end = start + 1;
+        while (end < ndirty && end - start < MAX_RUN_BLOCKS &&
+               dirty[end] == dirty[end - 1] + 1) {
+            end++;
+        }
+
+        for (size_t i = start; i < end; i++) {
+            CacheEntry *entry = &cache->Entries[lookupEntry(cache, dirty[i])];
+            iov[i - start].iov_base = entry->Data;
+            iov[i - start].iov_len = BLOCK_SIZE;
+            entry->Dirty = false;
+        }
+        cache->Backing->writeBlocks(cache->Backing, dirty[start], iov, end - start);
+        cache->WriteBacks += end - start;
+
+        start = end;
+    }
+    free(iov);
+    free(dirty);
+    pthread_mutex_unlock(&cache->Lock);
+
+    cache->Backing->flush(cache->Backing);
+}
+
+void invalidateCache(BlockCache *cache) {
+    for (size_t i = 0; i < cache->Buckets; i++) {
+        cache->Heads[i] = CACHE_EMPTY;
+    }
+    for (size_t i = 0; i < cache->Capacity; i++) {
+        cache->Entries[i].Block = CACHE_EMPTY;
+        cache->Entries[i].Next = CACHE_EMPTY;
+        cache->Entries[i].Dirty = false;
+        cache->Entries[i].Referenced = false;
+    }
+    cache->Hand = 0;
+}
+
+void openCache(Disk *self, const char *path, size_t nblocks) {
+    BlockCache *cache = cacheOf(self);
+
+    flushCache(self);
+    pthread_mutex_lock(&cache->Lock);
+    invalidateCache(cache);
+    pthread_mutex_unlock(&cache->Lock);
+
+    cache->Backing->open(cache->Backing, path, nblocks);
+    self->Blocks = cache->Backing->Blocks;
+    self->Reads = 0;
+    self->Writes = 0;
+}
+
+void CacheDestructor(Disk *self) {
+    BlockCache *cache = cacheOf(self);
+    if (cache == NULL) return;
+
+    flushCache(self);
+    cache->Backing->DiskDestructor(cache->Backing);
+
+    pthread_mutex_destroy(&cache->Lock);
+    free(cache->Heads);
+    free(cache->Entries);
+    free(cache->Memory);
+    free(cache);
+    self->Private = NULL;
+}
+
+void sanityCheckCache(Disk *self, int blocknum, char *data) {
+    BlockCache *cache = cacheOf(self);
+    cache->Backing->sanity_check(cache->Backing, blocknum, data);
+}
+
+void readCache(Disk *self, int blocknum, char *data) {
+    BlockCache *cache = cacheOf(self);
+    sanityCheckCache(self, blocknum, data);
+
+    pthread_mutex_lock(&cache->Lock);
+    int idx = lookupEntry(cache, blocknum);
+    if (idx != CACHE_EMPTY) {
+        cache->Hits++;
+        cache->Entries[idx].Referenced = true;
+    } else {
+        cache->Misses++;
+        idx = claimEntry(cache, blocknum);
+        cache->Backing->readDisk(cache->Backing, blocknum,
+                                 cache->Entries[idx].Data);
+    }
+
+    memcpy(data, cache->Entries[idx].Data, BLOCK_SIZE);
+    self->Reads++;
+    pthread_mutex_unlock(&cache->Lock);
+}
+
+void writeCache(Disk *self, int blocknum, char *data) {
+    BlockCache *cache = cacheOf(self);
+    sanityCheckCache(self, blocknum, data);
+
+    // Whole blocks are written, so a miss never needs to read the old contents
+    pthread_mutex_lock(&cache->Lock);
+    int idx = lookupEntry(cache, blocknum);
+    if (idx != CACHE_EMPTY) {
+        cache->Hits++;
+        cache->Entries[idx].Referenced = true;
+    } else {
+        cache->Misses++;
+        idx = claimEntry(cache, blocknum);
+    }
+
+    memcpy(cache->Entries[idx].Data, data, BLOCK_SIZE);
+    cache->Entries[idx].Dirty = true;
+    self->Writes++;
+    pthread_mutex_unlock(&cache->Lock);
+}
+
+/**
+ * @brief Serve the cached blocks of a transfer and collect the runs of
+ * uncached blocks, as pairs of first block index and length. Called with the
+ * cache lock held.
+ *
+ * @return int number of ints stored in "runs" (room for count + 1 needed)
+ */
+int serveCached(Disk *self, int blocknum, struct iovec *iov, int count, bool isWrite, int *runs) {
+    BlockCache *cache = cacheOf(self);
+    int nruns = 0;
+    int run = 0;
+    for (int i = 0; i <= count; i++) {
+        int idx = i < count ? lookupEntry(cache, blocknum + i) : CACHE_EMPTY;
+
+        if (i < count && idx == CACHE_EMPTY) {
+            cache->Misses++;
+            continue;
+        }
+
+        // Remember the run of misses that ends here for the backing disk
+        if (i > run) {
+            runs[nruns++] = run;
+            runs[nruns++] = i - run;
+        }
+        run = i + 1;
+        if (i == count) break;
+
+        cache->Hits++;
+        cache->Entries[idx].Referenced = true;
+        if (isWrite) {
+            memcpy(cache->Entries[idx].Data, iov[i].iov_base, BLOCK_SIZE);
+            cache->Entries[idx].Dirty = true;
+        } else {
+            memcpy(iov[i].iov_base, cache->Entries[idx].Data, BLOCK_SIZE);
+        }
+    }
+
+    if (isWrite)
+        self->Writes += count;
+    else
+        self->Reads += count;
+    return nruns;
+}
+
+/**
+ * Runs of blocks are served like asynchronous transfers below, but the lock
+ * is held until the backing disk is done, as for single blocks: each run of
+ * uncached blocks is one vectored transfer straight between the caller's
+ * buffers and the backing disk. Blocks read that way are then cached, as
+ * readCache would have, since runs are mostly metadata read at mount.
+ */
+void transferCacheBlocks(Disk *self, int blocknum, struct iovec *iov, int count, bool isWrite) {
+    BlockCache *cache = cacheOf(self);
+
+    sanityCheckCache(self, blocknum, iov[0].iov_base);
+    sanityCheckCache(self, blocknum + count - 1, iov[count - 1].iov_base);
+
+    int *runs = malloc((count + 1) * sizeof(int));
+    pthread_mutex_lock(&cache->Lock);
+    int nruns = serveCached(self, blocknum, iov, count, isWrite, runs);
+    for (int r = 0; r < nruns; r += 2) {
+        if (isWrite) {
+            cache->Backing->writeBlocks(cache->Backing, blocknum + runs[r], iov + runs[r], runs[r + 1]);
+            continue;
+        }
+
+        cache->Backing->readBlocks(cache->Backing, blocknum + runs[r], iov + runs[r], runs[r + 1]);
+        for (int i = runs[r]; i < runs[r] + runs[r + 1]; i++) {
+            int idx = claimEntry(cache, blocknum + i);
+            memcpy(cache->Entries[idx].Data, iov[i].iov_base, BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&cache->Lock);
+    free(runs);
+}
+
+void readCacheBlocks(Disk *self, int blocknum, struct iovec *iov, int count) {
+    transferCacheBlocks(self, blocknum, iov, count, false);
+}
+
+void writeCacheBlocks(Disk *self, int blocknum, struct iovec *iov, int count) {
+    transferCacheBlocks(self, blocknum, iov, count, true);
+}
+
+/**
+ * Asynchronous transfers carry bulk file data. Blocks that are already cached
+ * are served or updated in place; every run of uncached blocks goes straight
+ * to the backing disk as one request, so streaming a large file does not push
+ * the file system metadata out of the cache. The ticket is that of the last
+ * backing request, or 0 when every block was served from the cache.
+ */
+ssize_t transferCacheAsync(Disk *self, int blocknum, struct iovec *iov, int count, bool isWrite) {
+    BlockCache *cache = cacheOf(self);
+    ssize_t ticket = 0;
+
+    sanityCheckCache(self, blocknum, iov[0].iov_base);
+    sanityCheckCache(self, blocknum + count - 1, iov[count - 1].iov_base);
+
+    // Runs of misses, as pairs of first block index and length
+    int *runs = malloc((count + 1) * sizeof(int));
+    pthread_mutex_lock(&cache->Lock);
+    int nruns = serveCached(self, blocknum, iov, count, isWrite, runs);
+    pthread_mutex_unlock(&cache->Lock);
+
+    for (int r = 0; r < nruns; r += 2) {
+        if (isWrite)
+            ticket = cache->Backing->writeDiskAsync(cache->Backing, blocknum + runs[r], iov + runs[r], runs[r + 1]);
+        else
+            ticket = cache->Backing->readDiskAsync(cache->Backing, blocknum + runs[r], iov + runs[r], runs[r + 1]);
+    }
+    free(runs);
+
+    return ticket;
+}
+
+ssize_t readCacheAsync(Disk *self, int blocknum, struct iovec *iov, int count) {
+    return transferCacheAsync(self, blocknum, iov, count, false);
+}
+
+ssize_t writeCacheAsync(Disk *self, int blocknum, struct iovec *iov, int count) {
+    return transferCacheAsync(self, blocknum, iov, count, true);
+}
+
+void waitCache(Disk *self, ssize_t ticket) {
+    BlockCache *cache = cacheOf(self);
+    cache->Backing->waitDisk(cache->Backing, ticket);
+}
+
+Disk *concurrentCache(Disk *self) {
+    BlockCache *cache = cacheOf(self);
+    return cache->Backing->concurrent(cache->Backing);
+}
+
+size_t sizeCache(Disk *self) {
+    BlockCache *cache = cacheOf(self);
+    return cache->Backing->size(cache->Backing);
+}
+
+bool mountedCache(Disk *self) {
+    return self->Mounts > 0;
+}
+
+void mountCache(Disk *self) {
+    self->Mounts = self->Mounts + 1;
+}
+
+void unmountCache(Disk *self) {
+    if (self->Mounts > 0)
+        self->Mounts = self->Mounts - 1;
+}
+
+void CacheDiskConstructor(Disk *self, Disk *backing, size_t capacity) {
+    if (capacity == 0) capacity = 1;
+
+    BlockCache *cache = calloc(1, sizeof(BlockCache));
+    cache->Backing = backing;
+    cache->Capacity = capacity;
+    cache->Buckets = 2 * capacity;
+    cache->Heads = malloc(cache->Buckets * sizeof(int));
+    cache->Entries = calloc(capacity, sizeof(CacheEntry));
+    // Aligned, so misses and write-backs can go straight to a direct disk
+    if (posix_memalign((void **)&cache->Memory, BLOCK_SIZE, capacity * BLOCK_SIZE) != 0)
+        cache->Memory = NULL;
+    for (size_t i = 0; i < capacity; i++) {
+        cache->Entries[i].Data = cache->Memory + i * BLOCK_SIZE;
+    }
+    invalidateCache(cache);
+    pthread_mutex_init(&cache->Lock, NULL);
+
+    self->FileDescriptor = 0;
+    self->Blocks = backing->Blocks;
+    self->Reads = 0;
+    self->Writes = 0;
+    self->Mounts = 0;
+    self->Private = cache;
+    self->Buffers = backing->Buffers;
+
+    self->sanity_check = sanityCheckCache;
+    self->DiskDestructor = CacheDestructor;
+    self->open = openCache;
+    self->size = sizeCache;
+    self->mounted = mountedCache;
+    self->mount = mountCache;
+    self->unmount = unmountCache;
+    self->readDisk = readCache;
+    self->writeDisk = writeCache;
+    self->flush = flushCache;
+    self->readBlocks = readCacheBlocks;
+    self->writeBlocks = writeCacheBlocks;
+    self->readDiskAsync = readCacheAsync;
+    self->writeDiskAsync = writeCacheAsync;
+    self->waitDisk = waitCache;
+    self->concurrent = concurrentCache;
+}
@@ -1,5 +1,9 @@
 // disk.cpp: disk emulator
 
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include "sfs/bufpool.h"
 #include "sfs/disk.h"
 #include "sfs/fs.h"
 
@@ -13,6 +17,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <sys/mman.h>
 
 char signal_msg[256];
 char what[256];
@@ -23,46 +28,38 @@ void handle_sigint(int sig)
     exit(0);
 }
 
-int Reads = 0;
-int Writes = 0;
-size_t Blocks;
-int FileDescriptor;
-
 void openDisk(struct Disk *self, const char *path, size_t nblocks)
 {
-    FileDescriptor = open(path, O_RDWR | O_CREAT, 0600);
-    if (FileDescriptor < 0)
+    self->FileDescriptor = open(path, O_RDWR | O_CREAT, 0600);
+    if (self->FileDescriptor < 0)
     {
-        snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
+        snprintf(what, sizeof(what), "Unable to open %s: %s", path, strerror(errno));
         strcpy(signal_msg, "ERROR: unable to open the disk.\0");
         signal(SIGINT, handle_sigint);
         raise(SIGINT);
     }
 
-    if (ftruncate(FileDescriptor, nblocks * BLOCK_SIZE) < 0)
+    if (ftruncate(self->FileDescriptor, nblocks * BLOCK_SIZE) < 0)
     {
-        snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
+        snprintf(what, sizeof(what), "Unable to open %s: %s", path, strerror(errno));
         strcpy(signal_msg, "ERROR: unable to open the disk.\0");
         signal(SIGINT, handle_sigint);
         raise(SIGINT);
     }
 
     self->Blocks = nblocks;
-    Blocks = nblocks;
     self->Reads = 0;
     self->Writes = 0;
-    Reads = 0;
-    Writes = 0;
 }
 
 void DiskDestructor(struct Disk *self)
 {
-    if (FileDescriptor > 0)
+    if (self->FileDescriptor > 0)
     {
-        printf("%d disk block reads\n", Reads);
-        printf("%d disk block writes\n", Writes);
-        close(FileDescriptor);
-        FileDescriptor = 0;
+        printf("%zu disk block reads\n", self->Reads);
+        printf("%zu disk block writes\n", self->Writes);
+        close(self->FileDescriptor);
+        self->FileDescriptor = 0;
     }
 }
 
@@ -70,7 +67,7 @@ void sanity_check(struct Disk *self, int blocknum, char *data)
 {
     if (blocknum < 0)
     {
-        snprintf(what, BUFSIZ, "blocknum (%d) is negative!", blocknum);
+        snprintf(what, sizeof(what), "blocknum (%d) is negative!", blocknum);
         strcpy(signal_msg, "ERROR: blocknum is negative.\0");
         signal(SIGINT, handle_sigint);
         raise(SIGINT);
@@ -78,7 +75,7 @@ void sanity_check(struct Disk *self, int blocknum, char *data)
 
     if (blocknum >= (int)self->Blocks)
     {
-        snprintf(what, BUFSIZ, "blocknum (%d) is too big!", blocknum);
+        snprintf(what, sizeof(what), "blocknum (%d) is too big!", blocknum);
         strcpy(signal_msg, "ERROR: blocknum is too big!.\0");
         signal(SIGINT, handle_sigint);
         raise(SIGINT);
@@ -86,59 +83,126 @@ void sanity_check(struct Disk *self, int blocknum, char *data)
 
     if (data == NULL)
     {
-        snprintf(what, BUFSIZ, "null data pointer!");
+        snprintf(what, sizeof(what), "null data pointer!");
         strcpy(signal_msg, "ERROR: null data pointer.\0");
         signal(SIGINT, handle_sigint);
         raise(SIGINT);
     }
 }
 
+/**
+ * Transfers use pread/pwrite at the block offset, so no file position is
+ * shared between callers and several threads may read the same disk at once.
+ * The counters are bumped atomically for the same reason.
+ */
 void readDisk(struct Disk *self, int blocknum, char *data)
 {
     sanity_check(self, blocknum, data);
-    if (lseek(FileDescriptor, blocknum * BLOCK_SIZE, SEEK_SET) < 0)
-    {
-        snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-        strcpy(signal_msg, "ERROR: unable to lseek blocknum.\0");
-        signal(SIGINT, handle_sigint);
-    }
 
-    if (read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE)
+    if (pread(self->FileDescriptor, data, BLOCK_SIZE, (off_t)blocknum * BLOCK_SIZE) != BLOCK_SIZE)
     {
-        snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
+        snprintf(what, sizeof(what), "Unable to read %d: %s", blocknum, strerror(errno));
         strcpy(signal_msg, "ERROR: unable to read blocknum.\0");
         signal(SIGINT, handle_sigint);
         raise(SIGINT);
     }
 
-    Reads = Reads + 1;
+    __atomic_fetch_add(&self->Reads, 1, __ATOMIC_RELAXED);
 }
 
 void writeDisk(struct Disk *self, int blocknum, char *data)
 {
     sanity_check(self, blocknum, data);
-    if (lseek(FileDescriptor, blocknum * BLOCK_SIZE, SEEK_SET) < 0)
+
+    if (pwrite(self->FileDescriptor, data, BLOCK_SIZE, (off_t)blocknum * BLOCK_SIZE) != BLOCK_SIZE)
+    {
+        snprintf(what, sizeof(what), "Unable to write %d: %s", blocknum, strerror(errno));
+        strcpy(signal_msg, "ERROR: unable to write blocknum.\0");
+        signal(SIGINT, handle_sigint);
+        raise(SIGINT);
+    }
+
+    __atomic_fetch_add(&self->Writes, 1, __ATOMIC_RELAXED);
+}
+
+void flushDisk(struct Disk *self)
+{
+    if (self->FileDescriptor > 0)
+        fdatasync(self->FileDescriptor);
+}
+
+void sanity_check_run(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    if (count <= 0 || count > MAX_RUN_BLOCKS)
     {
-        snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-        strcpy(signal_msg, "ERROR: unable to lseek blocknum.\0");
+        snprintf(what, sizeof(what), "block count (%d) is out of range!", count);
+        strcpy(signal_msg, "ERROR: block count is out of range.\0");
         signal(SIGINT, handle_sigint);
         raise(SIGINT);
     }
 
-    if (write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE)
+    sanity_check(self, blocknum, iov[0].iov_base);
+    sanity_check(self, blocknum + count - 1, iov[count - 1].iov_base);
+}
+
+/**
+ * A run of consecutive blocks moves with a single preadv/pwritev. The
+ * counters still count blocks, so they stay comparable with readDisk and
+ * writeDisk.
+ */
+void readBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    sanity_check_run(self, blocknum, iov, count);
+
+    if (preadv(self->FileDescriptor, iov, count, (off_t)blocknum * BLOCK_SIZE) != (ssize_t)count * BLOCK_SIZE)
     {
-        snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
+        snprintf(what, sizeof(what), "Unable to read %d: %s", blocknum, strerror(errno));
+        strcpy(signal_msg, "ERROR: unable to read blocknum.\0");
+        signal(SIGINT, handle_sigint);
+        raise(SIGINT);
+    }
+
+    __atomic_fetch_add(&self->Reads, count, __ATOMIC_RELAXED);
+}
+
+void writeBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    sanity_check_run(self, blocknum, iov, count);
+
+    if (pwritev(self->FileDescriptor, iov, count, (off_t)blocknum * BLOCK_SIZE) != (ssize_t)count * BLOCK_SIZE)
+    {
+        snprintf(what, sizeof(what), "Unable to write %d: %s", blocknum, strerror(errno));
         strcpy(signal_msg, "ERROR: unable to write blocknum.\0");
         signal(SIGINT, handle_sigint);
         raise(SIGINT);
     }
 
-    Writes = Writes + 1;
+    __atomic_fetch_add(&self->Writes, count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Backends without an asynchronous interface complete every request before
+ * returning its ticket, so there is never anything to wait for.
+ */
+ssize_t readDiskAsync(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    self->readBlocks(self, blocknum, iov, count);
+    return 0;
+}
+
+ssize_t writeDiskAsync(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    self->writeBlocks(self, blocknum, iov, count);
+    return 0;
+}
+
+void waitDisk(struct Disk *self, ssize_t ticket)
+{
 }
 
 size_t size(struct Disk *self)
 {
-    return Blocks;
+    return self->Blocks;
 }
 
 bool mountedDisk(struct Disk *self)
@@ -156,3 +220,420 @@ void unmountDisk(struct Disk *self)
     if (self->Mounts > 0)
         self->Mounts = self->Mounts - 1;
 }
+
+// pread and pwrite need no shared state, so any number of threads may use them
+struct Disk *concurrentDisk(struct Disk *self)
+{
+    return self;
+}
+
+void DiskConstructor(struct Disk *self)
+{
+    self->FileDescriptor = 0;
+    self->Blocks = 0;
+    self->Reads = 0;
+    self->Writes = 0;
+    self->Mounts = 0;
+    self->Private = NULL;
+    self->Buffers = NULL;
+
+    self->sanity_check = sanity_check;
+    self->DiskDestructor = DiskDestructor;
+    self->open = openDisk;
+    self->size = size;
+    self->mounted = mountedDisk;
+    self->mount = mountDisk;
+    self->unmount = unmountDisk;
+    self->readDisk = readDisk;
+    self->writeDisk = writeDisk;
+    self->flush = flushDisk;
+    self->readBlocks = readBlocks;
+    self->writeBlocks = writeBlocks;
+    self->readDiskAsync = readDiskAsync;
+    self->writeDiskAsync = writeDiskAsync;
+    self->waitDisk = waitDisk;
+    self->concurrent = concurrentDisk;
+}
+
+// Memory mapped disk ----------------------------------------------------------
+
+/**
+ * The whole image is mapped with mmap, so a block transfer is a memcpy on the
+ * mapping and costs no system call. Dirty pages reach the image file when the
+ * kernel writes them back or at the explicit msync in flush.
+ */
+void openMmapDisk(struct Disk *self, const char *path, size_t nblocks)
+{
+    openDisk(self, path, nblocks);
+
+    self->Private = NULL;
+    if (nblocks == 0)
+        return;
+
+    void *mapping = mmap(NULL, nblocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, self->FileDescriptor, 0);
+    if (mapping == MAP_FAILED)
+    {
+        snprintf(what, sizeof(what), "Unable to mmap %s: %s", path, strerror(errno));
+        strcpy(signal_msg, "ERROR: unable to map the disk.\0");
+        signal(SIGINT, handle_sigint);
+        raise(SIGINT);
+    }
+
+    self->Private = mapping;
+}
+
+void MmapDiskDestructor(struct Disk *self)
+{
+    if (self->Private != NULL)
+    {
+        msync(self->Private, self->Blocks * BLOCK_SIZE, MS_SYNC);
+        munmap(self->Private, self->Blocks * BLOCK_SIZE);
+        self->Private = NULL;
+    }
+
+    DiskDestructor(self);
+}
+
+void readMmapDisk(struct Disk *self, int blocknum, char *data)
+{
+    sanity_check(self, blocknum, data);
+
+    memcpy(data, (char *)self->Private + (size_t)blocknum * BLOCK_SIZE, BLOCK_SIZE);
+
+    __atomic_fetch_add(&self->Reads, 1, __ATOMIC_RELAXED);
+}
+
+void writeMmapDisk(struct Disk *self, int blocknum, char *data)
+{
+    sanity_check(self, blocknum, data);
+
+    memcpy((char *)self->Private + (size_t)blocknum * BLOCK_SIZE, data, BLOCK_SIZE);
+
+    __atomic_fetch_add(&self->Writes, 1, __ATOMIC_RELAXED);
+}
+
+void readMmapBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    sanity_check_run(self, blocknum, iov, count);
+
+    char *start = (char *)self->Private + (size_t)blocknum * BLOCK_SIZE;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(iov[i].iov_base, start + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+
+    __atomic_fetch_add(&self->Reads, count, __ATOMIC_RELAXED);
+}
+
+void writeMmapBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    sanity_check_run(self, blocknum, iov, count);
+
+    char *start = (char *)self->Private + (size_t)blocknum * BLOCK_SIZE;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(start + (size_t)i * BLOCK_SIZE, iov[i].iov_base, BLOCK_SIZE);
+    }
+
+    __atomic_fetch_add(&self->Writes, count, __ATOMIC_RELAXED);
+}
+
+void flushMmapDisk(struct Disk *self)
+{
+    if (self->Private != NULL)
+        msync(self->Private, self->Blocks * BLOCK_SIZE, MS_SYNC);
+}
+
+void MmapDiskConstructor(struct Disk *self)
+{
+    DiskConstructor(self);
+
+    self->DiskDestructor = MmapDiskDestructor;
+    self->open = openMmapDisk;
+    self->readDisk = readMmapDisk;
+    self->writeDisk = writeMmapDisk;
+    self->readBlocks = readMmapBlocks;
+    self->writeBlocks = writeMmapBlocks;
+    self->flush = flushMmapDisk;
+}
+
+// Direct disk ----------------------------------------------------------------
+
+/**
+ * The image is opened with O_DIRECT, so blocks move between the image and
+ * the caller's buffer without a copy in the host page cache, and the block
+ * cache is the only place blocks are kept. O_DIRECT needs aligned buffers: the
+ * disk owns a pool of them, which front ends pass on and the file system takes
+ * its data buffers from. A transfer from any other buffer goes through a pool
+ * buffer. Where the image's file system cannot do O_DIRECT, the image is used
+ * through the page cache as before.
+ */
+void openDirectDisk(struct Disk *self, const char *path, size_t nblocks)
+{
+    openDisk(self, path, nblocks);
+
+    int flags = fcntl(self->FileDescriptor, F_GETFL);
+    if (flags < 0 || fcntl(self->FileDescriptor, F_SETFL, flags | O_DIRECT) < 0)
+        fprintf(stderr, "Unable to use O_DIRECT on %s: %s\n", path, strerror(errno));
+}
+
+void DirectDiskDestructor(struct Disk *self)
+{
+    DiskDestructor(self);
+
+    if (self->Buffers != NULL)
+    {
+        bufferPoolDestroy(self->Buffers);
+        free(self->Buffers);
+        self->Buffers = NULL;
+    }
+}
+
+void readDirectDisk(struct Disk *self, int blocknum, char *data)
+{
+    if (bufferAligned(data))
+    {
+        readDisk(self, blocknum, data);
+        return;
+    }
+
+    char *bounce = bufferPoolTake(self->Buffers);
+    readDisk(self, blocknum, bounce);
+    memcpy(data, bounce, BLOCK_SIZE);
+    bufferPoolGive(self->Buffers, bounce);
+}
+
+void writeDirectDisk(struct Disk *self, int blocknum, char *data)
+{
+    if (bufferAligned(data))
+    {
+        writeDisk(self, blocknum, data);
+        return;
+    }
+
+    char *bounce = bufferPoolTake(self->Buffers);
+    memcpy(bounce, data, BLOCK_SIZE);
+    writeDisk(self, blocknum, bounce);
+    bufferPoolGive(self->Buffers, bounce);
+}
+
+// Return a copy of "iov" with every unaligned buffer swapped for a pool
+// buffer, filled from the original when "isWrite"; NULL if all are aligned
+struct iovec *bounceVector(struct Disk *self, struct iovec *iov, int count, bool isWrite)
+{
+    int i = 0;
+    while (i < count && bufferAligned(iov[i].iov_base))
+        i++;
+    if (i >= count)
+        return NULL;
+
+    struct iovec *bounced = malloc(count * sizeof(struct iovec));
+    memcpy(bounced, iov, count * sizeof(struct iovec));
+    for (; i < count; i++)
+    {
+        if (bufferAligned(iov[i].iov_base))
+            continue;
+        bounced[i].iov_base = bufferPoolTake(self->Buffers);
+        if (isWrite)
+            memcpy(bounced[i].iov_base, iov[i].iov_base, BLOCK_SIZE);
+    }
+    return bounced;
+}
+
+// Give back the pool buffers of a bounce vector, copied out first unless "isWrite"
+void releaseBounceVector(struct Disk *self, struct iovec *iov, struct iovec *bounced, int count, bool isWrite)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (bounced[i].iov_base == iov[i].iov_base)
+            continue;
+        if (!isWrite)
+            memcpy(iov[i].iov_base, bounced[i].iov_base, BLOCK_SIZE);
+        bufferPoolGive(self->Buffers, bounced[i].iov_base);
+    }
+    free(bounced);
+}
+
+void readDirectBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    sanity_check_run(self, blocknum, iov, count);
+
+    struct iovec *bounced = bounceVector(self, iov, count, false);
+    readBlocks(self, blocknum, bounced != NULL ? bounced : iov, count);
+    if (bounced != NULL)
+        releaseBounceVector(self, iov, bounced, count, false);
+}
+
+void writeDirectBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count)
+{
+    sanity_check_run(self, blocknum, iov, count);
+
+    struct iovec *bounced = bounceVector(self, iov, count, true);
+    writeBlocks(self, blocknum, bounced != NULL ? bounced : iov, count);
+    if (bounced != NULL)
+        releaseBounceVector(self, iov, bounced, count, true);
+}
+
+void DirectDiskConstructor(struct Disk *self)
+{
+    DiskConstructor(self);
+
+    self->Buffers = malloc(sizeof(BufferPool));
+    bufferPoolInit(self->Buffers, BUFFER_POOL_DEFAULT_BUFFERS);
+
+    self->DiskDestructor = DirectDiskDestructor;
+    self->open = openDirectDisk;
+    self->readDisk = readDirectDisk;
+    self->writeDisk = writeDirectDisk;
+    self->readBlocks = readDirectBlocks;
+    self->writeBlocks = writeDirectBlocks;
+}
+
+// Memory disk ----------------------------------------------------------------
+
+/**
+ * The blocks live in an anonymous mapping that nothing writes back, so a
+ * transfer is a memcpy and the host's disks and page cache are never touched.
+ * The block transfers are those of the mapped disk. The mapping is rounded up
+ * to whole huge pages; pages that are never written are never faulted in, so
+ * that costs no memory. With huge pages, the mapping comes from the hugetlb
+ * pool when it has room and is otherwise left to transparent huge pages.
+ */
+size_t memoryDiskLength(size_t nblocks)
+{
+    size_t length = nblocks * BLOCK_SIZE;
+    return (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+void mapMemoryDisk(struct Disk *self, const char *path, size_t nblocks, bool hugePages)
+{
+    self->Blocks = nblocks;
+    self->Reads = 0;
+    self->Writes = 0;
+    self->Private = NULL;
+    if (nblocks == 0)
+        return;
+
+    size_t length = memoryDiskLength(nblocks);
+    void *memory = MAP_FAILED;
+    if (hugePages)
+        memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED && hugePages)
+            madvise(memory, length, MADV_HUGEPAGE);
+    }
+    if (memory == MAP_FAILED)
+    {
+        snprintf(what, sizeof(what), "Unable to allocate %zu blocks: %s", nblocks, strerror(errno));
+        strcpy(signal_msg, "ERROR: unable to allocate the disk.\0");
+        signal(SIGINT, handle_sigint);
+        raise(SIGINT);
+    }
+
+    self->Private = memory;
+
+    // Start from the image file when there is one, a missing file is a blank disk
+    if (path != NULL && access(path, F_OK) == 0 && !loadMemoryDisk(self, path))
+    {
+        snprintf(what, sizeof(what), "Unable to load %s: %s", path, strerror(errno));
+        strcpy(signal_msg, "ERROR: unable to load the disk.\0");
+        signal(SIGINT, handle_sigint);
+        raise(SIGINT);
+    }
+}
+
+void openMemoryDisk(struct Disk *self, const char *path, size_t nblocks)
+{
+    mapMemoryDisk(self, path, nblocks, false);
+}
+
+void openHugeMemoryDisk(struct Disk *self, const char *path, size_t nblocks)
+{
+    mapMemoryDisk(self, path, nblocks, true);
+}
+
+void MemoryDiskDestructor(struct Disk *self)
+{
+    if (self->Private != NULL)
+    {
+        printf("%zu disk block reads\n", self->Reads);
+        printf("%zu disk block writes\n", self->Writes);
+        munmap(self->Private, memoryDiskLength(self->Blocks));
+        self->Private = NULL;
+    }
+}
+
+bool loadMemoryDisk(struct Disk *self, const char *path)
+{
+    if (self->DiskDestructor != MemoryDiskDestructor || self->Private == NULL)
+        return false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    // An image shorter than the disk leaves the blocks past its end as they are
+    size_t length = self->Blocks * BLOCK_SIZE;
+    size_t loaded = 0;
+    while (loaded < length)
+    {
+        ssize_t result = pread(fd, (char *)self->Private + loaded, length - loaded, loaded);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0)
+        {
+            close(fd);
+            return false;
+        }
+        if (result == 0)
+            break;
+        loaded += result;
+    }
+
+    close(fd);
+    return true;
+}
+
+bool saveMemoryDisk(struct Disk *self, const char *path)
+{
+    if (self->DiskDestructor != MemoryDiskDestructor || self->Private == NULL)
+        return false;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return false;
+
+    size_t length = self->Blocks * BLOCK_SIZE;
+    size_t saved = 0;
+    while (saved < length)
+    {
+        ssize_t result = pwrite(fd, (char *)self->Private + saved, length - saved, saved);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+        {
+            close(fd);
+            return false;
+        }
+        saved += result;
+    }
+
+    bool synced = fdatasync(fd) == 0;
+    return close(fd) == 0 && synced;
+}
+
+void MemoryDiskConstructor(struct Disk *self, bool hugePages)
+{
+    DiskConstructor(self);
+
+    self->DiskDestructor = MemoryDiskDestructor;
+    self->open = hugePages ? openHugeMemoryDisk : openMemoryDisk;
+    self->readDisk = readMmapDisk;
+    self->writeDisk = writeMmapDisk;
+    self->readBlocks = readMmapBlocks;
+    self->writeBlocks = writeMmapBlocks;
+}
@@ -1,164 +1,697 @@
 // fs.cpp: File System
 #include "sfs/fs.h"
+#include "sfs/bitmap.h"
+#include "sfs/bufpool.h"
+#include "sfs/icache.h"
+#include "sfs/mapcache.h"
+#include "sfs/rangetree.h"
 
 // #include <algorithm>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
-ushort *freeblkmap;
-ushort *inodetable;
-Disk *selfDisk;
-Block superBlock;
+// File system state -----------------------------------------------------------
 
 /**
- *  Cache-like implementation for retrieving most recent accessed INODE
+ * Everything a FileSystem instance knows about the image it mounts, and its
+ * settings, live in its FileSystemState, so a process can mount any number
+ * of images at once, each with caches and counters of its own. The public
+ * operations find the state through their FileSystem; every function below
+ * them is handed it as "fs".
  */
-#define CACHE_LEN 3
 
-Inode cached_inodes[CACHE_LEN] = {0};
-size_t cached_inums[CACHE_LEN] = {0};
-
-ushort victim = 0;
-ushort referenceBits[CACHE_LEN] = {0};
-ushort filled = 0;
+#define INODE_LOCKS 1024
+
+typedef struct AllocGroup AllocGroup;
+typedef struct Magazine Magazine;
+typedef struct ReadaheadStream ReadaheadStream;
+typedef struct DelayedFile DelayedFile;
+
+struct FileSystemState {
+    Disk *Disk;                 // Mounted disk (NULL if none)
+    Block SuperBlock;           // Superblock of the mounted disk
+    Bitmap BlockMap;            // Blocks in use
+    RangeTree FreeExtents;      // Free blocks, as extents
+    Bitmap InodeMap;            // Inodes in use
+    InodeCache InodeCache;      // Recently used inodes
+    MapCache MapCache;          // Recently translated file blocks
+
+    // Allocation, see the allocation groups and magazines below
+    AllocGroup *Groups;         // Allocation groups
+    size_t GroupCount;          // Number of allocation groups
+    uint16_t *BlockFreeInodes;  // Free inodes per inode block
+    ssize_t WarmInodeBlock;     // Inode block last read or allocated from
+    size_t ReservedBlocks;      // Free blocks promised to delayed writes
+    pthread_t Flusher;          // Thread flushing delayed writes
+    size_t FlushReserved;       // Part of ReservedBlocks the flushing thread may take
+    Magazine *Magazines;        // Magazine of every thread that wrote
+    pthread_key_t MagazineKey;  // Magazine of the calling thread
+    size_t Refills;             // Number of magazine refills
+
+    // Open files, readahead and delayed allocation, see further down
+    FileHandle *OpenHandles;        // Open handles
+    ReadaheadStream *Streams;       // READAHEAD_STREAMS readahead streams
+    size_t NextStream;              // Stream to take over next
+    DelayedFile *DelayedFiles;      // DELAYED_FILES slots of buffered data
+    size_t NextDelayed;             // Slot to take over next
+    size_t BufferedBlocks;          // Blocks buffered across all slots
+
+    // Settings
+    size_t InodeCacheCapacity;  // Inodes cached (0 for the default)
+    size_t MapCacheExtents;     // Translations cached (0 for the default)
+    size_t MountThreads;        // Threads scanning an unclean image (0 for one per processor)
+    size_t ReadaheadBlocks;     // Largest readahead window
+    bool ExtentInodes;          // Whether or not format writes extent inodes
+    size_t DelayedBlocks;       // Most blocks buffered by delayed allocation
+    size_t MagazineBlocks;      // Blocks kept in a magazine past a run
+
+    // Locks, see the locking section
+    pthread_rwlock_t MountLock;
+    pthread_rwlock_t InodeLocks[INODE_LOCKS];
+    pthread_mutex_t DelayedLock;
+    pthread_mutex_t ReadaheadLock;
+    pthread_mutex_t HandlesLock;
+    pthread_mutex_t MagazinesLock;
+    pthread_mutex_t AllocLock;
+    pthread_mutex_t InodeBlockLock;
+};
+
+// Readahead is handled further down, next to the read path
+void forgetReadahead(FileSystemState *fs, size_t inumber);
+void forgetAllReadahead(FileSystemState *fs);
+
+// Delayed allocation is handled further down, next to the write path
+void flushAllData(FileSystemState *fs);
+void dropInodeData(FileSystemState *fs, size_t inumber);
+bool readLockInode(FileSystemState *fs, size_t inumber);
+
+// Allocation magazines are kept further down, next to the block runs
+void reclaimMagazines(FileSystemState *fs, Magazine *except, size_t idle);
+
+// Extent inodes are handled further down, next to the file handles
+bool usesExtents(FileSystemState *fs);
+bool validExtent(Extent *extent, uint32_t blocks);
+
+// Locking ---------------------------------------------------------------------
 
 /**
- * @brief Stores the instance of valid iNode in "inode" if there is a cache hit
+ * Every operation holds MountLock shared; format, mount, unmount and debug
+ * hold it exclusively, so nothing runs against a disk that is being set up
+ * or torn down. Inodes are guarded by reader/writer locks, shared by the
+ * inode numbers that are equal modulo INODE_LOCKS: reads, stats and opens
+ * share an inode's lock, writes and removes hold it exclusively. Below those,
+ * state shared between inodes has a mutex of its own, taken in this order:
+ *
+ *   DelayedLock     buffered data of delayed allocation
+ *   ReadaheadLock   readahead streams
+ *   HandlesLock     list of open handles
+ *   magazine        the calling thread's allocation magazine
+ *   MagazinesLock   list of every thread's magazine
+ *   AllocLock       block and inode bitmaps, free extents, groups, reservations
+ *   inode cache     (locked inside icache.c, as is the translation cache)
+ *   InodeBlockLock  read-modify-write of inode blocks
  *
- * @param inumber inode number
- * @param inode inode struct to store variable
- * @return bool
+ * The block cache and the disks below it lock themselves. An operation that
+ * needs several inode locks takes them in increasing order, and one that
+ * holds an inode lock only ever tries for another, so no two operations wait
+ * on each other. Magazines of other threads are only ever tried for.
  */
-bool cacheLookup(size_t inumber, Inode *inode) {
-    for (ushort i = 0; i < filled; i++) {
-        if (cached_inums[i] == inumber) {
-            referenceBits[i] = 1;
-            memcpy(inode, &cached_inodes[i], sizeof(Inode));
-            fprintf(stderr, "Cache hit: %lu\n", inumber);
-            return true;
-        }
-    }
 
-    memset(inode, 0, sizeof(Inode));
-    return false;
+pthread_rwlock_t *inodeLock(FileSystemState *fs, size_t inumber) {
+    return &fs->InodeLocks[inumber % INODE_LOCKS];
 }
 
-bool cacheUpdate(size_t inumber, Inode *inode) {
-    // check if exists in cache and update
-    for (ushort i = 0; i < filled; i++) {
-        if (cached_inums[i] == inumber) {
-            referenceBits[i] = 1;
-            memcpy(&cached_inodes[i], inode, sizeof(Inode));
-            return true;
-        }
-    }
+int compareLocks(const void *a, const void *b) {
+    pthread_rwlock_t *x = *(pthread_rwlock_t *const *)a, *y = *(pthread_rwlock_t *const *)b;
+    return x < y ? -1 : x > y;
+}
 
-    // inode fault, not exists.
-    if (filled == CACHE_LEN) {
-        // find victim
-        while (true) {
-            if (referenceBits[victim] == 0) {
-                memcpy(&cached_inodes[victim], inode, sizeof(Inode));
-                cached_inums[victim] = inumber;
-                break;
-            }
-            referenceBits[victim] = 0;
-            victim = (victim + 1) % CACHE_LEN;
-        }
-    } else {
-        memcpy(&cached_inodes[filled], inode, sizeof(Inode));
-        cached_inums[filled] = inumber;
-        filled++;
+// Lock every inode of a list, each lock once and in increasing order
+// @param	held	    Set to the locks taken, room for "count" of them
+// @return	Number of locks taken
+size_t lockInodes(FileSystemState *fs, size_t *inumbers, size_t count, bool exclusive, pthread_rwlock_t **held) {
+    for (size_t i = 0; i < count; i++) held[i] = inodeLock(fs, inumbers[i]);
+    qsort(held, count, sizeof(pthread_rwlock_t *), compareLocks);
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (distinct > 0 && held[distinct - 1] == held[i]) continue;
+        held[distinct] = held[i];
+        if (exclusive)
+            pthread_rwlock_wrlock(held[distinct]);
+        else
+            pthread_rwlock_rdlock(held[distinct]);
+        distinct++;
     }
+    return distinct;
+}
 
-    return true;
+void unlockInodes(pthread_rwlock_t **held, size_t count) {
+    for (size_t i = 0; i < count; i++) pthread_rwlock_unlock(held[i]);
 }
 
-bool hasDiskMounted() {
-    return selfDisk != NULL && selfDisk->mounted(selfDisk);
+bool hasDiskMounted(FileSystemState *fs) {
+    return fs->Disk != NULL && fs->Disk->mounted(fs->Disk);
 }
 
 int gw(int a) { return log10((double)a) + 1; }
 
-void printBitmaps() {
-    if (!hasDiskMounted()) {
+void printBitmaps(FileSystem *self) {
+    FileSystemState *fs = self->State;
+
+    if (!hasDiskMounted(fs)) {
         printf("Must mount disk first.\n");
         return;
     }
 
     int max_;
     printf("\n------------------- Inodes -------------------\n");
-    max_ = gw(superBlock.Super.Inodes) + 1;
-    for (int i = 0; i < superBlock.Super.Inodes; i++) {
+    max_ = gw(fs->SuperBlock.Super.Inodes) + 1;
+    for (int i = 0; i < fs->SuperBlock.Super.Inodes; i++) {
         printf("%d", i);
         if (i > 0) {
             printf("%-*s", max_ - gw(i), " ");
         } else {
             printf("%-*s", max_ - 1, " ");
         }
-        printf("=> %d\n", inodetable[i]);
+        printf("=> %d\n", bitmapTest(&fs->InodeMap, i));
     }
 
     printf("------------------- Blocks -------------------\n");
-    max_ = gw(superBlock.Super.Blocks) + 1;
-    for (int i = 0; i < superBlock.Super.Blocks; i++) {
+    max_ = gw(fs->SuperBlock.Super.Blocks) + 1;
+    for (int i = 0; i < fs->SuperBlock.Super.Blocks; i++) {
         printf("%d", i);
         if (i > 0) {
             printf("%-*s", max_ - gw(i), " ");
         } else {
             printf("%-*s", max_ - 1, " ");
         }
-        printf("=> %d\n", freeblkmap[i]);
+        printf("=> %d\n", bitmapTest(&fs->BlockMap, i));
     }
 }
 
-void initIndirectBlocks(int indirectBlock) {
-    Block indblock;
-    selfDisk->readDisk(selfDisk, indirectBlock, indblock.Data);
-    for (size_t pointer = 0;
-         pointer < POINTERS_PER_BLOCK && pointer < selfDisk->Blocks;
-         pointer++) {
-        if (indblock.Pointers[pointer] != FREE) {
-            freeblkmap[indblock.Pointers[pointer]] = OCCUPIED;
-        }
+// Point one iovec at each BLOCK_SIZE slice of buffer
+struct iovec *blockVector(char *buffer, size_t count) {
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = buffer + i * BLOCK_SIZE;
+        iov[i].iov_len = BLOCK_SIZE;
     }
+    return iov;
 }
 
-bool initFreeBlocks(Inode *inode) {
-    if (inode->Valid == FREE) {
-        return true;
+/**
+ * @brief Take one buffer per block from the disk's buffer pool, so data moves
+ * through buffers a direct disk can transfer as they are.
+ *
+ * @return struct iovec* to hand back with releasePoolVector
+ */
+struct iovec *poolVector(FileSystemState *fs, size_t count) {
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = bufferPoolTake(fs->Disk->Buffers);
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    return iov;
+}
+
+void releasePoolVector(FileSystemState *fs, struct iovec *iov, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        bufferPoolGive(fs->Disk->Buffers, iov[i].iov_base);
+    }
+    free(iov);
+}
+
+// Allocation bitmaps ----------------------------------------------------------
+
+/**
+ * Formatted images keep both allocation bitmaps in the last blocks of the
+ * disk, the block bitmap words followed by the inode bitmap words, so a clean
+ * image mounts by reading just those blocks. The first allocation or free
+ * after mount clears the clean flag on disk and unmount saves the bitmaps
+ * before setting it again. An image that was not unmounted cleanly, or one
+ * formatted before the bitmaps existed, is rebuilt with the full scan.
+ */
+
+uint32_t bitmapBlocksFor(uint32_t blocks, uint32_t inodes) {
+    size_t words = (blocks + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS +
+                   (inodes + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    return (words * sizeof(uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+char *packBitmaps(SuperBlock *super, Bitmap *blocks, Bitmap *inodes) {
+    char *buffer = calloc(super->BitmapBlocks, BLOCK_SIZE);
+    size_t blockBytes = bitmapWords(blocks) * sizeof(uint64_t);
+
+    memcpy(buffer, blocks->Words, blockBytes);
+    memcpy(buffer + blockBytes, inodes->Words, bitmapWords(inodes) * sizeof(uint64_t));
+
+    return buffer;
+}
+
+void transferBitmaps(FileSystemState *fs, char *buffer, bool isWrite) {
+    uint32_t start = fs->SuperBlock.Super.BitmapStart;
+    uint32_t count = fs->SuperBlock.Super.BitmapBlocks;
+    struct iovec *iov = blockVector(buffer, count);
+
+    for (uint32_t done = 0; done < count; done += MAX_RUN_BLOCKS) {
+        int run = fmin(count - done, MAX_RUN_BLOCKS);
+        if (isWrite)
+            fs->Disk->writeBlocks(fs->Disk, start + done, iov + done, run);
+        else
+            fs->Disk->readBlocks(fs->Disk, start + done, iov + done, run);
     }
 
-    for (ushort direct = 0; direct < POINTERS_PER_INODE; direct++) {
-        if (inode->Direct[direct] != FREE) {
-            freeblkmap[inode->Direct[direct]] = OCCUPIED; // mark data block as used
+    free(iov);
+}
+
+void loadBitmaps(FileSystemState *fs) {
+    char *buffer = calloc(fs->SuperBlock.Super.BitmapBlocks, BLOCK_SIZE);
+    transferBitmaps(fs, buffer, false);
+
+    bitmapLoad(&fs->BlockMap, (uint64_t *)buffer);
+
+    bitmapLoad(&fs->InodeMap, (uint64_t *)buffer + bitmapWords(&fs->BlockMap));
+
+    free(buffer);
+}
+
+void saveBitmaps(FileSystemState *fs) {
+    char *buffer = packBitmaps(&fs->SuperBlock.Super, &fs->BlockMap, &fs->InodeMap);
+    transferBitmaps(fs, buffer, true);
+
+    free(buffer);
+}
+
+// Record on disk that the saved bitmaps are stale before they first change
+void markUnclean(FileSystemState *fs) {
+    if (fs->SuperBlock.Super.BitmapBlocks == 0 || !fs->SuperBlock.Super.Clean) return;
+
+    fs->SuperBlock.Super.Clean = false;
+    fs->Disk->writeDisk(fs->Disk, 0, fs->SuperBlock.Data);
+    fs->Disk->flush(fs->Disk);
+}
+
+// Allocation groups -----------------------------------------------------------
+
+/**
+ * The disk is cut into groups of ALLOC_GROUP_BLOCKS blocks and the inode
+ * table into as many equal slices, one per group. Every group counts its
+ * free blocks and free inodes. A new file takes an inode from the group with
+ * the most free blocks, and its data is allocated inside that group for as
+ * long as the group has room, so files spread over the disk while each one
+ * stays close together.
+ *
+ * Inodes are tracked in a bitmap like blocks are. Every group keeps a hint
+ * below which none of its inodes are free, moved past each inode it hands
+ * out and back down to any inode freed under it, and every inode block
+ * counts its free inodes. A new inode goes to the inode block the previous
+ * one was read into or taken from while that block has room, since it is
+ * still in the block cache, and otherwise to the first free inode at or
+ * after the hint of its group.
+ */
+
+struct AllocGroup {
+    uint32_t Start;     // First block of the group
+    uint32_t Limit;     // One past the last block of the group
+    size_t FirstInode;  // First inode of the group
+    size_t LastInode;   // One past the last inode of the group
+    size_t FreeBlocks;  // Number of free blocks
+    size_t FreeInodes;  // Number of free inodes
+    size_t InodeHint;   // No inode of the group below the hint is free
+};
+
+// Lay out the groups and count their free inodes; free blocks are counted
+// as the free extents are indexed
+void initGroups(FileSystemState *fs) {
+    uint32_t blocks = fs->SuperBlock.Super.Blocks;
+    uint32_t inodes = fs->SuperBlock.Super.Inodes;
+
+    free(fs->Groups);
+    fs->GroupCount = (blocks + ALLOC_GROUP_BLOCKS - 1) / ALLOC_GROUP_BLOCKS;
+    fs->Groups = calloc(fs->GroupCount, sizeof(AllocGroup));
+
+    free(fs->BlockFreeInodes);
+    fs->BlockFreeInodes = calloc(fs->SuperBlock.Super.InodeBlocks, sizeof(uint16_t));
+    fs->WarmInodeBlock = -1;
+
+    size_t groupInodes = (inodes + fs->GroupCount - 1) / fs->GroupCount;
+    for (size_t g = 0; g < fs->GroupCount; g++) {
+        AllocGroup *group = &fs->Groups[g];
+        group->Start = g * ALLOC_GROUP_BLOCKS;
+        group->Limit = fmin(blocks, group->Start + ALLOC_GROUP_BLOCKS);
+        group->FirstInode = fmin(inodes, g * groupInodes);
+        group->LastInode = fmin(inodes, group->FirstInode + groupInodes);
+        group->InodeHint = group->LastInode;
+
+        ssize_t i = bitmapFind(&fs->InodeMap, group->FirstInode);
+        while (i >= 0 && (size_t)i < group->LastInode) {
+            if (group->FreeInodes++ == 0) group->InodeHint = i;
+            fs->BlockFreeInodes[i / INODES_PER_BLOCK]++;
+            i = bitmapFind(&fs->InodeMap, i + 1);
         }
     }
+}
 
-    if (inode->Indirect != FREE) {
-        fprintf(stderr, "Inode indirect: %d\n", inode->Indirect);
-        freeblkmap[inode->Indirect] = OCCUPIED;
-        initIndirectBlocks(inode->Indirect);
+AllocGroup *blockGroup(FileSystemState *fs, uint32_t block) {
+    size_t g = block / ALLOC_GROUP_BLOCKS;
+    return &fs->Groups[g < fs->GroupCount ? g : fs->GroupCount - 1];
+}
+
+AllocGroup *inodeGroup(FileSystemState *fs, size_t inumber) {
+    size_t g = inumber / (fs->Groups[0].LastInode - fs->Groups[0].FirstInode);
+    return &fs->Groups[g < fs->GroupCount ? g : fs->GroupCount - 1];
+}
+
+// Count blocks as taken or freed in the groups they fall in
+void countGroupBlocks(FileSystemState *fs, uint32_t start, size_t count, bool freed) {
+    while (count > 0) {
+        AllocGroup *group = blockGroup(fs, start);
+        size_t part = fmin(count, group->Limit - start);
+        if (freed)
+            group->FreeBlocks += part;
+        else
+            group->FreeBlocks -= part;
+        start += part;
+        count -= part;
+    }
+}
+
+// Group with the most free blocks among those with a free inode
+AllocGroup *lightestGroup(FileSystemState *fs) {
+    AllocGroup *lightest = NULL;
+    for (size_t g = 0; g < fs->GroupCount; g++) {
+        if (fs->Groups[g].FreeInodes == 0) continue;
+        if (lightest == NULL || fs->Groups[g].FreeBlocks > lightest->FreeBlocks)
+            lightest = &fs->Groups[g];
     }
+    return lightest;
+}
 
-    if (inode->DoubleIndirect != FREE) {
-        freeblkmap[inode->DoubleIndirect] = OCCUPIED;
-        Block doubleIndBlk;
-        selfDisk->readDisk(selfDisk, inode->DoubleIndirect, doubleIndBlk.Data);
-        for (size_t pointer = 0;
-             pointer < POINTERS_PER_BLOCK && pointer < superBlock.Super.Blocks;
-             pointer++) {
-            if (doubleIndBlk.Pointers[pointer] != FREE)
-                initIndirectBlocks(doubleIndBlk.Pointers[pointer]);
+// First data block of the group of an inode, where its data starts out
+uint32_t inodeGoal(FileSystemState *fs, size_t inumber) {
+    return fmax(inodeGroup(fs, inumber)->Start, fs->SuperBlock.Super.InodeBlocks + 1);
+}
+
+// Free extents --------------------------------------------------------------
+
+/**
+ * Alongside the bitmap, the free blocks are indexed as extents in a range
+ * tree built at mount. Allocation asks the tree for a whole run of blocks
+ * close after a goal, inside the goal's group when it has room, and marks it
+ * in the bitmap; freeing clears the bitmap and hands the runs back to the
+ * tree, which merges them with their neighbours. Writes request runs sized
+ * to the blocks they are missing, one per pointer block segment, so a file
+ * lands in as few runs as the free space allows while keeping each pointer
+ * block in front of its data.
+ */
+
+void buildFreeExtents(FileSystemState *fs) {
+    rangeTreeDestroy(&fs->FreeExtents);
+
+    ssize_t block = bitmapFind(&fs->BlockMap, 0);
+    while (block >= 0) {
+        ssize_t used = bitmapFindUsed(&fs->BlockMap, block);
+        size_t end = used < 0 ? fs->BlockMap.Bits : (size_t)used;
+        rangeTreeInsert(&fs->FreeExtents, block, end - block);
+        countGroupBlocks(fs, block, end - block, true);
+        block = used < 0 ? -1 : bitmapFind(&fs->BlockMap, end);
+    }
+}
+
+/**
+ * @brief Allocate up to "want" contiguous blocks, at "goal" or as close
+ * after it as possible
+ *
+ * @param got set to the number of blocks allocated
+ * @return ssize_t first block allocated, or -1 if no block is free
+ */
+ssize_t allocRun(FileSystemState *fs, uint32_t goal, size_t want, size_t *got) {
+    *got = 0;
+    pthread_mutex_lock(&fs->AllocLock);
+
+    // Blocks reserved for delayed writes are not up for grabs, except for
+    // the flush they were reserved for
+    size_t own = fs->FlushReserved > 0 && pthread_equal(fs->Flusher, pthread_self()) ? fs->FlushReserved : 0;
+    size_t reserved = fs->ReservedBlocks - own;
+    if (fs->BlockMap.Free <= reserved) {
+        pthread_mutex_unlock(&fs->AllocLock);
+        return -1;
+    }
+    want = fmin(want, fs->BlockMap.Free - reserved);
+
+    markUnclean(fs);
+    goal = fmin(fmax(goal, fs->SuperBlock.Super.InodeBlocks), fs->SuperBlock.Super.Blocks - 1);
+    AllocGroup *group = blockGroup(fs, goal);
+    ssize_t start = rangeTreeAlloc(&fs->FreeExtents, goal, group->Start, group->Limit, want, got);
+    if (start < 0 && fs->GroupCount > 1)
+        start = rangeTreeAlloc(&fs->FreeExtents, goal, 0, fs->SuperBlock.Super.Blocks, want, got);
+
+    if (start >= 0) {
+        bitmapSetRange(&fs->BlockMap, start, *got);
+        countGroupBlocks(fs, start, *got, false);
+
+        size_t taken = fmin(*got, own);
+        fs->FlushReserved -= taken;
+        fs->ReservedBlocks -= taken;
+    }
+    pthread_mutex_unlock(&fs->AllocLock);
+    return start;
+}
+
+bool tryReserveBlocks(FileSystemState *fs, size_t held, size_t wanted) {
+    pthread_mutex_lock(&fs->AllocLock);
+    bool fits = fs->BlockMap.Free + held >= fs->ReservedBlocks + wanted;
+    if (fits) fs->ReservedBlocks = fs->ReservedBlocks - held + wanted;
+    pthread_mutex_unlock(&fs->AllocLock);
+    return fits;
+}
+
+// Move a reservation of "held" blocks to "wanted" blocks, if enough are free
+// once the magazines are handed back
+bool reserveBlocks(FileSystemState *fs, size_t held, size_t wanted) {
+    if (tryReserveBlocks(fs, held, wanted)) return true;
+
+    reclaimMagazines(fs, NULL, 0);
+    return tryReserveBlocks(fs, held, wanted);
+}
+
+// Let the calling thread allocate the "blocks" it reserved, until endFlush
+void startFlush(FileSystemState *fs, size_t blocks) {
+    pthread_mutex_lock(&fs->AllocLock);
+    fs->Flusher = pthread_self();
+    fs->FlushReserved = blocks;
+    pthread_mutex_unlock(&fs->AllocLock);
+}
+
+// Give back what is left of the reservation of a flush
+void endFlush(FileSystemState *fs) {
+    pthread_mutex_lock(&fs->AllocLock);
+    fs->ReservedBlocks -= fs->FlushReserved;
+    fs->FlushReserved = 0;
+    pthread_mutex_unlock(&fs->AllocLock);
+}
+
+// Free the blocks in use among "count" blocks starting at "start"
+void releaseBlocks(FileSystemState *fs, uint32_t start, size_t count) {
+    pthread_mutex_lock(&fs->AllocLock);
+    size_t end = fmin((size_t)start + count, fs->BlockMap.Bits);
+
+    size_t block = start;
+    while (block < end) {
+        ssize_t used = bitmapFindUsed(&fs->BlockMap, block);
+        if (used < 0 || (size_t)used >= end) break;
+
+        ssize_t next = bitmapFind(&fs->BlockMap, used);
+        size_t stop = next < 0 || (size_t)next > end ? end : (size_t)next;
+        markUnclean(fs);
+        bitmapClearRange(&fs->BlockMap, used, stop - used);
+        rangeTreeInsert(&fs->FreeExtents, used, stop - used);
+        countGroupBlocks(fs, used, stop - used, true);
+        block = stop;
+    }
+    pthread_mutex_unlock(&fs->AllocLock);
+}
+
+bool blockInUse(FileSystemState *fs, uint32_t block) {
+    pthread_mutex_lock(&fs->AllocLock);
+    bool used = bitmapTest(&fs->BlockMap, block);
+    pthread_mutex_unlock(&fs->AllocLock);
+    return used;
+}
+
+// Allocation magazines --------------------------------------------------------
+
+/**
+ * Every writing thread keeps a magazine: one run of free blocks taken from
+ * the shared map ahead of time. A write asking for a run that starts where
+ * its thread's magazine starts, as the writes appending to a file do, is
+ * served from the front of the magazine without AllocLock. Otherwise the
+ * magazine goes back and the run is allocated as before, then extended by up
+ * to MagazineBlocks free blocks that follow it, which become the magazine.
+ * Blocks a write did not use go back to the front of the magazine they came
+ * from, so the next write of the same file continues where this one stopped.
+ *
+ * Blocks in a magazine are marked in use. Magazines not used for
+ * MAGAZINE_IDLE_REFILLS refills are handed back by the next thread to refill,
+ * all of them are handed back when the free space runs short and at unmount,
+ * and a thread's magazine is handed back when the thread exits.
+ */
+
+struct Magazine {
+    uint32_t Start;         // First block held
+    size_t Left;            // Number of blocks held
+    size_t LastUse;         // Refills done when the magazine was last used
+    pthread_mutex_t Lock;   // Held by the owner while using it, and by reclaimers
+    FileSystemState *Fs;    // File system the blocks belong to
+    struct Magazine *Next;  // Magazine of another thread
+};
+
+void setMagazineBlocks(FileSystem *self, size_t blocks) {
+    self->State->MagazineBlocks = blocks;
+}
+
+void returnMagazine(FileSystemState *fs, Magazine *magazine) {
+    if (magazine->Left == 0) return;
+
+    releaseBlocks(fs, magazine->Start, magazine->Left);
+    magazine->Left = 0;
+}
+
+// Hand back the magazines of other threads unused for "idle" refills (0 for all)
+void reclaimMagazines(FileSystemState *fs, Magazine *except, size_t idle) {
+    size_t now = __atomic_load_n(&fs->Refills, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&fs->MagazinesLock);
+    for (Magazine *magazine = fs->Magazines; magazine != NULL; magazine = magazine->Next) {
+        if (magazine == except || pthread_mutex_trylock(&magazine->Lock) != 0) continue;
+        if (idle == 0 || now - magazine->LastUse >= idle) returnMagazine(fs, magazine);
+        pthread_mutex_unlock(&magazine->Lock);
+    }
+    pthread_mutex_unlock(&fs->MagazinesLock);
+}
+
+// Hand back the magazine of an exiting thread
+void freeMagazine(void *arg) {
+    Magazine *magazine = arg;
+    FileSystemState *fs = magazine->Fs;
+
+    pthread_rwlock_rdlock(&fs->MountLock);
+    pthread_mutex_lock(&fs->MagazinesLock);
+    Magazine **link = &fs->Magazines;
+    while (*link != magazine) link = &(*link)->Next;
+    *link = magazine->Next;
+    pthread_mutex_unlock(&fs->MagazinesLock);
+
+    if (hasDiskMounted(fs)) returnMagazine(fs, magazine);
+    pthread_rwlock_unlock(&fs->MountLock);
+
+    pthread_mutex_destroy(&magazine->Lock);
+    free(magazine);
+}
+
+Magazine *threadMagazine(FileSystemState *fs) {
+    Magazine *magazine = pthread_getspecific(fs->MagazineKey);
+    if (magazine != NULL) return magazine;
+
+    magazine = calloc(1, sizeof(Magazine));
+    pthread_mutex_init(&magazine->Lock, NULL);
+    magazine->Fs = fs;
+    pthread_mutex_lock(&fs->MagazinesLock);
+    magazine->Next = fs->Magazines;
+    fs->Magazines = magazine;
+    pthread_mutex_unlock(&fs->MagazinesLock);
+
+    pthread_setspecific(fs->MagazineKey, magazine);
+    return magazine;
+}
+
+// Allocate a run from the shared map, taking back every magazine if it is full
+ssize_t allocSharedRun(FileSystemState *fs, Magazine *except, uint32_t goal, size_t want, size_t *got) {
+    ssize_t start = allocRun(fs, goal, want, got);
+    if (start < 0 && fs->MagazineBlocks > 0) {
+        reclaimMagazines(fs, except, 0);
+        start = allocRun(fs, goal, want, got);
+    }
+    return start;
+}
+
+// Take up to "extra" free blocks that directly follow "end"
+size_t extendRun(FileSystemState *fs, uint32_t end, size_t extra) {
+    pthread_mutex_lock(&fs->AllocLock);
+    size_t taken = 0;
+    if (end < fs->BlockMap.Bits && fs->BlockMap.Free > fs->ReservedBlocks) {
+        ssize_t used = bitmapFindUsed(&fs->BlockMap, end);
+        size_t free = (used < 0 ? fs->BlockMap.Bits : (size_t)used) - end;
+        taken = fmin(fmin(extra, free), fs->BlockMap.Free - fs->ReservedBlocks);
+    }
+    if (taken > 0 && rangeTreeRemove(&fs->FreeExtents, end, taken)) {
+        bitmapSetRange(&fs->BlockMap, end, taken);
+        countGroupBlocks(fs, end, taken, false);
+    } else {
+        taken = 0;
+    }
+    pthread_mutex_unlock(&fs->AllocLock);
+    return taken;
+}
+
+// Allocate up to "want" contiguous blocks at "goal" or as close after it as
+// possible, from the magazine of the calling thread when it starts at "goal"
+ssize_t magazineRun(FileSystemState *fs, uint32_t goal, size_t want, size_t *got) {
+    if (fs->MagazineBlocks == 0) return allocSharedRun(fs, NULL, goal, want, got);
+
+    Magazine *magazine = threadMagazine(fs);
+    pthread_mutex_lock(&magazine->Lock);
+
+    if (magazine->Left == 0 || magazine->Start != goal) {
+        returnMagazine(fs, magazine);
+        reclaimMagazines(fs, magazine, MAGAZINE_IDLE_REFILLS);
+        __atomic_fetch_add(&fs->Refills, 1, __ATOMIC_RELAXED);
+
+        ssize_t start = allocSharedRun(fs, magazine, goal, want, &magazine->Left);
+        if (start < 0) {
+            pthread_mutex_unlock(&magazine->Lock);
+            *got = 0;
+            return -1;
         }
+        magazine->Start = start;
+        magazine->Left += extendRun(fs, start + magazine->Left, fs->MagazineBlocks);
     }
+    magazine->LastUse = __atomic_load_n(&fs->Refills, __ATOMIC_RELAXED);
+
+    ssize_t start = magazine->Start;
+    *got = fmin(want, magazine->Left);
+    magazine->Start += *got;
+    magazine->Left -= *got;
+    pthread_mutex_unlock(&magazine->Lock);
+    return start;
+}
 
-    return true;
+// Give back "count" blocks from "start", in front of the calling thread's magazine if they fit there
+void unusedRun(FileSystemState *fs, uint32_t start, size_t count) {
+    if (count == 0) return;
+
+    Magazine *magazine = fs->MagazineBlocks > 0 ? threadMagazine(fs) : NULL;
+    if (magazine != NULL) {
+        pthread_mutex_lock(&magazine->Lock);
+        if (magazine->Left == 0 || start + count == magazine->Start) {
+            magazine->Start = start;
+            magazine->Left += count;
+            count = 0;
+        }
+        pthread_mutex_unlock(&magazine->Lock);
+    }
+
+    releaseBlocks(fs, start, count);
 }
 
+// Block runs --------------------------------------------------------------------
+
 /**
  * @brief Validate if input bnumber is valid and return newly allocated block
  * number if input bnumber is "0". If free block is not available, return "-1"
@@ -167,120 +700,489 @@ bool initFreeBlocks(Inode *inode) {
  * "non-zero" return "bnumber"
  * @return ssize_t
  */
-ssize_t allocFreeBlock(uint32_t bnumber) {
-    if (bnumber != 0 && bnumber < superBlock.Super.Blocks) return bnumber;
+ssize_t allocFreeBlock(FileSystemState *fs, uint32_t bnumber) {
+    if (bnumber != 0 && bnumber < fs->SuperBlock.Super.Blocks) return bnumber;
+
+    size_t got;
+    return allocRun(fs, fs->SuperBlock.Super.InodeBlocks, 1, &got);
+}
+
+typedef struct BlockRun { // Blocks allocated for a write but not handed out yet
+    uint32_t Next;        // Next block of the run, or the goal of the next run
+    size_t Left;          // Number of blocks left in the run
+} BlockRun;
+
+// Hand out the next block of a run, allocating a run of "want" blocks once it is used up
+ssize_t runBlock(FileSystemState *fs, BlockRun *run, size_t want) {
+    if (run->Left == 0) {
+        ssize_t start = magazineRun(fs, run->Next, want, &run->Left);
+        if (start < 0) return -1;
+        run->Next = start;
+    }
+
+    run->Left--;
+    return run->Next++;
+}
+
+// Free the blocks of a run that were not handed out
+void releaseRun(FileSystemState *fs, BlockRun *run) {
+    unusedRun(fs, run->Next, run->Left);
+    run->Left = 0;
+}
+
+// Mount scan ------------------------------------------------------------------
+
+/**
+ * Without saved bitmaps, mount rebuilds them from the inode blocks. The inode
+ * blocks are split into contiguous ranges, one per worker thread, and every
+ * worker reads its range a batch at a time. The pointer blocks named by a
+ * batch are queued together, one level at a time, so they are in flight at
+ * once rather than read one after another. Workers mark blocks in a bitmap of
+ * their own, and inodes in an inode bitmap of their own, that are merged into
+ * the shared maps once they finish.
+ *
+ * Small images, and disks that cannot be read from several threads, are
+ * scanned on the calling thread through the mounted disk, block cache
+ * included.
+ */
+
+#define SCAN_BATCH_BLOCKS 64    // Blocks read by a worker at a time
+#define SCAN_WORKER_BLOCKS 16   // Fewest inode blocks worth a thread of their own
+
+void setMountThreads(FileSystem *self, size_t threads) {
+    self->State->MountThreads = threads;
+}
+
+typedef struct ScanWorker {
+    FileSystemState *Fs; // File system being mounted
+    Disk *Disk;         // Disk to read from
+    uint32_t First;     // First inode block of the range
+    uint32_t Last;      // One past the last inode block of the range
+    Bitmap *Used;       // Blocks found in use
+    Bitmap Own;         // Storage for Used when running on a thread
+    Bitmap *Inodes;     // Inodes found in use
+    Bitmap OwnInodes;   // Storage for Inodes when running on a thread
+    pthread_t Thread;
+} ScanWorker;
+
+bool scanPointer(FileSystemState *fs, ScanWorker *worker, uint32_t block) {
+    if (block == FREE || block >= fs->SuperBlock.Super.Blocks) return false;
+
+    bitmapSet(worker->Used, block);
+    return true;
+}
+
+// Read up to SCAN_BATCH_BLOCKS scattered blocks into "iov", all in flight at once
+void readScanBatch(ScanWorker *worker, uint32_t *blocks, size_t batch, struct iovec *iov) {
+    // A lone block has nothing to overlap with, read it through the cache
+    if (batch == 1) {
+        worker->Disk->readDisk(worker->Disk, blocks[0], iov[0].iov_base);
+        return;
+    }
+
+    ssize_t ticket = 0;
+    for (size_t i = 0; i < batch; i++) {
+        ssize_t queued = worker->Disk->readDiskAsync(worker->Disk, blocks[i], &iov[i], 1);
+        if (queued > ticket) ticket = queued;
+    }
+    worker->Disk->waitDisk(worker->Disk, ticket);
+}
+
+// Mark the pointers held by the given pointer blocks as used. For double
+// indirect blocks, the indirect blocks they point to are scanned in turn.
+void scanPointerBlocks(FileSystemState *fs, ScanWorker *worker, uint32_t *blocks, size_t count, bool isDouble) {
+    char *buffer = malloc(SCAN_BATCH_BLOCKS * BLOCK_SIZE);
+    struct iovec *iov = blockVector(buffer, SCAN_BATCH_BLOCKS);
 
-    for (uint32_t i = superBlock.Super.InodeBlocks;
-         i < superBlock.Super.Blocks;
-         i++) {
-        if (freeblkmap[i] == FREE) {
-            freeblkmap[i] = OCCUPIED;
-            return i;
+    size_t children = 0;
+    uint32_t *next = isDouble ? malloc(count * POINTERS_PER_BLOCK * sizeof(uint32_t)) : NULL;
+
+    for (size_t start = 0; start < count; start += SCAN_BATCH_BLOCKS) {
+        size_t batch = fmin(count - start, SCAN_BATCH_BLOCKS);
+        readScanBatch(worker, blocks + start, batch, iov);
+
+        for (size_t i = 0; i < batch; i++) {
+            Block *block = (Block *)(buffer + i * BLOCK_SIZE);
+            for (size_t pointer = 0; pointer < POINTERS_PER_BLOCK; pointer++) {
+                if (scanPointer(fs, worker, block->Pointers[pointer]) && isDouble)
+                    next[children++] = block->Pointers[pointer];
+            }
         }
     }
 
-    return -1;
+    free(iov);
+    free(buffer);
+
+    if (isDouble) {
+        scanPointerBlocks(fs, worker, next, children, false);
+        free(next);
+    }
+}
+
+// Mark an extent as used
+bool scanExtent(FileSystemState *fs, ScanWorker *worker, Extent *extent) {
+    if (!validExtent(extent, fs->SuperBlock.Super.Blocks)) return false;
+
+    bitmapSetRange(worker->Used, extent->Start, extent->Length);
+    return true;
 }
 
-bool initInodeTable() {
-    free(inodetable);
-    inodetable = calloc(superBlock.Super.Inodes, sizeof(ushort));
+// Mark the given extent tree blocks, at "level" of their trees, and every
+// extent below them as used, one level of the trees at a time
+void scanExtentNodes(FileSystemState *fs, ScanWorker *worker, uint32_t *blocks, size_t count, size_t level) {
+    char *buffer = malloc(SCAN_BATCH_BLOCKS * BLOCK_SIZE);
+    struct iovec *iov = blockVector(buffer, SCAN_BATCH_BLOCKS);
+
+    size_t children = 0;
+    uint32_t *next = NULL;
+
+    for (size_t start = 0; start < count; start += SCAN_BATCH_BLOCKS) {
+        size_t batch = fmin(count - start, SCAN_BATCH_BLOCKS);
+        readScanBatch(worker, blocks + start, batch, iov);
+
+        for (size_t i = 0; i < batch; i++) {
+            ExtentNode *node = &((Block *)(buffer + i * BLOCK_SIZE))->Node;
+            if (level + node->Depth > EXTENT_MAX_DEPTH || node->Count > EXTENTS_PER_BLOCK)
+                continue;
+
+            if (node->Depth == 0) {
+                for (size_t e = 0; e < node->Count; e++) scanExtent(fs, worker, &node->Entries[e]);
+                continue;
+            }
+
+            next = realloc(next, (children + node->Count) * sizeof(uint32_t));
+            for (size_t e = 0; e < node->Count; e++) {
+                if (scanPointer(fs, worker, node->Entries[e].Start))
+                    next[children++] = node->Entries[e].Start;
+            }
+        }
+    }
+
+    free(iov);
+    free(buffer);
 
-    free(freeblkmap);
-    freeblkmap = calloc(superBlock.Super.Blocks, sizeof(ushort));
-    freeblkmap[0] = OCCUPIED; // mark super block as used
+    if (children > 0) scanExtentNodes(fs, worker, next, children, level + 1);
+    free(next);
+}
 
+void *scanInodeRange(void *arg) {
+    ScanWorker *worker = arg;
+    FileSystemState *fs = worker->Fs;
     uint32_t inodeperblk =
-        superBlock.Super.Inodes / superBlock.Super.InodeBlocks;
-    Block block;
-    for (size_t inodeblk = 1; inodeblk <= superBlock.Super.InodeBlocks;
-         inodeblk++) {
-        selfDisk->readDisk(selfDisk, inodeblk, block.Data);
-        freeblkmap[inodeblk] = OCCUPIED;
-        for (size_t inode = 0; inode < inodeperblk; inode++) {
-            if (block.Inodes[inode].Valid == OCCUPIED) {
-                inodetable[(inodeblk - 1) * inodeperblk + inode] = OCCUPIED;
-                initFreeBlocks(&block.Inodes[inode]);
+        fs->SuperBlock.Super.Inodes / fs->SuperBlock.Super.InodeBlocks;
+
+    char *buffer = malloc(SCAN_BATCH_BLOCKS * BLOCK_SIZE);
+    struct iovec *iov = blockVector(buffer, SCAN_BATCH_BLOCKS);
+    uint32_t *indirect = malloc(SCAN_BATCH_BLOCKS * inodeperblk * sizeof(uint32_t));
+    uint32_t *doubleIndirect = malloc(SCAN_BATCH_BLOCKS * inodeperblk * sizeof(uint32_t));
+
+    for (uint32_t first = worker->First; first < worker->Last; first += SCAN_BATCH_BLOCKS) {
+        uint32_t batch = fmin(worker->Last - first, SCAN_BATCH_BLOCKS);
+        worker->Disk->readBlocks(worker->Disk, first, iov, batch);
+
+        size_t indirects = 0, doubles = 0;
+        for (uint32_t b = 0; b < batch; b++) {
+            Block *block = (Block *)(buffer + b * BLOCK_SIZE);
+            bitmapSet(worker->Used, first + b);
+
+            for (uint32_t i = 0; i < inodeperblk; i++) {
+                Inode *inode = &block->Inodes[i];
+                if (inode->Valid != OCCUPIED) continue;
+
+                bitmapSet(worker->Inodes, (first + b - 1) * inodeperblk + i);
+
+                if (usesExtents(fs)) {
+                    for (size_t e = 0; e < EXTENTS_PER_INODE; e++) {
+                        if (!scanExtent(fs, worker, &inode->Extents[e])) break;
+                    }
+                    if (scanPointer(fs, worker, inode->ExtentTree))
+                        indirect[indirects++] = inode->ExtentTree;
+                    continue;
+                }
+
+                for (ushort direct = 0; direct < POINTERS_PER_INODE; direct++) {
+                    scanPointer(fs, worker, inode->Direct[direct]);
+                }
+                if (scanPointer(fs, worker, inode->Indirect))
+                    indirect[indirects++] = inode->Indirect;
+                if (scanPointer(fs, worker, inode->DoubleIndirect))
+                    doubleIndirect[doubles++] = inode->DoubleIndirect;
             }
         }
-        fprintf(stderr, "InodeBlk: %lu\n", inodeblk);
+
+        if (usesExtents(fs)) {
+            scanExtentNodes(fs, worker, indirect, indirects, 0);
+        } else {
+            scanPointerBlocks(fs, worker, indirect, indirects, false);
+            scanPointerBlocks(fs, worker, doubleIndirect, doubles, true);
+        }
+    }
+
+    free(doubleIndirect);
+    free(indirect);
+    free(iov);
+    free(buffer);
+    return NULL;
+}
+
+void scanInodeBlocks(FileSystemState *fs) {
+    uint32_t inodeBlocks = fs->SuperBlock.Super.InodeBlocks;
+
+    size_t threads = fs->MountThreads;
+    if (threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > inodeBlocks / SCAN_WORKER_BLOCKS)
+        threads = inodeBlocks / SCAN_WORKER_BLOCKS;
+
+    Disk *disk = NULL;
+    if (threads > 1) {
+        fs->Disk->flush(fs->Disk);
+        disk = fs->Disk->concurrent(fs->Disk);
     }
+    if (disk == NULL) {
+        ScanWorker worker = {fs, fs->Disk, 1, inodeBlocks + 1, &fs->BlockMap};
+        worker.Inodes = &fs->InodeMap;
+        scanInodeRange(&worker);
+        return;
+    }
+
+    ScanWorker *workers = calloc(threads, sizeof(ScanWorker));
+    uint32_t perWorker = (inodeBlocks + threads - 1) / threads;
+    for (size_t t = 0; t < threads; t++) {
+        ScanWorker *worker = &workers[t];
+        worker->Fs = fs;
+        worker->Disk = disk;
+        worker->First = 1 + t * perWorker;
+        worker->Last = fmin(worker->First + perWorker, inodeBlocks + 1);
+        worker->Used = &worker->Own;
+        bitmapInit(&worker->Own, fs->SuperBlock.Super.Blocks);
+        worker->Inodes = &worker->OwnInodes;
+        bitmapInit(&worker->OwnInodes, fs->SuperBlock.Super.Inodes);
+        pthread_create(&worker->Thread, NULL, scanInodeRange, worker);
+    }
+
+    for (size_t t = 0; t < threads; t++) {
+        pthread_join(workers[t].Thread, NULL);
+        bitmapMerge(&fs->BlockMap, &workers[t].Own);
+        bitmapDestroy(&workers[t].Own);
+        bitmapMerge(&fs->InodeMap, &workers[t].OwnInodes);
+        bitmapDestroy(&workers[t].OwnInodes);
+    }
+    free(workers);
+}
+
+bool initInodeTable(FileSystemState *fs) {
+    bitmapDestroy(&fs->InodeMap);
+    bitmapInit(&fs->InodeMap, fs->SuperBlock.Super.Inodes);
 
-    fprintf(stderr, "Total InodeBlocks %u\n", superBlock.Super.InodeBlocks);
+    bitmapDestroy(&fs->BlockMap);
+    bitmapInit(&fs->BlockMap, fs->SuperBlock.Super.Blocks);
+
+    if (fs->SuperBlock.Super.BitmapBlocks != 0 && fs->SuperBlock.Super.Clean) {
+        loadBitmaps(fs);
+        initGroups(fs);
+        buildFreeExtents(fs);
+        return true;
+    }
+
+    bitmapSet(&fs->BlockMap, 0); // mark super block as used
+    for (uint32_t b = 0; b < fs->SuperBlock.Super.BitmapBlocks; b++) {
+        bitmapSet(&fs->BlockMap, fs->SuperBlock.Super.BitmapStart + b);
+    }
+
+    scanInodeBlocks(fs);
+    initGroups(fs);
+    buildFreeExtents(fs);
+
+    fprintf(stderr, "Total InodeBlocks %u\n", fs->SuperBlock.Super.InodeBlocks);
 
     return true;
 }
 
-ssize_t allocFreeInode() {
-    size_t tinodes = superBlock.Super.Inodes;
-    for (int i = 0; i < tinodes; i++) {
-        if (inodetable[i] == FREE) {
-            inodetable[i] = OCCUPIED;
-            return i;
-        }
+// Take a free inode of the group with the most room, from the warm inode
+// block when it has room and otherwise the first one after the group's hint
+ssize_t allocFreeInode(FileSystemState *fs) {
+    pthread_mutex_lock(&fs->AllocLock);
+    AllocGroup *group = lightestGroup(fs);
+    ssize_t warm = __atomic_load_n(&fs->WarmInodeBlock, __ATOMIC_RELAXED);
+
+    ssize_t inumber = -1;
+    if (group != NULL && warm >= 0 && fs->BlockFreeInodes[warm] > 0) {
+        inumber = bitmapFind(&fs->InodeMap, warm * INODES_PER_BLOCK);
+        if ((size_t)inumber < group->FirstInode || (size_t)inumber >= group->LastInode)
+            inumber = -1;
     }
+    if (group != NULL && inumber < 0) inumber = bitmapFind(&fs->InodeMap, group->InodeHint);
+    if (group == NULL || inumber < 0 || (size_t)inumber >= group->LastInode) {
+        pthread_mutex_unlock(&fs->AllocLock);
+        return -1;
+    }
+
+    markUnclean(fs);
+    bitmapSet(&fs->InodeMap, inumber);
+    group->FreeInodes--;
+    if ((size_t)inumber == group->InodeHint) group->InodeHint++;
+    fs->BlockFreeInodes[inumber / INODES_PER_BLOCK]--;
+    __atomic_store_n(&fs->WarmInodeBlock, inumber / INODES_PER_BLOCK, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->AllocLock);
+    return inumber;
+}
 
-    return -1;
+void releaseInode(FileSystemState *fs, size_t inumber) {
+    pthread_mutex_lock(&fs->AllocLock);
+    AllocGroup *group = inodeGroup(fs, inumber);
+    markUnclean(fs);
+    bitmapClear(&fs->InodeMap, inumber);
+    group->FreeInodes++;
+    if (inumber < group->InodeHint) group->InodeHint = inumber;
+    fs->BlockFreeInodes[inumber / INODES_PER_BLOCK]++;
+    pthread_mutex_unlock(&fs->AllocLock);
 }
 
-bool loadInode(size_t inumber, Inode *inode) {
-    if (!hasDiskMounted()) {
+bool inodeInUse(FileSystemState *fs, size_t inumber) {
+    pthread_mutex_lock(&fs->AllocLock);
+    bool used = bitmapTest(&fs->InodeMap, inumber);
+    pthread_mutex_unlock(&fs->AllocLock);
+    return used;
+}
+
+bool loadInode(FileSystemState *fs, size_t inumber, Inode *inode) {
+    if (!hasDiskMounted(fs)) {
         return false;
     }
 
-    if (inumber < 0 || inumber >= superBlock.Super.Inodes) {
+    if (inumber < 0 || inumber >= fs->SuperBlock.Super.Inodes) {
         return false;
     }
 
-    if (inodetable[inumber] == FREE) {
+    if (!inodeInUse(fs, inumber)) {
         return false;
     }
 
-    /* Cache lookup */
-    if (cacheLookup(inumber, inode)) return true;
+    if (inodeCacheLookup(&fs->InodeCache, inumber, inode)) return true;
 
     /* Cache miss. Read inode from memory */
     size_t inodeperblk =
-        superBlock.Super.Inodes / superBlock.Super.InodeBlocks;
+        fs->SuperBlock.Super.Inodes / fs->SuperBlock.Super.InodeBlocks;
     size_t blockNumber = (inumber / inodeperblk) + 1;
     Block block;
-    selfDisk->readDisk(selfDisk, blockNumber, block.Data);
+    fs->Disk->readDisk(fs->Disk, blockNumber, block.Data);
     memcpy(inode, &block.Inodes[inumber % inodeperblk], sizeof(Inode));
+    __atomic_store_n(&fs->WarmInodeBlock, blockNumber - 1, __ATOMIC_RELAXED);
 
-    /* Update inode Cache references */
-    cacheUpdate(inumber, inode);
+    inodeCacheUpdate(&fs->InodeCache, inumber, inode, false);
 
     return true;
 }
 
-bool saveInode(size_t inumber, Inode *inode) {
-    if (!hasDiskMounted()) return false;
+// Inodes are written to disk when the inode cache evicts or flushes them
+bool saveInode(FileSystemState *fs, size_t inumber, Inode *inode) {
+    if (!hasDiskMounted(fs)) return false;
 
-    if (inumber < 0 || inumber >= superBlock.Super.Inodes) {
+    if (inumber < 0 || inumber >= fs->SuperBlock.Super.Inodes) {
         return false;
     }
 
-    uint32_t inodesperblk =
-        superBlock.Super.Inodes / superBlock.Super.InodeBlocks;
-    uint32_t blockNumber = (inumber / inodesperblk) + 1;
+    inodeCacheUpdate(&fs->InodeCache, inumber, inode, true);
+
+    return true;
+}
+
+// Store inodes, sorted by number, one block write per inode block. Used by the
+// inode cache for dirty inodes and by the batched operations.
+void storeInodes(FileSystemState *fs, size_t *inumbers, Inode **inodes, size_t count) {
+    size_t inodeperblk =
+        fs->SuperBlock.Super.Inodes / fs->SuperBlock.Super.InodeBlocks;
 
+    pthread_mutex_lock(&fs->InodeBlockLock);
     Block block;
-    selfDisk->readDisk(selfDisk, blockNumber, block.Data);
+    size_t i = 0;
+    while (i < count) {
+        size_t blockNumber = (inumbers[i] / inodeperblk) + 1;
+
+        // A block whose inodes are all being stored need not be read first
+        size_t inBlock = 0;
+        while (i + inBlock < count && (inumbers[i + inBlock] / inodeperblk) + 1 == blockNumber)
+            inBlock++;
+        if (inBlock < inodeperblk)
+            fs->Disk->readDisk(fs->Disk, blockNumber, block.Data);
+
+        for (; i < count && (inumbers[i] / inodeperblk) + 1 == blockNumber; i++) {
+            memcpy(&block.Inodes[inumbers[i] % inodeperblk], inodes[i], sizeof(Inode));
+        }
+
+        fs->Disk->writeDisk(fs->Disk, blockNumber, block.Data);
+    }
+    pthread_mutex_unlock(&fs->InodeBlockLock);
+}
+
+void writeBackInodes(void *context, size_t *inumbers, Inode **inodes, size_t count) {
+    storeInodes(context, inumbers, inodes, count);
+}
 
-    memcpy(&block.Inodes[inumber % inodesperblk], inode, sizeof(Inode));
+void setMapCacheExtents(FileSystem *self, size_t extents) {
+    self->State->MapCacheExtents = extents;
+}
 
-    selfDisk->writeDisk(selfDisk, blockNumber, block.Data);
+MapCache *getMapCache(FileSystem *self) {
+    return hasDiskMounted(self->State) ? &self->State->MapCache : NULL;
+}
 
-    cacheUpdate(inumber, inode);
+void setInodeCacheCapacity(FileSystem *self, size_t entries) {
+    self->State->InodeCacheCapacity = entries;
+}
 
-    return true;
+InodeCache *getInodeCache(FileSystem *self) {
+    return hasDiskMounted(self->State) ? &self->State->InodeCache : NULL;
 }
 
 // Debug file system -----------------------------------------------------------
 
-void debug(Disk *disk) {
+// Print the blocks of an extent tree, or the extents in its leaves
+void printExtentTree(Disk *disk, uint32_t number, uint32_t blocks, size_t level, bool leaves) {
+    if (number == FREE || number >= blocks) return;
+
+    Block node;
+    disk->readDisk(disk, number, node.Data);
+    if (!leaves) printf(" %u", number);
+    if (level + node.Node.Depth > EXTENT_MAX_DEPTH || node.Node.Count > EXTENTS_PER_BLOCK) return;
+
+    for (size_t i = 0; i < node.Node.Count; i++) {
+        Extent *entry = &node.Node.Entries[i];
+        if (node.Node.Depth > 0)
+            printExtentTree(disk, entry->Start, blocks, level + 1, leaves);
+        else if (leaves)
+            printf(" %u-%u", entry->Start, entry->Start + entry->Length - 1);
+    }
+}
+
+void printExtents(Disk *disk, Inode *inode, uint32_t blocks) {
+    printf("    extents:");
+    for (size_t i = 0; i < EXTENTS_PER_INODE; i++) {
+        if (!validExtent(&inode->Extents[i], blocks)) break;
+        printf(" %u-%u", inode->Extents[i].Start,
+               inode->Extents[i].Start + inode->Extents[i].Length - 1);
+    }
+    printf("\n");
+
+    if (inode->ExtentTree != FREE) {
+        printf("    extent tree blocks:");
+        printExtentTree(disk, inode->ExtentTree, blocks, 0, false);
+        printf("\n");
+        printf("    extent tree extents:");
+        printExtentTree(disk, inode->ExtentTree, blocks, 0, true);
+        printf("\n");
+    }
+}
+
+void debugImage(FileSystemState *fs, Disk *disk) {
     Block block;
 
+    // Inode blocks on disk must reflect the cached inodes
+    if (hasDiskMounted(fs) && disk == fs->Disk) {
+        flushAllData(fs);
+        inodeCacheFlush(&fs->InodeCache);
+    }
+
     // Read Superblock
     disk->readDisk(disk, 0, block.Data);
 
@@ -296,6 +1198,10 @@ void debug(Disk *disk) {
     printf("    %u inode blocks\n", block.Super.InodeBlocks);
     printf("    %u inodes\n", block.Super.Inodes);
 
+    bool extents = block.Super.Flags & SUPER_EXTENTS;
+    uint32_t blocks = block.Super.Blocks;
+    if (extents) printf("    extent inodes\n");
+
     // Read Inode blocks
     uint32_t iblock = 1;
     uint32_t totalIBlocks = block.Super.InodeBlocks;
@@ -313,7 +1219,13 @@ void debug(Disk *disk) {
                 printf("Inode %d:\n", iblock * inodeIdx);
                 printf("    size: %u bytes\n", inode.Size);
 
-                printf("    direct blocks:");
+                if (extents) {
+                    printExtents(disk, &inode, blocks);
+                    inodeIdx++;
+                    continue;
+                }
+
+                printf("    direct blocks:");
                 for (ushort idx = 0; idx < POINTERS_PER_INODE; idx++) {
                     if (inode.Direct[idx] == 0) break;
                     printf(" %u", inode.Direct[idx]);
@@ -334,15 +1246,30 @@ void debug(Disk *disk) {
 
                 if (inode.DoubleIndirect != FREE) {
                     printf("    double indirect block: %u\n", inode.DoubleIndirect);
-                    printf("    doubly directed indirect data blocks:");
 
                     Block doubleIndirect;
-                    disk->readDisk(disk, inode.Indirect, doubleIndirect.Data);
+                    disk->readDisk(disk, inode.DoubleIndirect, doubleIndirect.Data);
+                    printf("    double indirect pointer blocks:");
                     for (size_t ind = 0; ind < POINTERS_PER_BLOCK; ind++) {
                         if (doubleIndirect.Pointers[ind] == 0) break;
                         printf(" %u", doubleIndirect.Pointers[ind]);
                     }
                     printf("\n");
+
+                    // Then the data blocks each pointer block holds
+                    printf("    doubly directed indirect data blocks:");
+                    for (size_t ind = 0; ind < POINTERS_PER_BLOCK; ind++) {
+                        uint32_t level = doubleIndirect.Pointers[ind];
+                        if (level == 0 || level >= blocks) break;
+
+                        Block indirect;
+                        disk->readDisk(disk, level, indirect.Data);
+                        for (size_t data = 0; data < POINTERS_PER_BLOCK; data++) {
+                            if (indirect.Pointers[data] == 0) break;
+                            printf(" %u", indirect.Pointers[data]);
+                        }
+                    }
+                    printf("\n");
                 }
             }
             inodeIdx++;
@@ -353,8 +1280,8 @@ void debug(Disk *disk) {
 
 // Format file system ----------------------------------------------------------
 
-bool format(Disk *disk) {
-    if (hasDiskMounted()) {
+bool formatImage(FileSystemState *fs, Disk *disk) {
+    if (hasDiskMounted(fs)) {
         return false;
     }
 
@@ -366,6 +1293,29 @@ bool format(Disk *disk) {
     block.Super.Blocks = disk->Blocks;
     block.Super.InodeBlocks = inodeBlocks;
     block.Super.Inodes = INODES_PER_BLOCK * inodeBlocks;
+    block.Super.Flags = fs->ExtentInodes ? SUPER_EXTENTS : 0;
+
+    // Place the allocation bitmaps at the end of the disk, if they fit
+    uint32_t bitmapBlocks = bitmapBlocksFor(block.Super.Blocks, block.Super.Inodes);
+    char *bitmaps = NULL;
+    if (bitmapBlocks < block.Super.Blocks &&
+        block.Super.Blocks - bitmapBlocks > inodeBlocks + 1) {
+        block.Super.BitmapStart = block.Super.Blocks - bitmapBlocks;
+        block.Super.BitmapBlocks = bitmapBlocks;
+        block.Super.Clean = true;
+
+        Bitmap blocks, inodes;
+        bitmapInit(&blocks, block.Super.Blocks);
+        bitmapInit(&inodes, block.Super.Inodes);
+        for (uint32_t b = 0; b <= inodeBlocks; b++) bitmapSet(&blocks, b);
+        for (uint32_t b = block.Super.BitmapStart; b < block.Super.Blocks; b++)
+            bitmapSet(&blocks, b);
+
+        bitmaps = packBitmaps(&block.Super, &blocks, &inodes);
+        bitmapDestroy(&blocks);
+        bitmapDestroy(&inodes);
+    }
+    uint32_t bitmapStart = block.Super.BitmapStart;
 
     // Write superblock
     disk->writeDisk(disk, 0, block.Data);
@@ -376,44 +1326,67 @@ bool format(Disk *disk) {
     // Clear all other blocks
     uint32_t blockIdx = 1;
     while (blockIdx < disk->Blocks) {
+        if (bitmaps != NULL && blockIdx >= bitmapStart &&
+            blockIdx < bitmapStart + bitmapBlocks) {
+            disk->writeDisk(disk, blockIdx, bitmaps + (blockIdx - bitmapStart) * BLOCK_SIZE);
+            blockIdx++;
+            continue;
+        }
         disk->writeDisk(disk, blockIdx++, block.Data);
     }
 
+    free(bitmaps);
     return true;
 }
 
 // Mount file system -----------------------------------------------------------
 
-bool mount(Disk *disk) {
+bool mountImage(FileSystemState *fs, Disk *disk) {
     if (disk->mounted(disk)) {
         return false;
     }
 
     // Read superblock
-    disk->readDisk(disk, 0, superBlock.Data);
-    if (superBlock.Super.MagicNumber != MAGIC_NUMBER) {
+    disk->readDisk(disk, 0, fs->SuperBlock.Data);
+    if (fs->SuperBlock.Super.MagicNumber != MAGIC_NUMBER) {
         fprintf(stderr, "Invalid valid magic number: %x...\n",
-                superBlock.Super.MagicNumber); // debug
+                fs->SuperBlock.Super.MagicNumber); // debug
         return false;
     }
     fprintf(stderr, "Valid magic number: %x...\n",
-            superBlock.Super.MagicNumber); // debug
+            fs->SuperBlock.Super.MagicNumber); // debug
 
-    if (superBlock.Super.Blocks == 0) return false;
+    if (fs->SuperBlock.Super.Blocks == 0) return false;
 
-    if (superBlock.Super.InodeBlocks != ceil(0.10 * superBlock.Super.Blocks))
+    if (fs->SuperBlock.Super.InodeBlocks != ceil(0.10 * fs->SuperBlock.Super.Blocks))
         return false;
 
-    uint32_t inodes = superBlock.Super.Inodes;
+    uint32_t inodes = fs->SuperBlock.Super.Inodes;
     if (inodes == 0 || inodes % INODES_PER_BLOCK != 0) return false;
 
+    if (fs->SuperBlock.Super.Flags & ~SUPER_EXTENTS) return false;
+
+    uint32_t bitmapBlocks = fs->SuperBlock.Super.BitmapBlocks;
+    if (bitmapBlocks != 0 &&
+        (bitmapBlocks != bitmapBlocksFor(fs->SuperBlock.Super.Blocks, inodes) ||
+         fs->SuperBlock.Super.BitmapStart <= fs->SuperBlock.Super.InodeBlocks ||
+         fs->SuperBlock.Super.BitmapStart + bitmapBlocks != fs->SuperBlock.Super.Blocks ||
+         fs->SuperBlock.Super.Blocks > disk->size(disk)))
+        return false;
+
     // Set device
-    selfDisk = disk;
+    fs->Disk = disk;
+
+    size_t capacity = fs->InodeCacheCapacity;
+    if (capacity == 0) capacity = fmin(inodes, INODE_CACHE_DEFAULT_ENTRIES);
+    inodeCacheInit(&fs->InodeCache, capacity, writeBackInodes, fs);
+    mapCacheInit(&fs->MapCache, capacity,
+                 fs->MapCacheExtents ? fs->MapCacheExtents : MAP_CACHE_DEFAULT_EXTENTS);
 
     // Allocate free block freeblkmap
     // Allocate inode table
     // Copy metadata
-    if (!initInodeTable()) return false;
+    if (!initInodeTable(fs)) return false;
 
     // Mount
     disk->mount(disk);
@@ -421,376 +1394,1813 @@ bool mount(Disk *disk) {
     return true;
 }
 
-// Create inode ----------------------------------------------------------------
+// Unmount file system ---------------------------------------------------------
 
-ssize_t create() {
-    if (!hasDiskMounted()) {
-        return -1;
+bool unmountImage(FileSystemState *fs, Disk *disk) {
+    if (!hasDiskMounted(fs) || disk != fs->Disk) {
+        return false;
     }
 
-    // Locate free inode in inode table
-    ssize_t inodeidx = allocFreeInode();
-    if (inodeidx < 0) return -1;
+    forgetAllReadahead(fs);
+    flushAllData(fs);
+    inodeCacheFlush(&fs->InodeCache);
+    reclaimMagazines(fs, NULL, 0);
 
-    size_t inodeperblk =
-        superBlock.Super.Inodes / superBlock.Super.InodeBlocks;
-    size_t bnumber = (inodeidx / inodeperblk) + 1;
+    // Save the bitmaps, then mark the image clean once they are on disk
+    if (fs->SuperBlock.Super.BitmapBlocks != 0 && !fs->SuperBlock.Super.Clean) {
+        saveBitmaps(fs);
+        disk->flush(disk);
 
-    // Record inode if found
-    Block block;
-    selfDisk->readDisk(selfDisk, bnumber, block.Data);
+        fs->SuperBlock.Super.Clean = true;
+        disk->writeDisk(disk, 0, fs->SuperBlock.Data);
+    }
+
+    // Write back anything buffered below the file system
+    disk->flush(disk);
 
-    size_t adjustedinumber = inodeidx % inodeperblk;
+    bitmapDestroy(&fs->InodeMap);
+    bitmapDestroy(&fs->BlockMap);
+    rangeTreeDestroy(&fs->FreeExtents);
+    free(fs->Groups);
+    fs->Groups = NULL;
+    fs->GroupCount = 0;
+    free(fs->BlockFreeInodes);
+    fs->BlockFreeInodes = NULL;
+
+    // Forget cached inodes, they belong to this disk
+    inodeCacheDestroy(&fs->InodeCache);
+    mapCacheDestroy(&fs->MapCache);
+
+    fs->Disk = NULL;
+    disk->unmount(disk);
+
+    return true;
+}
+
+// Create inode ----------------------------------------------------------------
 
-    bzero(&block.Inodes[adjustedinumber], sizeof(Inode));
-    block.Inodes[adjustedinumber].Valid = OCCUPIED;
+ssize_t create(FileSystem *self) {
+    FileSystemState *fs = self->State;
 
-    saveInode(inodeidx, &block.Inodes[adjustedinumber]);
+    pthread_rwlock_rdlock(&fs->MountLock);
 
+    // Locate free inode in inode table, in the group with the most room
+    ssize_t inodeidx = hasDiskMounted(fs) ? allocFreeInode(fs) : -1;
+
+    // Record inode if found, the inode block is updated when it is written back
+    if (inodeidx >= 0) {
+        Inode inode = {0};
+        inode.Valid = OCCUPIED;
+        saveInode(fs, inodeidx, &inode);
+    }
+
+    pthread_rwlock_unlock(&fs->MountLock);
     return inodeidx;
 }
 
 // Remove inode ----------------------------------------------------------------
 
-void freeIndirectBlock(int indirectBlock) {
+void freeIndirectBlock(FileSystemState *fs, int indirectBlock) {
     Block indirectBlk;
-    selfDisk->readDisk(selfDisk, indirectBlock, indirectBlk.Data);
+    fs->Disk->readDisk(fs->Disk, indirectBlock, indirectBlk.Data);
 
     for (size_t pointer = 0;
-         pointer < POINTERS_PER_BLOCK && pointer < superBlock.Super.Blocks;
+         pointer < POINTERS_PER_BLOCK && pointer < fs->SuperBlock.Super.Blocks;
          pointer++) {
         // printf("pointer: %d...\n", pointer);
         if (indirectBlk.Pointers[pointer] == FREE) continue;
-        freeblkmap[indirectBlk.Pointers[pointer]] = FREE;
+        releaseBlocks(fs, indirectBlk.Pointers[pointer], 1);
         indirectBlk.Pointers[pointer] = FREE;
     }
-    selfDisk->writeDisk(selfDisk, indirectBlock, indirectBlk.Data);
+    fs->Disk->writeDisk(fs->Disk, indirectBlock, indirectBlk.Data);
 
-    freeblkmap[indirectBlock] = FREE;
+    releaseBlocks(fs, indirectBlock, 1);
 }
 
-bool removeInode(size_t inumber) {
-    // Load inode information
-    Inode inode;
-    if (!loadInode(inumber, &inode)) {
-        return false;
+// Free the extents below an extent tree block, then the block itself
+void freeExtentNode(FileSystemState *fs, uint32_t number, size_t level) {
+    if (number == FREE || number >= fs->SuperBlock.Super.Blocks) return;
+
+    Block node;
+    fs->Disk->readDisk(fs->Disk, number, node.Data);
+    if (level + node.Node.Depth <= EXTENT_MAX_DEPTH && node.Node.Count <= EXTENTS_PER_BLOCK) {
+        for (size_t i = 0; i < node.Node.Count; i++) {
+            Extent *entry = &node.Node.Entries[i];
+            if (node.Node.Depth > 0)
+                freeExtentNode(fs, entry->Start, level + 1);
+            else if (validExtent(entry, fs->SuperBlock.Super.Blocks))
+                releaseBlocks(fs, entry->Start, entry->Length);
+        }
     }
 
-    // Clear inode in inode table
-    inodetable[inumber] = FREE;
-    inode.Valid = FREE;
-    inode.Size = 0;
+    releaseBlocks(fs, number, 1);
+}
+
+// Free every block of an extent inode, one extent at a time
+void freeInodeExtents(FileSystemState *fs, Inode *inode) {
+    for (size_t i = 0; i < EXTENTS_PER_INODE; i++) {
+        if (validExtent(&inode->Extents[i], fs->SuperBlock.Super.Blocks))
+            releaseBlocks(fs, inode->Extents[i].Start, inode->Extents[i].Length);
+    }
+    freeExtentNode(fs, inode->ExtentTree, 0);
+
+    memset(inode->Extents, 0, sizeof(inode->Extents));
+    inode->ExtentTree = FREE;
+}
+
+// Free every block an inode holds, leaving "inode" to be stored. The inode
+// number itself is released by the caller once the cleared inode is stored
+// or cached, so it cannot be handed out while the old contents are current.
+void clearInode(FileSystemState *fs, size_t inumber, Inode *inode) {
+    mapCacheInvalidate(&fs->MapCache, inumber, 0);
+    forgetReadahead(fs, inumber);
+    dropInodeData(fs, inumber);
+    inode->Valid = FREE;
+    inode->Size = 0;
+
+    if (usesExtents(fs)) {
+        freeInodeExtents(fs, inode);
+        return;
+    }
 
     // Free direct blocks
     for (int direct = 0; direct < POINTERS_PER_INODE; direct++) {
-        if (inode.Direct[direct] == FREE) continue;
-        freeblkmap[inode.Direct[direct]] = FREE;
-        inode.Direct[direct] = FREE;
+        if (inode->Direct[direct] == FREE) continue;
+        releaseBlocks(fs, inode->Direct[direct], 1);
+        inode->Direct[direct] = FREE;
     }
     // printf("freed direct blocks...\n");
 
     // Free indirect blocks
-    if (inode.Indirect != FREE) {
-        freeIndirectBlock(inode.Indirect);
-        inode.Indirect = FREE;
+    if (inode->Indirect != FREE) {
+        freeIndirectBlock(fs, inode->Indirect);
+        inode->Indirect = FREE;
     }
 
-    if (inode.DoubleIndirect != FREE) {
+    if (inode->DoubleIndirect != FREE) {
         Block doubleIndirect;
-        selfDisk->readDisk(selfDisk, inode.DoubleIndirect, doubleIndirect.Data);
+        fs->Disk->readDisk(fs->Disk, inode->DoubleIndirect, doubleIndirect.Data);
         for (size_t pointer = 0;
-             pointer < POINTERS_PER_BLOCK && pointer < superBlock.Super.Blocks;
+             pointer < POINTERS_PER_BLOCK && pointer < fs->SuperBlock.Super.Blocks;
              pointer++) {
             if (doubleIndirect.Pointers[pointer] != FREE)
-                freeIndirectBlock(doubleIndirect.Pointers[pointer]);
+                freeIndirectBlock(fs, doubleIndirect.Pointers[pointer]);
         }
-        inode.DoubleIndirect = FREE;
+        releaseBlocks(fs, inode->DoubleIndirect, 1);
+        inode->DoubleIndirect = FREE;
     }
     fprintf(stderr, "freed indirect blocks...\n");
+}
 
-    saveInode(inumber, &inode);
+bool removeInode(FileSystem *self, size_t inumber) {
+    FileSystemState *fs = self->State;
 
-    return true;
+    pthread_rwlock_rdlock(&fs->MountLock);
+    pthread_rwlock_wrlock(inodeLock(fs, inumber));
+
+    // Load inode information
+    Inode inode;
+    bool removed = loadInode(fs, inumber, &inode);
+    if (removed) {
+        clearInode(fs, inumber, &inode);
+        saveInode(fs, inumber, &inode);
+        releaseInode(fs, inumber);
+    }
+
+    pthread_rwlock_unlock(inodeLock(fs, inumber));
+    pthread_rwlock_unlock(&fs->MountLock);
+    return removed;
 }
 
 // Inode stat ------------------------------------------------------------------
 
-ssize_t stat(size_t inumber) {
-    if (!hasDiskMounted()) {
+ssize_t stat(FileSystem *self, size_t inumber) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_rdlock(&fs->MountLock);
+    ssize_t size = -1;
+
+    if (!hasDiskMounted(fs)) {
         fprintf(stderr, "Mount disk first...\n");
+        pthread_rwlock_unlock(&fs->MountLock);
         return -1;
     }
 
     // Load inode information
     Inode inode;
-    if (!loadInode(inumber, &inode)) {
+    pthread_rwlock_rdlock(inodeLock(fs, inumber));
+    if (loadInode(fs, inumber, &inode))
+        size = inode.Size;
+    else
         fprintf(stderr, "Invalid inode...\n");
+    pthread_rwlock_unlock(inodeLock(fs, inumber));
+
+    pthread_rwlock_unlock(&fs->MountLock);
+    return size;
+}
+
+// Batched inode operations ----------------------------------------------------
+
+/**
+ * The batched operations sort the inodes they are given and go through them
+ * one inode block at a time, holding the locks of the inodes in the block,
+ * reading the block once, changing every listed inode in it and writing it
+ * once. Cached copies of those inodes are newer than the block, so they are
+ * used in its place and refreshed before the block is stored; inodes that
+ * are not cached are left out of the inode cache, so a large batch does not
+ * push out the inodes in use.
+ */
+
+// Sort a copy of an inode list, dropping repeated inodes
+size_t *sortInumbers(size_t *inumbers, size_t *count) {
+    size_t *sorted = malloc(*count * sizeof(size_t));
+    memcpy(sorted, inumbers, *count * sizeof(size_t));
+    qsort(sorted, *count, sizeof(size_t), compareInumbers);
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < *count; i++) {
+        if (distinct == 0 || sorted[distinct - 1] != sorted[i])
+            sorted[distinct++] = sorted[i];
+    }
+    *count = distinct;
+    return sorted;
+}
+
+// Number of inodes at the front of a sorted list that share its first inode block
+size_t inodesInBlock(size_t *inumbers, size_t count) {
+    size_t inBlock = 1;
+    while (inBlock < count && inumbers[inBlock] / INODES_PER_BLOCK == inumbers[0] / INODES_PER_BLOCK)
+        inBlock++;
+    return inBlock;
+}
+
+// Take up to "count" free inodes and store them, blank, one block write per inode block
+ssize_t createMany(FileSystem *self, size_t count, size_t *inumbers) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_rdlock(&fs->MountLock);
+    if (!hasDiskMounted(fs)) {
+        pthread_rwlock_unlock(&fs->MountLock);
         return -1;
-    };
+    }
+
+    size_t created = 0;
+    while (created < count) {
+        ssize_t inumber = allocFreeInode(fs);
+        if (inumber < 0) break;
+        inumbers[created++] = inumber;
+    }
+
+    size_t stored = created;
+    size_t *sorted = sortInumbers(inumbers, &stored);
+    Inode *inodes = calloc(INODES_PER_BLOCK, sizeof(Inode));
+    Inode **pointers = malloc(INODES_PER_BLOCK * sizeof(Inode *));
+    pthread_rwlock_t **held = malloc(INODES_PER_BLOCK * sizeof(pthread_rwlock_t *));
+
+    for (size_t i = 0; i < stored;) {
+        size_t inBlock = inodesInBlock(sorted + i, stored - i);
+        size_t locks = lockInodes(fs, sorted + i, inBlock, true, held);
+
+        for (size_t n = 0; n < inBlock; n++) {
+            inodes[n].Valid = OCCUPIED;
+            pointers[n] = &inodes[n];
+            inodeCacheRefresh(&fs->InodeCache, sorted[i + n], &inodes[n]);
+        }
+        storeInodes(fs, sorted + i, pointers, inBlock);
+
+        unlockInodes(held, locks);
+        i += inBlock;
+    }
 
-    return inode.Size;
+    free(held);
+    free(pointers);
+    free(inodes);
+    free(sorted);
+    pthread_rwlock_unlock(&fs->MountLock);
+    return created;
 }
 
-// Read from inode -------------------------------------------------------------
-void readFromIndirect(Block *pointers, size_t *pointer, char *data, size_t length, int *read, size_t *offset) {
-    fprintf(stderr, "Entering readIndirect()...\n");
-    Block block;
-    while (*read < length && (*pointer) < POINTERS_PER_BLOCK && (*pointer) < superBlock.Super.Blocks) {
-        if (pointers->Pointers[(*pointer)] == FREE ||
-            freeblkmap[pointers->Pointers[(*pointer)]] == FREE)
-            break;
+// Remove the valid inodes of a list, one block read and write per inode block
+ssize_t removeMany(FileSystem *self, size_t *inumbers, size_t count) {
+    FileSystemState *fs = self->State;
 
-        selfDisk->readDisk(selfDisk, pointers->Pointers[(*pointer)], block.Data);
+    pthread_rwlock_rdlock(&fs->MountLock);
+    if (!hasDiskMounted(fs)) {
+        pthread_rwlock_unlock(&fs->MountLock);
+        return -1;
+    }
 
-        int lenData = strnlen(block.Data + *offset, BLOCK_SIZE);
-        int maxCopy = fmin(lenData, length - *read);
+    size_t *sorted = sortInumbers(inumbers, &count);
+    size_t *cleared = malloc(INODES_PER_BLOCK * sizeof(size_t));
+    Inode *inodes = malloc(INODES_PER_BLOCK * sizeof(Inode));
+    Inode **pointers = malloc(INODES_PER_BLOCK * sizeof(Inode *));
+    pthread_rwlock_t **held = malloc(INODES_PER_BLOCK * sizeof(pthread_rwlock_t *));
+    size_t removed = 0;
 
-        strncpy(data + *read, block.Data + *offset, maxCopy);
-        bzero(block.Data, BLOCK_SIZE);
+    Block block;
+    for (size_t i = 0; i < count;) {
+        size_t blockNumber = sorted[i] / INODES_PER_BLOCK + 1;
+        size_t inBlock = inodesInBlock(sorted + i, count - i);
+        size_t locks = lockInodes(fs, sorted + i, inBlock, true, held);
+
+        size_t ncleared = 0;
+        for (size_t n = 0; n < inBlock; n++) {
+            size_t inumber = sorted[i + n];
+            if (inumber >= fs->SuperBlock.Super.Inodes || !inodeInUse(fs, inumber)) continue;
+            if (ncleared == 0) fs->Disk->readDisk(fs->Disk, blockNumber, block.Data);
+
+            Inode *inode = &inodes[ncleared];
+            *inode = block.Inodes[inumber % INODES_PER_BLOCK];
+            inodeCacheLookup(&fs->InodeCache, inumber, inode);
+            clearInode(fs, inumber, inode);
+            inodeCacheRefresh(&fs->InodeCache, inumber, inode);
+
+            pointers[ncleared] = inode;
+            cleared[ncleared++] = inumber;
+        }
 
-        (*read) += maxCopy;
+        if (ncleared > 0) storeInodes(fs, cleared, pointers, ncleared);
+        for (size_t n = 0; n < ncleared; n++) releaseInode(fs, cleared[n]);
+        removed += ncleared;
 
-        *offset = 0;
-        (*pointer)++;
+        unlockInodes(held, locks);
+        i += inBlock;
     }
-    return;
+
+    free(held);
+    free(pointers);
+    free(inodes);
+    free(cleared);
+    free(sorted);
+    pthread_rwlock_unlock(&fs->MountLock);
+    return removed;
 }
 
-ssize_t readInode(size_t inumber, char *data, size_t length, size_t offset) {
-    fprintf(stderr, "readInode(inumber:%ld, length:%ld, offset:%ld)\n", inumber,
-            length, offset);
-    // Load inode information
-    Inode inode;
-    if (!loadInode(inumber, &inode)) {
+// Find the sizes of a list of inodes, one block read per inode block
+ssize_t statMany(FileSystem *self, size_t *inumbers, size_t count, ssize_t *sizes) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_rdlock(&fs->MountLock);
+    if (!hasDiskMounted(fs)) {
+        pthread_rwlock_unlock(&fs->MountLock);
         return -1;
     }
-    // printf("Loaded inode...\n"); // debug
 
-    // Adjust length
-    size_t offsetedDataBlock = offset / BLOCK_SIZE;
-    offset %= BLOCK_SIZE;
+    size_t distinct = count;
+    size_t *sorted = sortInumbers(inumbers, &distinct);
+    ssize_t *found = malloc(distinct * sizeof(ssize_t));
+    pthread_rwlock_t **held = malloc(INODES_PER_BLOCK * sizeof(pthread_rwlock_t *));
+
     Block block;
-    bzero(block.Data, BLOCK_SIZE);
-    int read = 0;
+    for (size_t i = 0; i < distinct;) {
+        size_t blockNumber = sorted[i] / INODES_PER_BLOCK + 1;
+        size_t inBlock = inodesInBlock(sorted + i, distinct - i);
+        size_t locks = lockInodes(fs, sorted + i, inBlock, false, held);
+
+        bool loaded = false;
+        for (size_t end = i + inBlock; i < end; i++) {
+            found[i] = -1;
+            if (sorted[i] >= fs->SuperBlock.Super.Inodes || !inodeInUse(fs, sorted[i]))
+                continue;
+
+            Inode inode;
+            if (!inodeCacheLookup(&fs->InodeCache, sorted[i], &inode)) {
+                if (!loaded) {
+                    fs->Disk->readDisk(fs->Disk, blockNumber, block.Data);
+                    loaded = true;
+                }
+                inode = block.Inodes[sorted[i] % INODES_PER_BLOCK];
+            }
+            found[i] = inode.Size;
+        }
+
+        unlockInodes(held, locks);
+    }
+
+    // Hand the sizes back in the order the inodes were asked for
+    ssize_t valid = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t *match = bsearch(&inumbers[i], sorted, distinct, sizeof(size_t), compareInumbers);
+        sizes[i] = found[match - sorted];
+        if (sizes[i] >= 0) valid++;
+    }
+
+    free(held);
+    free(found);
+    free(sorted);
+    pthread_rwlock_unlock(&fs->MountLock);
+    return valid;
+}
+
+// File handles ----------------------------------------------------------------
+
+/**
+ * A handle keeps the inode it was opened on, the file position and the
+ * pointer blocks it last used: the indirect block, the double indirect block
+ * and one indirect block below it. Streaming through a handle finds the
+ * pointers in memory instead of reloading the inode and re-reading the
+ * pointer tree for every chunk. Pointer blocks changed by a write are written
+ * back, and the inode saved, before the write returns.
+ */
 
-    // printf("StartBlock %d\n", startBlock); // debug
-    while (offsetedDataBlock < POINTERS_PER_INODE && read < length) {
-        if (freeblkmap[inode.Direct[offsetedDataBlock]] == FREE ||
-            inode.Direct[offsetedDataBlock] == FREE)
+void storePointerBlock(FileSystemState *fs, PointerBlock *slot) {
+    if (!slot->Dirty) return;
+
+    fs->Disk->writeDisk(fs->Disk, slot->Number, slot->Data.Data);
+    slot->Dirty = false;
+}
+
+// Return the contents of a pointer block, reading it unless it is held already
+Block *pointerBlock(FileSystemState *fs, PointerBlock *slot, uint32_t number) {
+    if (slot->Number != number) {
+        storePointerBlock(fs, slot);
+        fs->Disk->readDisk(fs->Disk, number, slot->Data.Data);
+        slot->Number = number;
+    }
+    return &slot->Data;
+}
+
+// Start a newly allocated pointer block with every pointer free, without reading it
+Block *freshPointerBlock(FileSystemState *fs, PointerBlock *slot, uint32_t number) {
+    storePointerBlock(fs, slot);
+    memset(slot->Data.Data, 0, BLOCK_SIZE);
+    slot->Number = number;
+    slot->Dirty = true;
+    return &slot->Data;
+}
+
+bool initHandle(FileSystemState *fs, FileHandle *handle, size_t inumber) {
+    memset(handle, 0, sizeof(FileHandle));
+    handle->Inumber = inumber;
+    return loadInode(fs, inumber, &handle->Inode);
+}
+
+// Reload the inode in every other open handle on it, after it changed
+void refreshHandles(FileSystemState *fs, size_t inumber, FileHandle *except) {
+    pthread_mutex_lock(&fs->HandlesLock);
+    for (FileHandle *other = fs->OpenHandles; other != NULL; other = other->Next) {
+        if (other == except || other->Inumber != inumber) continue;
+
+        loadInode(fs, inumber, &other->Inode);
+        other->Indirect.Number = FREE;
+        other->DoubleIndirect.Number = FREE;
+        other->Level.Number = FREE;
+    }
+    pthread_mutex_unlock(&fs->HandlesLock);
+}
+
+// Extent inodes ---------------------------------------------------------------
+
+/**
+ * With SUPER_EXTENTS set, an inode holds the first EXTENTS_PER_INODE extents
+ * of its file and an extent tree holds the rest. Tree leaves hold extents in
+ * file order; index nodes hold one entry per child, naming the child block
+ * and the number of file blocks below it, so whole subtrees are skipped when
+ * mapping. Files only grow at their end, so new blocks extend the last
+ * extent or are appended along the rightmost path of the tree. A full root
+ * is pushed down into a new block, keeping its own block number, until the
+ * tree is EXTENT_MAX_DEPTH levels deep. A handle holds one tree block per
+ * level in its pointer block slots.
+ */
+
+void setExtentInodes(FileSystem *self, bool enabled) {
+    self->State->ExtentInodes = enabled;
+}
+
+bool usesExtents(FileSystemState *fs) {
+    return fs->SuperBlock.Super.Flags & SUPER_EXTENTS;
+}
+
+PointerBlock *extentSlot(FileHandle *handle, size_t level) {
+    PointerBlock *slots[] = {&handle->Indirect, &handle->DoubleIndirect, &handle->Level};
+    return slots[level];
+}
+
+bool validExtent(Extent *extent, uint32_t blocks) {
+    return extent->Length > 0 && extent->Start != FREE &&
+           (uint64_t)extent->Start + extent->Length <= blocks;
+}
+
+/**
+ * @brief Copy the blocks of an extent that fall in [first, first + count)
+ * to "blocks". The extent starts at file block "*fileblk", which is moved
+ * past it.
+ *
+ * @return bool false once the range is mapped
+ */
+bool mapExtent(Extent *extent, size_t *fileblk, size_t first, size_t count,
+               uint32_t *blocks, size_t *mapped) {
+    size_t end = *fileblk + extent->Length;
+    size_t stop = fmin(end, first + count);
+
+    for (size_t b = fmax(*fileblk, first); b < stop; b++) {
+        blocks[b - first] = extent->Start + (b - *fileblk);
+    }
+    if (stop > first) *mapped = stop - first;
+
+    *fileblk = end;
+    return end < first + count;
+}
+
+bool walkExtentNode(FileSystemState *fs, FileHandle *handle, size_t level, uint32_t number, size_t *fileblk,
+                    size_t first, size_t count, uint32_t *blocks, size_t *mapped) {
+    if (number == FREE || number >= fs->SuperBlock.Super.Blocks) return false;
+
+    ExtentNode *node = &pointerBlock(fs, extentSlot(handle, level), number)->Node;
+    if (level + node->Depth > EXTENT_MAX_DEPTH || node->Count > EXTENTS_PER_BLOCK)
+        return false;
+
+    // Children are held one level down, in a slot of their own
+    for (size_t i = 0; i < node->Count; i++) {
+        Extent *entry = &node->Entries[i];
+        if (node->Depth == 0) {
+            if (!validExtent(entry, fs->SuperBlock.Super.Blocks) ||
+                !mapExtent(entry, fileblk, first, count, blocks, mapped))
+                return false;
+        } else if (*fileblk + entry->Length <= first) {
+            *fileblk += entry->Length;
+        } else if (!walkExtentNode(fs, handle, level + 1, entry->Start, fileblk,
+                                   first, count, blocks, mapped)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Translate "count" file blocks, starting at file block "first", into
+ * data block numbers by walking the extents of the inode
+ *
+ * @param covered set to the number of file blocks the extents cover, when
+ * the walk reaches the last extent
+ * @return size_t number of blocks mapped before the end of the extents
+ */
+size_t walkExtents(FileSystemState *fs, FileHandle *handle, size_t first, size_t count, uint32_t *blocks,
+                   size_t *covered) {
+    Inode *inode = &handle->Inode;
+    size_t fileblk = 0;
+    size_t mapped = 0;
+
+    for (size_t i = 0; i < EXTENTS_PER_INODE; i++) {
+        if (!validExtent(&inode->Extents[i], fs->SuperBlock.Super.Blocks)) break;
+        if (!mapExtent(&inode->Extents[i], &fileblk, first, count, blocks, &mapped))
+            return mapped;
+    }
+
+    if (inode->ExtentTree != FREE &&
+        !walkExtentNode(fs, handle, 0, inode->ExtentTree, &fileblk, first, count, blocks, &mapped))
+        return mapped;
+
+    if (covered != NULL) *covered = fileblk;
+    return mapped;
+}
+
+// Whether or not a block continues an extent
+bool extendsExtent(Extent *extent, uint32_t block) {
+    return extent->Length > 0 && extent->Start + extent->Length == block;
+}
+
+// Start a chain of new tree blocks, from "level" down to a leaf holding "block"
+ssize_t newExtentPath(FileSystemState *fs, FileHandle *handle, size_t level, uint32_t depth, uint32_t block) {
+    ssize_t number = allocFreeBlock(fs, FREE);
+    if (number <= 0) return -1;
+
+    Extent entry = {block, 1};
+    if (depth > 0) {
+        ssize_t child = newExtentPath(fs, handle, level + 1, depth - 1, block);
+        if (child <= 0) {
+            releaseBlocks(fs, number, 1);
+            return -1;
+        }
+        entry.Start = child;
+    }
+
+    ExtentNode *node = &freshPointerBlock(fs, extentSlot(handle, level), number)->Node;
+    node->Depth = depth;
+    node->Count = 1;
+    node->Entries[0] = entry;
+    return number;
+}
+
+// Append a block to the subtree at "number"; false if the subtree is full
+bool appendToNode(FileSystemState *fs, FileHandle *handle, size_t level, uint32_t number, uint32_t block) {
+    PointerBlock *slot = extentSlot(handle, level);
+    ExtentNode *node = &pointerBlock(fs, slot, number)->Node;
+
+    if (node->Depth == 0) {
+        if (node->Count > 0 && extendsExtent(&node->Entries[node->Count - 1], block)) {
+            node->Entries[node->Count - 1].Length++;
+        } else if (node->Count < EXTENTS_PER_BLOCK) {
+            node->Entries[node->Count++] = (Extent){block, 1};
+        } else {
+            return false;
+        }
+        slot->Dirty = true;
+        return true;
+    }
+
+    Extent *last = &node->Entries[node->Count - 1];
+    if (appendToNode(fs, handle, level + 1, last->Start, block)) {
+        last->Length++;
+    } else if (node->Count < EXTENTS_PER_BLOCK) {
+        ssize_t child = newExtentPath(fs, handle, level + 1, node->Depth - 1, block);
+        if (child <= 0) return false;
+        node->Entries[node->Count++] = (Extent){child, 1};
+    } else {
+        return false;
+    }
+    slot->Dirty = true;
+    return true;
+}
+
+// Move the contents of the full root into a new block below it
+bool pushDownRoot(FileSystemState *fs, FileHandle *handle) {
+    PointerBlock *rootSlot = extentSlot(handle, 0);
+    ExtentNode *root = &pointerBlock(fs, rootSlot, handle->Inode.ExtentTree)->Node;
+    if (root->Depth >= EXTENT_MAX_DEPTH) return false;
+
+    ssize_t moved = allocFreeBlock(fs, FREE);
+    if (moved <= 0) return false;
+
+    // Every block below the root moves down a level, so the other slots are emptied
+    for (size_t level = 1; level <= EXTENT_MAX_DEPTH; level++) {
+        PointerBlock *slot = extentSlot(handle, level);
+        storePointerBlock(fs, slot);
+        slot->Number = FREE;
+    }
+
+    uint32_t covered = 0;
+    for (size_t i = 0; i < root->Count; i++) covered += root->Entries[i].Length;
+
+    Block *copy = freshPointerBlock(fs, extentSlot(handle, 1), moved);
+    memcpy(copy->Data, rootSlot->Data.Data, BLOCK_SIZE);
+
+    root->Depth++;
+    root->Count = 1;
+    root->Entries[0] = (Extent){moved, covered};
+    rootSlot->Dirty = true;
+    return true;
+}
+
+// Add a block at the end of the file; false if no block is left for the tree
+bool appendExtent(FileSystemState *fs, FileHandle *handle, uint32_t block) {
+    Inode *inode = &handle->Inode;
+
+    if (inode->ExtentTree == FREE) {
+        size_t used = 0;
+        while (used < EXTENTS_PER_INODE && inode->Extents[used].Length > 0) used++;
+
+        if (used > 0 && extendsExtent(&inode->Extents[used - 1], block)) {
+            inode->Extents[used - 1].Length++;
+            return true;
+        }
+        if (used < EXTENTS_PER_INODE) {
+            inode->Extents[used] = (Extent){block, 1};
+            return true;
+        }
+
+        ssize_t root = newExtentPath(fs, handle, 0, 0, block);
+        if (root <= 0) return false;
+        inode->ExtentTree = root;
+        return true;
+    }
+
+    if (appendToNode(fs, handle, 0, inode->ExtentTree, block)) return true;
+    return pushDownRoot(fs, handle) && appendToNode(fs, handle, 0, inode->ExtentTree, block);
+}
+
+// Last block of the file on disk, where the next block is best placed after
+uint32_t lastExtentBlock(FileSystemState *fs, FileHandle *handle) {
+    Inode *inode = &handle->Inode;
+    if (inode->ExtentTree == FREE) {
+        uint32_t last = 0;
+        for (size_t i = 0; i < EXTENTS_PER_INODE && inode->Extents[i].Length > 0; i++)
+            last = inode->Extents[i].Start + inode->Extents[i].Length - 1;
+        return last;
+    }
+
+    uint32_t number = inode->ExtentTree;
+    for (size_t level = 0; level <= EXTENT_MAX_DEPTH; level++) {
+        ExtentNode *node = &pointerBlock(fs, extentSlot(handle, level), number)->Node;
+        if (node->Count == 0) return 0;
+
+        Extent *last = &node->Entries[node->Count - 1];
+        if (node->Depth == 0) return last->Start + last->Length - 1;
+        number = last->Start;
+    }
+    return 0;
+}
+
+/**
+ * @brief Translate "count" file blocks, starting at file block "first", into
+ * data block numbers, appending extents for blocks past the end of the file.
+ * Blocks skipped over between the end of the file and "first" are zeroed so
+ * the extents stay free of holes. Tree blocks are updated in the handle and
+ * marked dirty.
+ *
+ * @return size_t number of blocks mapped before the disk filled up
+ */
+size_t allocExtentBlocks(FileSystemState *fs, FileHandle *handle, size_t first, size_t count, uint32_t *blocks) {
+    size_t covered = SIZE_MAX;
+    size_t mapped = walkExtents(fs, handle, first, count, blocks, &covered);
+
+    // Nothing is appended to extents that end in a damaged one
+    if (mapped == count || covered == SIZE_MAX) return mapped;
+
+    // Runs as long as the blocks missing, the first right after the file if possible
+    Block zero = {0};
+    uint32_t last = lastExtentBlock(fs, handle);
+    BlockRun run = {last != 0 ? last + 1 : inodeGoal(fs, handle->Inumber), 0};
+    for (size_t fileblk = covered; fileblk < first + count; fileblk++) {
+        ssize_t block = runBlock(fs, &run, first + count - fileblk);
+        if (block < 0) break;
+        if (!appendExtent(fs, handle, block)) {
+            releaseBlocks(fs, block, 1);
             break;
+        }
+
+        if (fileblk < first) {
+            fs->Disk->writeDisk(fs->Disk, block, zero.Data);
+        } else {
+            blocks[fileblk - first] = block;
+            mapped = fileblk - first + 1;
+        }
+    }
 
-        fprintf(stderr, "Hi %d\n", inode.Direct[offsetedDataBlock]);
+    releaseRun(fs, &run);
+    return mapped;
+}
 
-        selfDisk->readDisk(selfDisk, inode.Direct[offsetedDataBlock],
-                           block.Data);
+// Read from inode -------------------------------------------------------------
 
-        int lenData = strnlen(block.Data + offset, BLOCK_SIZE);
-        int maxCopy = fmin(lenData, length - read);
+/**
+ * @brief Collect the data blocks referenced by a pointer block, starting at
+ * "*pointer", until "count" blocks are mapped or a hole is found
+ *
+ * @return bool false if a hole ended the mapping
+ */
+bool readFromIndirect(FileSystemState *fs, Block *pointers, size_t *pointer, uint32_t *blocks, size_t count, size_t *mapped) {
+    while (*mapped < count && *pointer < POINTERS_PER_BLOCK) {
+        uint32_t blk = pointers->Pointers[*pointer];
+        if (blk == FREE || blk >= fs->SuperBlock.Super.Blocks || !blockInUse(fs, blk))
+            return false;
 
-        strncpy(data + read, block.Data + offset, maxCopy);
-        bzero(block.Data, BLOCK_SIZE);
+        blocks[(*mapped)++] = blk;
+        (*pointer)++;
+    }
+    return true;
+}
 
-        read += maxCopy;
+/**
+ * @brief Translate "count" file blocks, starting at file block "first", into
+ * data block numbers by walking the pointer blocks. Pointer blocks come from
+ * the handle when it holds them.
+ *
+ * @return size_t number of blocks mapped before the end of the file
+ */
+size_t walkInodeBlocks(FileSystemState *fs, FileHandle *handle, size_t first, size_t count, uint32_t *blocks) {
+    if (usesExtents(fs)) return walkExtents(fs, handle, first, count, blocks, NULL);
 
-        fprintf(stderr, "Read: %d | Offset:%ld\n", read, offset);
-        offset = 0;
-        offsetedDataBlock++;
+    Inode *inode = &handle->Inode;
+    size_t mapped = 0;
+    size_t fileblk = first;
+
+    while (mapped < count && fileblk < POINTERS_PER_INODE) {
+        uint32_t blk = inode->Direct[fileblk];
+        if (blk == FREE || blk >= fs->SuperBlock.Super.Blocks || !blockInUse(fs, blk))
+            return mapped;
+
+        blocks[mapped++] = blk;
+        fileblk++;
     }
 
-    fprintf(stderr, "Ended reading directs...\n");
-    if (inode.Indirect != FREE &&
-        offsetedDataBlock < POINTERS_PER_BLOCK + POINTERS_PER_INODE &&
-        read < length) {
-        // if (inode.Indirect != FREE) {
-        fprintf(stderr, "Started reading indirects...\n");
+    if (mapped < count && fileblk < POINTERS_PER_INODE + POINTERS_PER_BLOCK) {
+        if (inode->Indirect == FREE) return mapped;
 
-        Block pointers;
-        selfDisk->readDisk(selfDisk, inode.Indirect, pointers.Data);
+        Block *pointers = pointerBlock(fs, &handle->Indirect, inode->Indirect);
 
-        // adjust offsetedDataBlock to start at 0 to account for zero-start
+        // adjust fileblk to start at 0 to account for zero-start
         // at the pointer data block
-        size_t pointer = offsetedDataBlock - POINTERS_PER_INODE;
-        readFromIndirect(&pointers, &pointer, data, length, &read, &offset);
-        offsetedDataBlock = pointer + POINTERS_PER_INODE;
+        size_t pointer = fileblk - POINTERS_PER_INODE;
+        if (!readFromIndirect(fs, pointers, &pointer, blocks, count, &mapped))
+            return mapped;
+        fileblk = pointer + POINTERS_PER_INODE;
     }
 
-    if (inode.DoubleIndirect != FREE && read < length) {
-        fprintf(stderr, "Reading Double Indirect...\n");
+    if (mapped < count) {
+        if (inode->DoubleIndirect == FREE) return mapped;
 
-        Block doubleIndirect;
-        selfDisk->readDisk(selfDisk, inode.DoubleIndirect, doubleIndirect.Data);
+        Block *doubleIndirect = pointerBlock(fs, &handle->DoubleIndirect, inode->DoubleIndirect);
 
-        size_t pointer = offsetedDataBlock - POINTERS_PER_BLOCK - POINTERS_PER_INODE;
-        size_t indirectBlockIdx = (pointer / POINTERS_PER_BLOCK);
+        size_t pointer = fileblk - POINTERS_PER_BLOCK - POINTERS_PER_INODE;
+        size_t indirectBlockIdx = pointer / POINTERS_PER_BLOCK;
         pointer %= POINTERS_PER_BLOCK;
 
-        while (read < length && indirectBlockIdx < POINTERS_PER_BLOCK) {
-            if (doubleIndirect.Pointers[indirectBlockIdx] == FREE ||
-                freeblkmap[doubleIndirect.Pointers[indirectBlockIdx]] == FREE) break;
-            // get indirect and read
-            Block indirect;
-            selfDisk->readDisk(selfDisk, indirectBlockIdx, indirect.Data);
+        while (mapped < count && indirectBlockIdx < POINTERS_PER_BLOCK) {
+            uint32_t indblk = doubleIndirect->Pointers[indirectBlockIdx];
+            if (indblk == FREE || indblk >= fs->SuperBlock.Super.Blocks ||
+                !blockInUse(fs, indblk))
+                break;
 
-            readFromIndirect(&indirect, &pointer, data, length, &read, &offset);
+            Block *indirect = pointerBlock(fs, &handle->Level, indblk);
+            if (!readFromIndirect(fs, indirect, &pointer, blocks, count, &mapped))
+                break;
 
-            offsetedDataBlock += pointer;
             indirectBlockIdx++;
             pointer = 0;
         }
     }
 
-    return read;
+    return mapped;
 }
 
-// Write to inode --------------------------------------------------------------
+/**
+ * @brief Translate "count" file blocks, starting at file block "first", into
+ * data block numbers. Translations come from the map cache as far as it
+ * knows them; the rest are walked and added to it.
+ *
+ * @return size_t number of blocks mapped before the end of the file
+ */
+size_t mapInodeBlocks(FileSystemState *fs, FileHandle *handle, size_t first, size_t count, uint32_t *blocks) {
+    size_t cached = mapCacheLookup(&fs->MapCache, handle->Inumber, first, count, blocks);
+    if (cached == count) return count;
 
-void writeToIndirect(Block *pointers, size_t *pointer, char *data, size_t length, uint32_t *written, size_t *offset) {
-    Block block;
-    ssize_t freeblk;
+    size_t mapped = walkInodeBlocks(fs, handle, first + cached, count - cached, blocks + cached);
+    mapCacheInsert(&fs->MapCache, handle->Inumber, first + cached, blocks + cached, mapped);
+
+    return cached + mapped;
+}
+
+/**
+ * @brief Queue asynchronous transfers for "count" mapped blocks, one request
+ * per run of physically consecutive blocks. Wait on the returned ticket before
+ * touching the buffers; it covers every request queued here, and only waits
+ * for other threads' requests that were queued before them.
+ *
+ * @param blocks data block numbers
+ * @param iov one BLOCK_SIZE buffer per block, must stay valid until waited on
+ * @param count number of blocks
+ * @param isWrite whether to write the buffers instead of reading into them
+ * @return ssize_t ticket of the last request, 0 if there was none
+ */
+ssize_t transferRuns(FileSystemState *fs, uint32_t *blocks, struct iovec *iov, size_t count, bool isWrite) {
+    ssize_t ticket = 0;
+    size_t start = 0;
+    while (start < count) {
+        size_t end = start + 1;
+        while (end < count && end - start < MAX_RUN_BLOCKS &&
+               blocks[end] == blocks[end - 1] + 1) {
+            end++;
+        }
 
-    while (*written < length && *pointer < POINTERS_PER_BLOCK) {
-        freeblk = allocFreeBlock(pointers->Pointers[*pointer]);
+        ssize_t queued;
+        if (isWrite)
+            queued = fs->Disk->writeDiskAsync(fs->Disk, blocks[start], iov + start, end - start);
+        else
+            queued = fs->Disk->readDiskAsync(fs->Disk, blocks[start], iov + start, end - start);
+        if (queued > ticket) ticket = queued;
 
-        if (freeblk <= 0) break;
+        start = end;
+    }
+    return ticket;
+}
 
-        pointers->Pointers[*pointer] = freeblk;
-        fprintf(stderr, "Free Blck: %ld\n", freeblk);
+// Readahead -------------------------------------------------------------------
+
+/**
+ * Reads that start where the previous read of the same inode stopped form a
+ * stream. Once a stream has used up its prefetched blocks, the next window
+ * is mapped and queued asynchronously as the read returns, so the disk works
+ * on it while the caller consumes the data. Every window is twice the size
+ * of the previous one, up to ReadaheadBlocks, and a read anywhere else
+ * starts over with the smallest window. Mapping a window ahead of the reader
+ * also brings in the next pointer block before the reader needs it. The
+ * streams are guarded by ReadaheadLock, which is only held to look at or
+ * change them. A read takes the prefetched window out of its stream, waits
+ * for it and copies from it with the lock let go, then hands back what is
+ * left. The next window is mapped and queued without the lock and put into
+ * the stream afterwards, unless the stream has meanwhile been taken over by
+ * another inode or given a window by another reader. Windows taken out of
+ * streams are waited for and freed only after the lock is let go.
+ */
+
+typedef struct Prefetch {
+    size_t First;       // First prefetched file block
+    size_t Count;       // Number of prefetched blocks (0 if none)
+    struct iovec *Iov;  // Prefetched blocks, in flight until Ticket is waited on
+    ssize_t Ticket;     // Ticket covering the reads of the blocks
+} Prefetch;
+
+struct ReadaheadStream {
+    bool Active;          // Whether or not the stream is in use
+    size_t Inumber;       // Inode being read
+    size_t NextBlock;     // File block a sequential read starts in
+    size_t Window;        // Number of blocks to prefetch next
+    Prefetch Prefetched;  // Window queued for the next sequential read
+};
+
+void setReadaheadBlocks(FileSystem *self, size_t blocks) {
+    self->State->ReadaheadBlocks = blocks;
+}
+
+// Take the prefetched window out of a stream, with ReadaheadLock held
+Prefetch detachPrefetch(ReadaheadStream *stream) {
+    Prefetch prefetch = stream->Prefetched;
+    memset(&stream->Prefetched, 0, sizeof(Prefetch));
+    return prefetch;
+}
 
-        if (*offset > 0) {
-            selfDisk->readDisk(selfDisk, freeblk, block.Data);
+// Wait for a window taken out of its stream and free it, without ReadaheadLock
+void releasePrefetch(FileSystemState *fs, Prefetch *prefetch) {
+    if (prefetch->Count == 0) return;
+
+    // The buffers belong to the disk until the requests complete
+    fs->Disk->waitDisk(fs->Disk, prefetch->Ticket);
+    releasePoolVector(fs, prefetch->Iov, prefetch->Count);
+    memset(prefetch, 0, sizeof(Prefetch));
+}
+
+void forgetReadahead(FileSystemState *fs, size_t inumber) {
+    Prefetch dropped[READAHEAD_STREAMS] = {{0}};
+    pthread_mutex_lock(&fs->ReadaheadLock);
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+        if (fs->Streams[i].Active && fs->Streams[i].Inumber == inumber) {
+            dropped[i] = detachPrefetch(&fs->Streams[i]);
+            fs->Streams[i].Active = false;
         }
+    }
+    pthread_mutex_unlock(&fs->ReadaheadLock);
 
-        int maxCopy = fmin(BLOCK_SIZE - *offset, length - *written);
-        strncpy(block.Data + *offset, data + *written, maxCopy);
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+        releasePrefetch(fs, &dropped[i]);
+    }
+}
 
-        selfDisk->writeDisk(selfDisk, freeblk, block.Data);
-        bzero(block.Data, BLOCK_SIZE);
+void forgetAllReadahead(FileSystemState *fs) {
+    Prefetch dropped[READAHEAD_STREAMS];
+    pthread_mutex_lock(&fs->ReadaheadLock);
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+        dropped[i] = detachPrefetch(&fs->Streams[i]);
+        fs->Streams[i].Active = false;
+    }
+    pthread_mutex_unlock(&fs->ReadaheadLock);
 
-        *written += maxCopy;
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+        releasePrefetch(fs, &dropped[i]);
+    }
+}
 
-        *offset = 0;
-        (*pointer)++;
+ReadaheadStream *lookupStream(FileSystemState *fs, size_t inumber) {
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+        if (fs->Streams[i].Active && fs->Streams[i].Inumber == inumber) return &fs->Streams[i];
     }
+    return NULL;
+}
 
-    // mark the end of data
-    if (*pointer < POINTERS_PER_BLOCK)
-        pointers->Pointers[*pointer] = FREE;
+// Find the stream of an inode or take over the next slot, whose window is
+// left in "dropped" for the caller to release
+ReadaheadStream *findStream(FileSystemState *fs, size_t inumber, size_t startBlock, Prefetch *dropped) {
+    ReadaheadStream *stream = lookupStream(fs, inumber);
+    if (stream != NULL) return stream;
+
+    stream = &fs->Streams[fs->NextStream];
+    fs->NextStream = (fs->NextStream + 1) % READAHEAD_STREAMS;
+
+    *dropped = detachPrefetch(stream);
+    stream->Active = true;
+    stream->Inumber = inumber;
+    stream->NextBlock = startBlock;
+    stream->Window = fmin(READAHEAD_MIN_BLOCKS, fs->ReadaheadBlocks);
+    return stream;
 }
 
-ssize_t writeInode(size_t inumber, char *data, size_t length, size_t offset) {
-    // printf("writeInode(inumber:%d, len:%d, offset:%d)\n", inumber, length,
-    // offset); Load inode
-    Inode inode;
-    if (!loadInode(inumber, &inode)) {
-        return -1;
+// Copy a prefetched block, if the window holds it
+bool takePrefetched(Prefetch *prefetch, size_t fileblk, char *data) {
+    if (fileblk < prefetch->First || fileblk >= prefetch->First + prefetch->Count)
+        return false;
+
+    memcpy(data, prefetch->Iov[fileblk - prefetch->First].iov_base, BLOCK_SIZE);
+    return true;
+}
+
+// Map and queue the reads of up to "window" blocks from file block "first"
+Prefetch queuePrefetch(FileSystemState *fs, FileHandle *handle, size_t first, size_t window) {
+    Prefetch prefetch = {0};
+    size_t fileBlocks = (handle->Inode.Size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (first >= fileBlocks) return prefetch;
+
+    size_t count = fmin(window, fileBlocks - first);
+    uint32_t *blocks = malloc(count * sizeof(uint32_t));
+    size_t mapped = mapInodeBlocks(fs, handle, first, count, blocks);
+
+    if (mapped > 0) {
+        prefetch.Iov = poolVector(fs, mapped);
+        prefetch.First = first;
+        prefetch.Count = mapped;
+        prefetch.Ticket = transferRuns(fs, blocks, prefetch.Iov, mapped, false);
     }
+    free(blocks);
+    return prefetch;
+}
 
-    // Write block and copy to data
-    bool isDiskFull = false;
-    Block block;
-    uint32_t written = 0;
-    ssize_t freeblk;
-    size_t offsetedDataBlock = offset / BLOCK_SIZE;
+// Whether or not the block at "at" in "data" can be read into place
+bool readsInPlace(FileSystemState *fs, char *data, ssize_t at, size_t length) {
+    if (at < 0 || at + BLOCK_SIZE > length) return false;
+    return fs->Disk->Buffers == NULL || bufferAligned(data + at);
+}
+
+// Written data still in memory must be given blocks first, see readLockInode
+ssize_t readHandle(FileSystemState *fs, FileHandle *handle, char *data, size_t length) {
+    // Never read past the end of the file
+    size_t offset = handle->Position;
+    if (offset >= handle->Inode.Size) return 0;
+    length = fmin(length, handle->Inode.Size - offset);
+
+    // Map every data block the request touches
+    size_t startBlock = offset / BLOCK_SIZE;
     offset %= BLOCK_SIZE;
+    size_t count = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t *blocks = malloc(count * sizeof(uint32_t));
+    size_t mapped = mapInodeBlocks(fs, handle, startBlock, count, blocks);
+
+    // A read that continues the stream takes its prefetched window, any other
+    // read throws it away
+    Prefetch prefetched = {0}, dropped = {0}, stale = {0};
+    bool streaming = false;
+    bool sequential = false;
+    pthread_mutex_lock(&fs->ReadaheadLock);
+    if (fs->ReadaheadBlocks > 0) {
+        streaming = true;
+        ReadaheadStream *stream = findStream(fs, handle->Inumber, startBlock, &dropped);
+        sequential = stream->NextBlock == startBlock;
+        if (sequential) {
+            prefetched = detachPrefetch(stream);
+        } else {
+            stale = detachPrefetch(stream);
+            stream->Window = fmin(READAHEAD_MIN_BLOCKS, fs->ReadaheadBlocks);
+        }
+    }
+    pthread_mutex_unlock(&fs->ReadaheadLock);
+
+    releasePrefetch(fs, &dropped);
+    releasePrefetch(fs, &stale);
+    if (prefetched.Count > 0) fs->Disk->waitDisk(fs->Disk, prefetched.Ticket);
+
+    // Blocks that fit entirely in "data" are read straight into it; a partial
+    // first or last block, or one the disk cannot transfer in place, goes
+    // through a pool buffer
+    struct iovec *iov = malloc(mapped * sizeof(struct iovec));
+    for (size_t i = 0; i < mapped; i++) {
+        ssize_t at = (ssize_t)(i * BLOCK_SIZE) - (ssize_t)offset;
+        iov[i].iov_len = BLOCK_SIZE;
+        if (readsInPlace(fs, data, at, length))
+            iov[i].iov_base = data + at;
+        else
+            iov[i].iov_base = bufferPoolTake(fs->Disk->Buffers);
+    }
 
-    fprintf(stderr, "Write on direct...\n");
+    // Prefetched blocks are copied, the rest are read
+    uint32_t *missing = malloc(mapped * sizeof(uint32_t));
+    struct iovec *missingIov = malloc(mapped * sizeof(struct iovec));
+    size_t misses = 0;
+    for (size_t i = 0; i < mapped; i++) {
+        if (takePrefetched(&prefetched, startBlock + i, iov[i].iov_base))
+            continue;
+        missing[misses] = blocks[i];
+        missingIov[misses++] = iov[i];
+    }
 
-    while (written < length && offsetedDataBlock < POINTERS_PER_INODE) {
-        freeblk = allocFreeBlock(inode.Direct[offsetedDataBlock]);
+    // Keep all of the data block reads in flight at once
+    ssize_t ticket = transferRuns(fs, missing, missingIov, misses, false);
+    fs->Disk->waitDisk(fs->Disk, ticket);
 
-        if (freeblk <= 0) {
-            isDiskFull = true;
-            break;
-        };
+    size_t read = mapped > 0 ? fmin(length, mapped * BLOCK_SIZE - offset) : 0;
+    for (size_t i = 0; i < mapped; i++) {
+        ssize_t at = (ssize_t)(i * BLOCK_SIZE) - (ssize_t)offset;
+        if (readsInPlace(fs, data, at, length)) continue;
 
-        fprintf(stderr, "Free block: %ld\n", freeblk);
-        inode.Direct[offsetedDataBlock] = freeblk;
+        size_t from = at < 0 ? offset : 0;
+        size_t to = fmin(BLOCK_SIZE, read - at);
+        memcpy(data + (at + from), (char *)iov[i].iov_base + from, to - from);
+        bufferPoolGive(fs->Disk->Buffers, iov[i].iov_base);
+    }
 
-        if (offset > 0) {
-            selfDisk->readDisk(selfDisk, freeblk, block.Data);
+    free(missingIov);
+    free(missing);
+    free(iov);
+    free(blocks);
+
+    handle->Position += read;
+
+    // Hand back what is left of the window, or pick the next one once it is
+    // used up
+    size_t fetched = (handle->Position + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t window = 0;
+    pthread_mutex_lock(&fs->ReadaheadLock);
+    ReadaheadStream *stream = streaming ? lookupStream(fs, handle->Inumber) : NULL;
+    if (stream != NULL) {
+        stream->NextBlock = handle->Position / BLOCK_SIZE;
+        if (stream->Prefetched.Count == 0) {
+            if (fetched < prefetched.First + prefetched.Count) {
+                stream->Prefetched = prefetched;
+                memset(&prefetched, 0, sizeof(Prefetch));
+            } else if (sequential || startBlock == 0) {
+                window = stream->Window;
+                stream->Window = fmin(2 * stream->Window, fs->ReadaheadBlocks);
+            }
         }
-        int maxCopy = fmin(BLOCK_SIZE, length - written);
-        strncpy(block.Data + offset, data + written, maxCopy);
+    }
+    pthread_mutex_unlock(&fs->ReadaheadLock);
+    releasePrefetch(fs, &prefetched);
+
+    // Queue the next window, and keep it unless the stream moved on meanwhile
+    if (window > 0) {
+        Prefetch next = queuePrefetch(fs, handle, fetched, window);
+        pthread_mutex_lock(&fs->ReadaheadLock);
+        stream = lookupStream(fs, handle->Inumber);
+        if (stream != NULL && stream->Prefetched.Count == 0 && next.Count > 0) {
+            stream->Prefetched = next;
+            memset(&next, 0, sizeof(Prefetch));
+        }
+        pthread_mutex_unlock(&fs->ReadaheadLock);
+        releasePrefetch(fs, &next);
+    }
 
-        selfDisk->writeDisk(selfDisk, freeblk, block.Data);
-        bzero(block.Data, BLOCK_SIZE);
+    return read;
+}
 
-        written += maxCopy;
+ssize_t readInode(FileSystemState *fs, size_t inumber, char *data, size_t length, size_t offset) {
+    fprintf(stderr, "readInode(inumber:%ld, length:%ld, offset:%ld)\n", inumber,
+            length, offset);
+    // Load inode information
+    FileHandle handle;
+    if (!initHandle(fs, &handle, inumber)) {
+        return -1;
+    }
 
-        offset = 0;
-        offsetedDataBlock++;
+    handle.Position = offset;
+    return readHandle(fs, &handle, data, length);
+}
+
+ssize_t readInodeLocked(FileSystem *self, size_t inumber, char *data, size_t length, size_t offset) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_rdlock(&fs->MountLock);
+    bool intact = readLockInode(fs, inumber);
+    ssize_t read = intact ? readInode(fs, inumber, data, length, offset) : -1;
+    pthread_rwlock_unlock(inodeLock(fs, inumber));
+    pthread_rwlock_unlock(&fs->MountLock);
+    return read;
+}
+
+// Write to inode --------------------------------------------------------------
+
+// Number of blocks still to map in a segment of "room" pointers, that the
+// file does not have yet, starting at file block "fileblk"
+size_t segmentBlocks(size_t fileblk, size_t fileBlocks, size_t room, size_t left) {
+    if (fileblk < fileBlocks) return 0;
+    return fmin(room, left);
+}
+
+/**
+ * @brief Allocate (when missing) the data blocks referenced by a pointer
+ * block, starting at "*pointer", until "count" blocks are mapped. Only
+ * pointers to file blocks below "fileBlocks" are trusted to be in use.
+ * Missing blocks come from "run".
+ *
+ * @param base file block of the first pointer in the pointer block
+ * @return bool false if the disk is full
+ */
+bool writeToIndirect(FileSystemState *fs, Block *pointers, size_t *pointer, size_t base, size_t fileBlocks,
+                     BlockRun *run, uint32_t *blocks, size_t count, size_t *mapped) {
+    while (*mapped < count && *pointer < POINTERS_PER_BLOCK) {
+        bool inUse = base + *pointer < fileBlocks;
+        ssize_t freeblk = inUse ? allocFreeBlock(fs, pointers->Pointers[*pointer])
+                                : runBlock(fs, run, fmin(count - *mapped, POINTERS_PER_BLOCK - *pointer));
+        if (freeblk <= 0) return false;
+
+        pointers->Pointers[*pointer] = freeblk;
+        blocks[(*mapped)++] = freeblk;
+        (*pointer)++;
     }
 
-    // mark the end of data
-    if (offsetedDataBlock < POINTERS_PER_INODE)
-        inode.Direct[offsetedDataBlock] = FREE;
+    return true;
+}
 
-    fprintf(stderr, "Ended writting to direct...\n");
-    fprintf(stderr, "Wrote %u bytes of %lu...\n", written, length);
+// Allocate the blocks of a pointer inode, taking missing ones from "run"
+size_t allocPointerBlocks(FileSystemState *fs, FileHandle *handle, BlockRun *run, size_t first, size_t count,
+                          uint32_t *blocks) {
+    Inode *inode = &handle->Inode;
+    size_t fileBlocks = (inode->Size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t mapped = 0;
+    size_t fileblk = first;
+
+    while (mapped < count && fileblk < POINTERS_PER_INODE) {
+        bool inUse = fileblk < fileBlocks;
+        ssize_t freeblk = inUse ? allocFreeBlock(fs, inode->Direct[fileblk])
+                                : runBlock(fs, run, fmin(count - mapped, POINTERS_PER_INODE - fileblk));
+        if (freeblk <= 0) return mapped;
+
+        inode->Direct[fileblk] = freeblk;
+        blocks[mapped++] = freeblk;
+        fileblk++;
+    }
 
     // still data to write,
     // use indirect data
-    if (written < length && !isDiskFull && offsetedDataBlock < POINTERS_PER_BLOCK + POINTERS_PER_INODE) {
-        fprintf(stderr, "Use indirect...\n");
-        ssize_t indblk = allocFreeBlock(inode.Indirect);
+    if (mapped < count && fileblk < POINTERS_PER_BLOCK + POINTERS_PER_INODE) {
+        size_t data = segmentBlocks(fileblk, fileBlocks,
+                                    POINTERS_PER_BLOCK + POINTERS_PER_INODE - fileblk, count - mapped);
+        ssize_t indblk = inode->Indirect != FREE ? allocFreeBlock(fs, inode->Indirect)
+                                                 : runBlock(fs, run, 1 + data);
+        if (indblk <= 0) return mapped;
+
+        Block *pointers = indblk == inode->Indirect
+                              ? pointerBlock(fs, &handle->Indirect, indblk)
+                              : freshPointerBlock(fs, &handle->Indirect, indblk);
+        inode->Indirect = indblk;
+
+        // adjust fileblk to start at 0 to account for zero-start
+        // at the pointer data block
+        size_t pointer = fileblk - POINTERS_PER_INODE;
+        bool hasSpace = writeToIndirect(fs, pointers, &pointer, POINTERS_PER_INODE, fileBlocks,
+                                        run, blocks, count, &mapped);
+        handle->Indirect.Dirty = true;
+
+        if (!hasSpace) return mapped;
+        fileblk = pointer + POINTERS_PER_INODE;
+    }
+
+    // use double indirect block
+    if (mapped < count) {
+        size_t pointer = fileblk - POINTERS_PER_INODE - POINTERS_PER_BLOCK;
+        size_t data = segmentBlocks(fileblk, fileBlocks,
+                                    POINTERS_PER_BLOCK - pointer % POINTERS_PER_BLOCK, count - mapped);
+        ssize_t doubleIndirect = inode->DoubleIndirect != FREE
+                                     ? allocFreeBlock(fs, inode->DoubleIndirect)
+                                     : runBlock(fs, run, 2 + data);
+        if (doubleIndirect <= 0) return mapped;
+
+        Block *indirectBlocks = doubleIndirect == inode->DoubleIndirect
+                                    ? pointerBlock(fs, &handle->DoubleIndirect, doubleIndirect)
+                                    : freshPointerBlock(fs, &handle->DoubleIndirect, doubleIndirect);
+        inode->DoubleIndirect = doubleIndirect;
+
+        size_t indirectBlock = pointer / POINTERS_PER_BLOCK;
+        pointer %= POINTERS_PER_BLOCK;
 
-        if (indblk > 0) {
-            inode.Indirect = indblk;
+        while (mapped < count && indirectBlock < POINTERS_PER_BLOCK) {
+            size_t base = POINTERS_PER_INODE + POINTERS_PER_BLOCK + indirectBlock * POINTERS_PER_BLOCK;
+            uint32_t current = base < fileBlocks ? indirectBlocks->Pointers[indirectBlock] : FREE;
 
-            fprintf(stderr, "Indirect block:%ld\n", indblk);
+            data = segmentBlocks(base + pointer, fileBlocks, POINTERS_PER_BLOCK - pointer, count - mapped);
+            ssize_t indBlkAddr = current != FREE ? allocFreeBlock(fs, current) : runBlock(fs, run, 1 + data);
+            if (indBlkAddr <= 0) break;
 
-            Block pointers;
-            selfDisk->readDisk(selfDisk, indblk, pointers.Data);
+            Block *indBlock = indBlkAddr == current
+                                  ? pointerBlock(fs, &handle->Level, indBlkAddr)
+                                  : freshPointerBlock(fs, &handle->Level, indBlkAddr);
+            if (indBlkAddr != current) {
+                indirectBlocks->Pointers[indirectBlock] = indBlkAddr;
+                handle->DoubleIndirect.Dirty = true;
+            }
 
-            // adjust offsetedDataBlock to start at 0 to account for zero-start
-            // at the pointer data block
-            offsetedDataBlock -= POINTERS_PER_INODE;
-            writeToIndirect(&pointers, &offsetedDataBlock, data, length, &written, &offset);
+            bool hasSpace = writeToIndirect(fs, indBlock, &pointer, base, fileBlocks,
+                                            run, blocks, count, &mapped);
+            handle->Level.Dirty = true;
 
-            selfDisk->writeDisk(selfDisk, indblk, pointers.Data);
+            if (!hasSpace) break;
+            indirectBlock++;
+            pointer = 0;
         }
     }
 
-    // use double indirect block
-    if (written < length) {
-        fprintf(stderr, "Use double indirect...\n");
-        ssize_t doubleIndirect = allocFreeBlock(inode.DoubleIndirect);
+    return mapped;
+}
+
+/**
+ * @brief Translate "count" file blocks, starting at file block "first", into
+ * data block numbers, allocating data and pointer blocks that are missing.
+ * Missing blocks are taken a run at a time: the rest of the direct blocks,
+ * then each pointer block together with the data blocks it holds.
+ * Newly allocated pointer blocks start out zeroed instead of being read.
+ * Pointer blocks are updated in the handle and marked dirty.
+ *
+ * @return size_t number of blocks mapped before the disk filled up
+ */
+size_t allocInodeBlocks(FileSystemState *fs, FileHandle *handle, size_t first, size_t count, uint32_t *blocks) {
+    if (usesExtents(fs)) return allocExtentBlocks(fs, handle, first, count, blocks);
+
+    // An appending write continues right after the last block of the file
+    size_t fileBlocks = (handle->Inode.Size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t last = 0;
+    if (fileBlocks > 0 && first >= fileBlocks) mapInodeBlocks(fs, handle, fileBlocks - 1, 1, &last);
+
+    BlockRun run = {last != 0 ? last + 1 : inodeGoal(fs, handle->Inumber), 0};
+    size_t mapped = allocPointerBlocks(fs, handle, &run, first, count, blocks);
+    releaseRun(fs, &run);
+    return mapped;
+}
+
+/**
+ * @brief Write "length" bytes at "position" straight to disk, allocating the
+ * blocks they need. The inode size is left to the caller.
+ *
+ * @return size_t number of bytes written before the disk filled up
+ */
+size_t writeFileBlocks(FileSystemState *fs, FileHandle *handle, char *data, size_t length, size_t position) {
+    // Map (and allocate) every data block the request touches
+    size_t offset = position;
+    size_t startBlock = offset / BLOCK_SIZE;
+    offset %= BLOCK_SIZE;
+    size_t count = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t *blocks = malloc(count * sizeof(uint32_t));
+    size_t oldSize = handle->Inode.Size;
+    size_t mapped = allocInodeBlocks(fs, handle, startBlock, count, blocks);
+    forgetReadahead(fs, handle->Inumber);
+
+    // The write may have moved or cut off the blocks that follow it
+    mapCacheInvalidate(&fs->MapCache, handle->Inumber, startBlock);
+    mapCacheInsert(&fs->MapCache, handle->Inumber, startBlock, blocks, mapped);
+
+    // Fill the blocks and keep all of the writes in flight at once. Only a
+    // partially covered block that holds file data outside the write is read.
+    struct iovec *iov = poolVector(fs, mapped);
+    uint32_t written = 0;
+    for (size_t i = 0; i < mapped; i++) {
+        char *block = iov[i].iov_base;
+
+        int maxCopy = fmin(BLOCK_SIZE - offset, length - written);
+
+        size_t blockStart = (startBlock + i) * BLOCK_SIZE;
+        bool keepsHead = offset > 0 && blockStart < oldSize;
+        bool keepsTail = offset + maxCopy < BLOCK_SIZE && blockStart + offset + maxCopy < oldSize;
+        if (keepsHead || keepsTail) {
+            fs->Disk->readDisk(fs->Disk, blocks[i], block);
+        } else if (maxCopy < BLOCK_SIZE) {
+            memset(block, 0, BLOCK_SIZE);
+        }
+        memcpy(block + offset, data + written, maxCopy);
 
-        if (doubleIndirect > 0) {
-            Block indirectBlocks;
-            selfDisk->readDisk(selfDisk, doubleIndirect, indirectBlocks.Data);
+        written += maxCopy;
+        offset = 0;
+    }
+
+    ssize_t ticket = transferRuns(fs, blocks, iov, mapped, true);
+    fs->Disk->waitDisk(fs->Disk, ticket);
 
-            size_t pointer = offsetedDataBlock - POINTERS_PER_INODE - POINTERS_PER_BLOCK;
-            size_t indirectBlock = pointer / POINTERS_PER_BLOCK;
-            pointer %= POINTERS_PER_BLOCK;
+    fprintf(stderr, "Wrote %u bytes of %lu...\n", written, length);
 
-            while (written < length && indirectBlock < POINTERS_PER_BLOCK) {
-                size_t indBlkAddr = allocFreeBlock(indirectBlocks.Pointers[indirectBlock]);
+    releasePoolVector(fs, iov, mapped);
+    free(blocks);
 
-                if (indBlkAddr <= 0) break;
+    // Pointer blocks are on their way to disk before returning
+    storePointerBlock(fs, &handle->Indirect);
+    storePointerBlock(fs, &handle->DoubleIndirect);
+    storePointerBlock(fs, &handle->Level);
 
-                indirectBlocks.Pointers[indirectBlock] = indBlkAddr;
+    return written;
+}
 
-                Block indBlock;
-                selfDisk->readDisk(selfDisk, indBlkAddr, indBlock.Data);
+// Delayed allocation ----------------------------------------------------------
 
-                writeToIndirect(&indBlock, &pointer, data, length, &written, &offset);
+/**
+ * Data written past the last block a file has on disk is kept in memory and
+ * only reserves space. Blocks are allocated for the whole buffered range at
+ * once when it is flushed, so a file written in chunks, even interleaved with
+ * other files, gets one contiguous run. Buffered data is flushed before the
+ * file is read, when the buffers grow past DelayedBlocks, when a slot is
+ * needed for another file, and by debug and unmount. The reservation covers
+ * the data blocks and the pointer blocks they may need. allocRun hands out
+ * reserved blocks only to the flush they were reserved for, which keeps the
+ * reservation while it allocates, so a flush cannot run out of space. Should
+ * one still come up short, the lost data is reported, and the next read of
+ * the file, or the write that needed the flush, fails.
+ * The slots are guarded by DelayedLock, and a file's buffered data is only
+ * flushed by a thread holding its inode lock exclusively: readers that find
+ * buffered data come back as writers to flush it, and a writer that needs the
+ * slot of another file only tries for that file's lock.
+ */
 
-                offsetedDataBlock += pointer;
-                indirectBlock++;
-                pointer = 0;
+struct DelayedFile {
+    bool Active;        // Whether or not the slot is in use
+    size_t Inumber;     // Inode written
+    size_t DiskSize;    // Size of the inode covered by blocks on disk
+    size_t First;       // File block of the first buffered block
+    size_t Count;       // Number of buffered blocks
+    size_t Reserved;    // Number of blocks reserved for the buffered blocks
+    char *Buffer;       // Buffered blocks
+};
+
+void setDelayedBlocks(FileSystem *self, size_t blocks) {
+    self->State->DelayedBlocks = blocks;
+}
 
-                selfDisk->writeDisk(selfDisk, indirectBlock, indBlock.Data);
-            }
+// Worst case number of blocks needed to give "count" buffered blocks a place
+size_t delayedReservation(size_t count) {
+    // Indirect blocks, or extent tree blocks with one extent per block
+    return count + 2 * (count / EXTENTS_PER_BLOCK) + 3;
+}
+
+DelayedFile *findDelayed(FileSystemState *fs, size_t inumber) {
+    for (size_t i = 0; i < DELAYED_FILES; i++) {
+        if (fs->DelayedFiles[i].Active && fs->DelayedFiles[i].Inumber == inumber)
+            return &fs->DelayedFiles[i];
+    }
+    return NULL;
+}
+
+bool hasDelayed(FileSystemState *fs, size_t inumber) {
+    pthread_mutex_lock(&fs->DelayedLock);
+    bool delayed = findDelayed(fs, inumber) != NULL;
+    pthread_mutex_unlock(&fs->DelayedLock);
+    return delayed;
+}
+
+void releaseDelayed(FileSystemState *fs, DelayedFile *file) {
+    reserveBlocks(fs, file->Reserved, 0);
+    fs->BufferedBlocks -= file->Count;
+    free(file->Buffer);
+    memset(file, 0, sizeof(DelayedFile));
+}
+
+/**
+ * @brief Allocate blocks for, and write, the buffered blocks of a file. The
+ * blocks are taken from the reservation of the file, and only what is left
+ * of it is given back.
+ *
+ * @return bool false if buffered data could not be written and was lost
+ */
+bool flushDelayed(FileSystemState *fs, DelayedFile *file, FileHandle *handle) {
+    size_t inumber = file->Inumber;
+    size_t count = file->Count;
+    FileHandle local;
+    if (handle == NULL || handle->Inumber != inumber) {
+        handle = &local;
+        if (!initHandle(fs, handle, inumber)) {
+            fprintf(stderr, "Lost %lu buffered blocks of inode %lu...\n", count, inumber);
+            releaseDelayed(fs, file);
+            return false;
+        }
+    }
+
+    // The flush takes over the reservation of the file
+    size_t first = file->First;
+    char *buffer = file->Buffer;
+    file->Buffer = NULL;
+    size_t diskSize = file->DiskSize;
+    startFlush(fs, file->Reserved);
+    file->Reserved = 0;
+    releaseDelayed(fs, file);
+
+    // Pointers past the blocks on disk are not in use yet
+    size_t size = handle->Inode.Size;
+    handle->Inode.Size = diskSize;
+    size_t written = writeFileBlocks(fs, handle, buffer, count * BLOCK_SIZE, first * BLOCK_SIZE);
+    endFlush(fs);
+    handle->Inode.Size = fmin(size, fmax(diskSize, first * BLOCK_SIZE + written));
+    free(buffer);
+
+    saveInode(fs, inumber, &handle->Inode);
+    refreshHandles(fs, inumber, handle);
+
+    bool flushed = handle->Inode.Size == size;
+    if (!flushed) fprintf(stderr, "Lost %lu buffered bytes of inode %lu...\n", size - handle->Inode.Size, inumber);
+    return flushed;
+}
+
+void flushAllData(FileSystemState *fs) {
+    pthread_mutex_lock(&fs->DelayedLock);
+    for (size_t i = 0; i < DELAYED_FILES; i++) {
+        if (fs->DelayedFiles[i].Active) flushDelayed(fs, &fs->DelayedFiles[i], NULL);
+    }
+    pthread_mutex_unlock(&fs->DelayedLock);
+}
+
+void dropInodeData(FileSystemState *fs, size_t inumber) {
+    pthread_mutex_lock(&fs->DelayedLock);
+    DelayedFile *file = findDelayed(fs, inumber);
+    if (file != NULL) releaseDelayed(fs, file);
+    pthread_mutex_unlock(&fs->DelayedLock);
+}
+
+// Take the lock of an inode to read it, once its buffered data is on disk.
+// Returns false if buffered data of the inode was lost on the way.
+bool readLockInode(FileSystemState *fs, size_t inumber) {
+    pthread_rwlock_t *lock = inodeLock(fs, inumber);
+    bool flushed = true;
+    while (true) {
+        pthread_rwlock_rdlock(lock);
+        if (!hasDelayed(fs, inumber)) return flushed;
+        pthread_rwlock_unlock(lock);
+
+        pthread_rwlock_wrlock(lock);
+        pthread_mutex_lock(&fs->DelayedLock);
+        DelayedFile *file = findDelayed(fs, inumber);
+        if (file != NULL && !flushDelayed(fs, file, NULL)) flushed = false;
+        pthread_mutex_unlock(&fs->DelayedLock);
+        pthread_rwlock_unlock(lock);
+    }
+}
 
-            selfDisk->writeDisk(selfDisk, doubleIndirect, indirectBlocks.Data);
+/**
+ * @brief Buffer "length" bytes written at "position", which lies in or past
+ * the first file block without a block on disk. Falls back to writeFileBlocks
+ * when the buffers or the reservations would not fit.
+ *
+ * @return size_t number of bytes written, 0 if earlier buffered data of the
+ * file was lost making room
+ */
+size_t delayWrite(FileSystemState *fs, FileHandle *handle, char *data, size_t length, size_t position) {
+    pthread_mutex_lock(&fs->DelayedLock);
+    DelayedFile *file = findDelayed(fs, handle->Inumber);
+    if (file == NULL) {
+        file = &fs->DelayedFiles[fs->NextDelayed];
+        fs->NextDelayed = (fs->NextDelayed + 1) % DELAYED_FILES;
+
+        // The file in the slot is flushed only if its lock is free, or ours
+        if (file->Active) {
+            pthread_rwlock_t *other = inodeLock(fs, file->Inumber);
+            bool ours = other == inodeLock(fs, handle->Inumber);
+            if (!ours && pthread_rwlock_trywrlock(other) != 0) {
+                pthread_mutex_unlock(&fs->DelayedLock);
+                return writeFileBlocks(fs, handle, data, length, position);
+            }
+            flushDelayed(fs, file, NULL);
+            if (!ours) pthread_rwlock_unlock(other);
         }
+
+        file->Active = true;
+        file->Inumber = handle->Inumber;
+        file->DiskSize = handle->Inode.Size;
+        file->First = (file->DiskSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    size_t endBlock = (position + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t count = fmax(file->Count, endBlock - file->First);
+    size_t reserve = delayedReservation(count);
+    bool fits = fs->BufferedBlocks + count - file->Count <= fs->DelayedBlocks &&
+                reserveBlocks(fs, file->Reserved, reserve);
+    if (!fits) {
+        bool flushed = flushDelayed(fs, file, handle);
+        pthread_mutex_unlock(&fs->DelayedLock);
+        return flushed ? writeFileBlocks(fs, handle, data, length, position) : 0;
+    }
+
+    if (count > file->Count) {
+        file->Buffer = realloc(file->Buffer, count * BLOCK_SIZE);
+        memset(file->Buffer + file->Count * BLOCK_SIZE, 0, (count - file->Count) * BLOCK_SIZE);
+        fs->BufferedBlocks += count - file->Count;
+        file->Count = count;
+    }
+    file->Reserved = reserve;
+
+    memcpy(file->Buffer + position - file->First * BLOCK_SIZE, data, length);
+    forgetReadahead(fs, handle->Inumber);
+    pthread_mutex_unlock(&fs->DelayedLock);
+
+    return length;
+}
+
+ssize_t writeHandle(FileSystemState *fs, FileHandle *handle, char *data, size_t length) {
+    // Only the part of the write that lands in blocks already on disk is
+    // written now, the rest waits in memory
+    size_t position = handle->Position;
+    pthread_mutex_lock(&fs->DelayedLock);
+    DelayedFile *file = findDelayed(fs, handle->Inumber);
+    size_t diskSize = file != NULL ? file->DiskSize : handle->Inode.Size;
+    pthread_mutex_unlock(&fs->DelayedLock);
+    size_t diskEnd = (diskSize + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+    size_t now = length;
+    if (fs->DelayedBlocks > 0) now = position < diskEnd ? fmin(length, diskEnd - position) : 0;
+
+    size_t written = now > 0 ? writeFileBlocks(fs, handle, data, now, position) : 0;
+    if (written == now && now < length) {
+        written += delayWrite(fs, handle, data + now, length - now, position + now);
+    }
+
+    // Writing inside the file leaves its size alone
+    handle->Position += written;
+    handle->Inode.Size = fmax(handle->Inode.Size, handle->Position);
+    saveInode(fs, handle->Inumber, &handle->Inode);
+    refreshHandles(fs, handle->Inumber, handle);
+
+    return written;
+}
+
+ssize_t writeInode(FileSystemState *fs, size_t inumber, char *data, size_t length, size_t offset) {
+    // Load inode
+    FileHandle handle;
+    if (!initHandle(fs, &handle, inumber)) {
+        return -1;
+    }
+
+    handle.Position = offset;
+    return writeHandle(fs, &handle, data, length);
+}
+
+ssize_t writeInodeLocked(FileSystem *self, size_t inumber, char *data, size_t length, size_t offset) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_rdlock(&fs->MountLock);
+    pthread_rwlock_wrlock(inodeLock(fs, inumber));
+    ssize_t written = writeInode(fs, inumber, data, length, offset);
+    pthread_rwlock_unlock(inodeLock(fs, inumber));
+    pthread_rwlock_unlock(&fs->MountLock);
+    return written;
+}
+
+// Open file handle API --------------------------------------------------------
+
+/**
+ * A handle is used by one thread at a time. Handles on the same inode may be
+ * used by different threads: the inode lock keeps a write, and the refresh
+ * of the other handles it causes, apart from reads through them.
+ */
+
+FileHandle *openFile(FileSystem *self, size_t inumber) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_rdlock(&fs->MountLock);
+    if (!hasDiskMounted(fs)) {
+        pthread_rwlock_unlock(&fs->MountLock);
+        return NULL;
+    }
+
+    // The handle is listed before the inode can change under it
+    FileHandle *handle = malloc(sizeof(FileHandle));
+    pthread_rwlock_rdlock(inodeLock(fs, inumber));
+    if (initHandle(fs, handle, inumber)) {
+        pthread_mutex_lock(&fs->HandlesLock);
+        handle->Next = fs->OpenHandles;
+        fs->OpenHandles = handle;
+        pthread_mutex_unlock(&fs->HandlesLock);
+    } else {
+        free(handle);
+        handle = NULL;
+    }
+    pthread_rwlock_unlock(inodeLock(fs, inumber));
+
+    pthread_rwlock_unlock(&fs->MountLock);
+    return handle;
+}
+
+ssize_t readFile(FileSystem *self, FileHandle *handle, char *data, size_t length) {
+    FileSystemState *fs = self->State;
+
+    if (handle == NULL) return -1;
+
+    pthread_rwlock_rdlock(&fs->MountLock);
+    ssize_t read = -1;
+    if (hasDiskMounted(fs)) {
+        if (readLockInode(fs, handle->Inumber)) read = readHandle(fs, handle, data, length);
+        pthread_rwlock_unlock(inodeLock(fs, handle->Inumber));
     }
+    pthread_rwlock_unlock(&fs->MountLock);
+    return read;
+}
+
+ssize_t writeFile(FileSystem *self, FileHandle *handle, char *data, size_t length) {
+    FileSystemState *fs = self->State;
 
-    fprintf(stderr, "Saving inode...\n"); // debug
-    inode.Size = written;
-    saveInode(inumber, &inode);
-    fprintf(stderr, "Saved inode...\n");
+    if (handle == NULL) return -1;
 
+    pthread_rwlock_rdlock(&fs->MountLock);
+    ssize_t written = -1;
+    if (hasDiskMounted(fs)) {
+        pthread_rwlock_wrlock(inodeLock(fs, handle->Inumber));
+        written = writeHandle(fs, handle, data, length);
+        pthread_rwlock_unlock(inodeLock(fs, handle->Inumber));
+    }
+    pthread_rwlock_unlock(&fs->MountLock);
     return written;
 }
+
+bool seekFile(FileSystem *self, FileHandle *handle, size_t position) {
+    if (handle == NULL || position > UINT32_MAX) return false;
+
+    handle->Position = position;
+    return true;
+}
+
+bool closeFile(FileSystem *self, FileHandle *handle) {
+    FileSystemState *fs = self->State;
+
+    if (handle == NULL) return false;
+
+    pthread_mutex_lock(&fs->HandlesLock);
+    FileHandle **link = &fs->OpenHandles;
+    while (*link != NULL && *link != handle) link = &(*link)->Next;
+    if (*link != NULL) *link = handle->Next;
+    pthread_mutex_unlock(&fs->HandlesLock);
+
+    free(handle);
+    return true;
+}
+
+// Debug, format, mount and unmount wait for every other operation to finish
+
+void debug(FileSystem *self, Disk *disk) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_wrlock(&fs->MountLock);
+    debugImage(fs, disk);
+    pthread_rwlock_unlock(&fs->MountLock);
+}
+
+bool format(FileSystem *self, Disk *disk) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_wrlock(&fs->MountLock);
+    bool formatted = formatImage(fs, disk);
+    pthread_rwlock_unlock(&fs->MountLock);
+    return formatted;
+}
+
+bool mount(FileSystem *self, Disk *disk) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_wrlock(&fs->MountLock);
+    bool mounted = mountImage(fs, disk);
+    pthread_rwlock_unlock(&fs->MountLock);
+    return mounted;
+}
+
+bool unmount(FileSystem *self, Disk *disk) {
+    FileSystemState *fs = self->State;
+
+    pthread_rwlock_wrlock(&fs->MountLock);
+    bool unmounted = unmountImage(fs, disk);
+    pthread_rwlock_unlock(&fs->MountLock);
+    return unmounted;
+}
+
+void FileSystemDestructor(FileSystem *self) {
+    FileSystemState *fs = self->State;
+    if (hasDiskMounted(fs)) unmount(self, fs->Disk);
+
+    // Magazines are empty once unmounted; threads that still hold one never
+    // see the key again
+    while (fs->Magazines != NULL) {
+        Magazine *magazine = fs->Magazines;
+        fs->Magazines = magazine->Next;
+        pthread_mutex_destroy(&magazine->Lock);
+        free(magazine);
+    }
+    pthread_key_delete(fs->MagazineKey);
+
+    for (size_t i = 0; i < INODE_LOCKS; i++) pthread_rwlock_destroy(&fs->InodeLocks[i]);
+    pthread_rwlock_destroy(&fs->MountLock);
+    pthread_mutex_destroy(&fs->DelayedLock);
+    pthread_mutex_destroy(&fs->ReadaheadLock);
+    pthread_mutex_destroy(&fs->HandlesLock);
+    pthread_mutex_destroy(&fs->MagazinesLock);
+    pthread_mutex_destroy(&fs->AllocLock);
+    pthread_mutex_destroy(&fs->InodeBlockLock);
+
+    free(fs->DelayedFiles);
+    free(fs->Streams);
+    free(fs);
+    self->State = NULL;
+}
+
+void FileSystemConstructor(FileSystem *self) {
+    FileSystemState *fs = calloc(1, sizeof(FileSystemState));
+    fs->Streams = calloc(READAHEAD_STREAMS, sizeof(ReadaheadStream));
+    fs->DelayedFiles = calloc(DELAYED_FILES, sizeof(DelayedFile));
+    fs->WarmInodeBlock = -1;
+    fs->ReadaheadBlocks = READAHEAD_DEFAULT_BLOCKS;
+    fs->DelayedBlocks = DELAYED_DEFAULT_BLOCKS;
+    fs->MagazineBlocks = MAGAZINE_DEFAULT_BLOCKS;
+    pthread_key_create(&fs->MagazineKey, freeMagazine);
+
+    pthread_rwlock_init(&fs->MountLock, NULL);
+    for (size_t i = 0; i < INODE_LOCKS; i++) pthread_rwlock_init(&fs->InodeLocks[i], NULL);
+    pthread_mutex_init(&fs->DelayedLock, NULL);
+    pthread_mutex_init(&fs->ReadaheadLock, NULL);
+    pthread_mutex_init(&fs->HandlesLock, NULL);
+    pthread_mutex_init(&fs->MagazinesLock, NULL);
+    pthread_mutex_init(&fs->AllocLock, NULL);
+    pthread_mutex_init(&fs->InodeBlockLock, NULL);
+
+    self->State = fs;
+    self->FileSystemDestructor = FileSystemDestructor;
+    self->debug = debug;
+    self->format = format;
+    self->mount = mount;
+    self->unmount = unmount;
+    self->create = create;
+    self->removeInode = removeInode;
+    self->stat = stat;
+    self->createMany = createMany;
+    self->removeMany = removeMany;
+    self->statMany = statMany;
+    self->readInode = readInodeLocked;
+    self->writeInode = writeInodeLocked;
+    self->open = openFile;
+    self->read = readFile;
+    self->write = writeFile;
+    self->seek = seekFile;
+    self->close = closeFile;
+}
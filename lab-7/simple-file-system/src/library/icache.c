@@ -0,0 +1,174 @@
+// icache.c: Write-back inode cache
+
+#include "sfs/icache.h"
+
+#include <string.h>
+
+/**
+ * Inodes are found through a chained hash table on the inode number and
+ * replaced with the CLOCK algorithm, like blocks in the block cache. Updates
+ * only mark the entry dirty; a dirty inode goes through the writeBack function
+ * when it is evicted or when the cache is flushed. Flushing hands every dirty
+ * inode over at once in inode number order, so inodes sharing a block can be
+ * stored with a single block write.
+ *
+ * Every operation holds the cache lock, write backs included, so a dirty
+ * inode never reaches the disk after a newer copy replaced it.
+ */
+
+void inodeCacheInit(InodeCache *cache, size_t capacity,
+                    void (*writeBack)(void *context, size_t *inumbers, Inode **inodes, size_t count),
+                    void *context) {
+    if (capacity == 0) capacity = 1;
+
+    memset(cache, 0, sizeof(InodeCache));
+    cache->Capacity = capacity;
+    cache->Buckets = 2 * capacity;
+    cache->Heads = malloc(cache->Buckets * sizeof(int));
+    cache->Entries = calloc(capacity, sizeof(InodeCacheEntry));
+    cache->writeBack = writeBack;
+    cache->Context = context;
+    pthread_mutex_init(&cache->Lock, NULL);
+
+    for (size_t i = 0; i < cache->Buckets; i++) {
+        cache->Heads[i] = INODE_CACHE_EMPTY;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        cache->Entries[i].Inumber = INODE_CACHE_EMPTY;
+        cache->Entries[i].Next = INODE_CACHE_EMPTY;
+    }
+}
+
+void inodeCacheDestroy(InodeCache *cache) {
+    if (cache->Entries != NULL) pthread_mutex_destroy(&cache->Lock);
+    free(cache->Heads);
+    free(cache->Entries);
+    memset(cache, 0, sizeof(InodeCache));
+}
+
+int lookupInodeEntry(InodeCache *cache, size_t inumber) {
+    int idx = cache->Heads[inumber % cache->Buckets];
+    while (idx != INODE_CACHE_EMPTY) {
+        if (cache->Entries[idx].Inumber == (ssize_t)inumber) return idx;
+        idx = cache->Entries[idx].Next;
+    }
+    return INODE_CACHE_EMPTY;
+}
+
+void unlinkInodeEntry(InodeCache *cache, int idx) {
+    int *link = &cache->Heads[cache->Entries[idx].Inumber % cache->Buckets];
+    while (*link != INODE_CACHE_EMPTY) {
+        if (*link == idx) {
+            *link = cache->Entries[idx].Next;
+            break;
+        }
+        link = &cache->Entries[*link].Next;
+    }
+    cache->Entries[idx].Inumber = INODE_CACHE_EMPTY;
+    cache->Entries[idx].Next = INODE_CACHE_EMPTY;
+}
+
+// Find an entry for "inumber" with the CLOCK algorithm, writing back a dirty victim
+int claimInodeEntry(InodeCache *cache, size_t inumber) {
+    int idx;
+    while (true) {
+        idx = cache->Hand;
+        cache->Hand = (cache->Hand + 1) % cache->Capacity;
+
+        InodeCacheEntry *entry = &cache->Entries[idx];
+        if (entry->Inumber == INODE_CACHE_EMPTY) break;
+
+        if (entry->Referenced) {
+            entry->Referenced = false;
+            continue;
+        }
+
+        if (entry->Dirty) {
+            size_t victim = entry->Inumber;
+            Inode *inode = &entry->Inode;
+            cache->writeBack(cache->Context, &victim, &inode, 1);
+            cache->WriteBacks++;
+        }
+        unlinkInodeEntry(cache, idx);
+        cache->Evictions++;
+        break;
+    }
+
+    InodeCacheEntry *entry = &cache->Entries[idx];
+    size_t bucket = inumber % cache->Buckets;
+    entry->Inumber = inumber;
+    entry->Next = cache->Heads[bucket];
+    entry->Dirty = false;
+    entry->Referenced = true;
+    cache->Heads[bucket] = idx;
+
+    return idx;
+}
+
+bool inodeCacheLookup(InodeCache *cache, size_t inumber, Inode *inode) {
+    pthread_mutex_lock(&cache->Lock);
+    int idx = lookupInodeEntry(cache, inumber);
+    if (idx == INODE_CACHE_EMPTY) {
+        cache->Misses++;
+        pthread_mutex_unlock(&cache->Lock);
+        return false;
+    }
+
+    cache->Hits++;
+    cache->Entries[idx].Referenced = true;
+    memcpy(inode, &cache->Entries[idx].Inode, sizeof(Inode));
+    pthread_mutex_unlock(&cache->Lock);
+    return true;
+}
+
+void inodeCacheUpdate(InodeCache *cache, size_t inumber, Inode *inode, bool dirty) {
+    pthread_mutex_lock(&cache->Lock);
+    int idx = lookupInodeEntry(cache, inumber);
+    if (idx == INODE_CACHE_EMPTY) idx = claimInodeEntry(cache, inumber);
+
+    InodeCacheEntry *entry = &cache->Entries[idx];
+    memcpy(&entry->Inode, inode, sizeof(Inode));
+    entry->Dirty = entry->Dirty || dirty;
+    entry->Referenced = true;
+    pthread_mutex_unlock(&cache->Lock);
+}
+
+void inodeCacheRefresh(InodeCache *cache, size_t inumber, Inode *inode) {
+    pthread_mutex_lock(&cache->Lock);
+    int idx = lookupInodeEntry(cache, inumber);
+    if (idx != INODE_CACHE_EMPTY) {
+        memcpy(&cache->Entries[idx].Inode, inode, sizeof(Inode));
+        cache->Entries[idx].Dirty = false;
+    }
+    pthread_mutex_unlock(&cache->Lock);
+}
+
+int compareInumbers(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void inodeCacheFlush(InodeCache *cache) {
+    pthread_mutex_lock(&cache->Lock);
+    size_t *inumbers = malloc(cache->Capacity * sizeof(size_t));
+    Inode **inodes = malloc(cache->Capacity * sizeof(Inode *));
+
+    size_t ndirty = 0;
+    for (size_t i = 0; i < cache->Capacity; i++) {
+        if (cache->Entries[i].Inumber != INODE_CACHE_EMPTY && cache->Entries[i].Dirty)
+            inumbers[ndirty++] = cache->Entries[i].Inumber;
+    }
+    qsort(inumbers, ndirty, sizeof(size_t), compareInumbers);
+
+    for (size_t i = 0; i < ndirty; i++) {
+        InodeCacheEntry *entry = &cache->Entries[lookupInodeEntry(cache, inumbers[i])];
+        inodes[i] = &entry->Inode;
+        entry->Dirty = false;
+    }
+    if (ndirty > 0) cache->writeBack(cache->Context, inumbers, inodes, ndirty);
+    cache->WriteBacks += ndirty;
+
+    free(inodes);
+    free(inumbers);
+    pthread_mutex_unlock(&cache->Lock);
+}
@@ -0,0 +1,263 @@
+// mapcache.c: Per-inode cache of file block to disk block translations
+
+#include "sfs/mapcache.h"
+
+#include <string.h>
+
+/**
+ * Each inode with cached translations has an entry holding a sorted array of
+ * extents, runs of file blocks stored in consecutive disk blocks, so a file
+ * that was written contiguously costs a handful of extents no matter its
+ * size. Entries are found through a chained hash table on the inode number.
+ * When the extents of all entries would exceed MaxExtents, or every entry is
+ * taken, whole entries are dropped with the CLOCK algorithm. Every public
+ * operation holds the cache lock.
+ */
+
+void mapCacheInit(MapCache *cache, size_t capacity, size_t maxExtents) {
+    if (capacity == 0) capacity = 1;
+    if (maxExtents == 0) maxExtents = 1;
+
+    memset(cache, 0, sizeof(MapCache));
+    cache->Capacity = capacity;
+    cache->Buckets = 2 * capacity;
+    cache->Heads = malloc(cache->Buckets * sizeof(int));
+    cache->Entries = calloc(capacity, sizeof(MapEntry));
+    cache->MaxExtents = maxExtents;
+    pthread_mutex_init(&cache->Lock, NULL);
+
+    for (size_t i = 0; i < cache->Buckets; i++) {
+        cache->Heads[i] = MAP_CACHE_EMPTY;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        cache->Entries[i].Inumber = MAP_CACHE_EMPTY;
+        cache->Entries[i].Next = MAP_CACHE_EMPTY;
+    }
+}
+
+void mapCacheDestroy(MapCache *cache) {
+    if (cache->Entries != NULL) pthread_mutex_destroy(&cache->Lock);
+    for (size_t i = 0; i < cache->Capacity; i++) {
+        free(cache->Entries[i].Extents);
+    }
+    free(cache->Heads);
+    free(cache->Entries);
+    memset(cache, 0, sizeof(MapCache));
+}
+
+int lookupMapEntry(MapCache *cache, size_t inumber) {
+    int idx = cache->Heads[inumber % cache->Buckets];
+    while (idx != MAP_CACHE_EMPTY) {
+        if (cache->Entries[idx].Inumber == (ssize_t)inumber) return idx;
+        idx = cache->Entries[idx].Next;
+    }
+    return MAP_CACHE_EMPTY;
+}
+
+void dropMapEntry(MapCache *cache, int idx) {
+    MapEntry *entry = &cache->Entries[idx];
+
+    int *link = &cache->Heads[entry->Inumber % cache->Buckets];
+    while (*link != MAP_CACHE_EMPTY) {
+        if (*link == idx) {
+            *link = entry->Next;
+            break;
+        }
+        link = &cache->Entries[*link].Next;
+    }
+
+    cache->Extents -= entry->Count;
+    free(entry->Extents);
+    memset(entry, 0, sizeof(MapEntry));
+    entry->Inumber = MAP_CACHE_EMPTY;
+    entry->Next = MAP_CACHE_EMPTY;
+}
+
+// Drop one entry other than "keep" with the CLOCK algorithm
+// @return	Whether or not there was an entry to drop
+bool evictMapEntry(MapCache *cache, int keep) {
+    for (size_t scanned = 0; scanned < 2 * cache->Capacity; scanned++) {
+        int idx = cache->Hand;
+        cache->Hand = (cache->Hand + 1) % cache->Capacity;
+
+        MapEntry *entry = &cache->Entries[idx];
+        if (idx == keep || entry->Inumber == MAP_CACHE_EMPTY) continue;
+
+        if (entry->Referenced) {
+            entry->Referenced = false;
+            continue;
+        }
+
+        dropMapEntry(cache, idx);
+        cache->Evictions++;
+        return true;
+    }
+    return false;
+}
+
+int claimMapEntry(MapCache *cache, size_t inumber) {
+    int idx = MAP_CACHE_EMPTY;
+    while (idx == MAP_CACHE_EMPTY) {
+        for (size_t i = 0; i < cache->Capacity; i++) {
+            if (cache->Entries[(cache->Hand + i) % cache->Capacity].Inumber == MAP_CACHE_EMPTY) {
+                idx = (cache->Hand + i) % cache->Capacity;
+                break;
+            }
+        }
+        if (idx == MAP_CACHE_EMPTY) evictMapEntry(cache, MAP_CACHE_EMPTY);
+    }
+
+    MapEntry *entry = &cache->Entries[idx];
+    size_t bucket = inumber % cache->Buckets;
+    entry->Inumber = inumber;
+    entry->Next = cache->Heads[bucket];
+    entry->Referenced = true;
+    cache->Heads[bucket] = idx;
+
+    return idx;
+}
+
+// Index of the last extent starting at or before "logical", or -1
+ssize_t findExtent(MapEntry *entry, size_t logical) {
+    ssize_t low = 0, high = (ssize_t)entry->Count - 1, found = -1;
+    while (low <= high) {
+        ssize_t mid = (low + high) / 2;
+        if (entry->Extents[mid].Logical <= logical) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+size_t mapCacheLookup(MapCache *cache, size_t inumber, size_t first, size_t count, uint32_t *blocks) {
+    size_t translated = 0;
+    pthread_mutex_lock(&cache->Lock);
+
+    int idx = lookupMapEntry(cache, inumber);
+    if (idx != MAP_CACHE_EMPTY) {
+        MapEntry *entry = &cache->Entries[idx];
+        entry->Referenced = true;
+
+        ssize_t e = findExtent(entry, first);
+        while (e >= 0 && (size_t)e < entry->Count && translated < count) {
+            MapExtent *extent = &entry->Extents[e];
+            size_t logical = first + translated;
+            if (logical < extent->Logical || logical >= extent->Logical + extent->Length)
+                break;
+
+            for (; logical < extent->Logical + extent->Length && translated < count; logical++) {
+                blocks[translated++] = extent->Physical + (logical - extent->Logical);
+            }
+            e++;
+        }
+    }
+
+    if (translated == count)
+        cache->Hits++;
+    else
+        cache->Misses++;
+    pthread_mutex_unlock(&cache->Lock);
+    return translated;
+}
+
+void invalidateMapEntry(MapCache *cache, size_t inumber, size_t from) {
+    int idx = lookupMapEntry(cache, inumber);
+    if (idx == MAP_CACHE_EMPTY) return;
+
+    MapEntry *entry = &cache->Entries[idx];
+    ssize_t e = findExtent(entry, from);
+    size_t keep = e < 0 ? 0 : e + 1;
+
+    // Cut the extent that straddles "from"
+    if (e >= 0 && entry->Extents[e].Logical + entry->Extents[e].Length > from) {
+        entry->Extents[e].Length = from - entry->Extents[e].Logical;
+        if (entry->Extents[e].Length == 0) keep = e;
+    }
+
+    cache->Extents -= entry->Count - keep;
+    entry->Count = keep;
+    if (keep == 0) dropMapEntry(cache, idx);
+}
+
+void mapCacheInvalidate(MapCache *cache, size_t inumber, size_t from) {
+    pthread_mutex_lock(&cache->Lock);
+    invalidateMapEntry(cache, inumber, from);
+    pthread_mutex_unlock(&cache->Lock);
+}
+
+void mapCacheInsert(MapCache *cache, size_t inumber, size_t first, uint32_t *blocks, size_t count) {
+    if (count == 0) return;
+    pthread_mutex_lock(&cache->Lock);
+
+    // Replace whatever was known from "first" on, then append the new runs
+    uint32_t end = first + count;
+    MapExtent *tail = NULL;
+    size_t tailCount = 0;
+
+    int idx = lookupMapEntry(cache, inumber);
+    if (idx != MAP_CACHE_EMPTY) {
+        // Keep the extents past the new range
+        MapEntry *entry = &cache->Entries[idx];
+        ssize_t e = findExtent(entry, end);
+        size_t from = e < 0 ? 0 : (size_t)e;
+
+        tail = malloc((entry->Count - from + 1) * sizeof(MapExtent));
+        if (from < entry->Count && entry->Extents[from].Logical < end) {
+            MapExtent *extent = &entry->Extents[from++];
+            if (extent->Logical + extent->Length > end) {
+                tail[0].Logical = end;
+                tail[0].Physical = extent->Physical + (end - extent->Logical);
+                tail[0].Length = extent->Logical + extent->Length - end;
+                tailCount = 1;
+            }
+        }
+        for (; from < entry->Count; from++) tail[tailCount++] = entry->Extents[from];
+
+        invalidateMapEntry(cache, inumber, first);
+        idx = lookupMapEntry(cache, inumber);
+    }
+    if (idx == MAP_CACHE_EMPTY) idx = claimMapEntry(cache, inumber);
+
+    MapEntry *entry = &cache->Entries[idx];
+    entry->Referenced = true;
+
+    for (size_t i = 0; i <= count + tailCount; i++) {
+        MapExtent run;
+        if (i < count) {
+            run.Logical = first + i;
+            run.Physical = blocks[i];
+            run.Length = 1;
+        } else if (i < count + tailCount) {
+            run = tail[i - count];
+        } else {
+            break;
+        }
+
+        // Extend the last extent when the run continues it
+        MapExtent *last = entry->Count > 0 ? &entry->Extents[entry->Count - 1] : NULL;
+        if (last != NULL && last->Logical + last->Length == run.Logical &&
+            last->Physical + last->Length == run.Physical) {
+            last->Length += run.Length;
+            continue;
+        }
+
+        // Stay under the cap by dropping other inodes first
+        while (cache->Extents >= cache->MaxExtents && evictMapEntry(cache, idx))
+            ;
+        if (cache->Extents >= cache->MaxExtents) break;
+
+        if (entry->Count == entry->Allocated) {
+            entry->Allocated = entry->Allocated ? 2 * entry->Allocated : 4;
+            entry->Extents = realloc(entry->Extents, entry->Allocated * sizeof(MapExtent));
+        }
+        entry->Extents[entry->Count++] = run;
+        cache->Extents++;
+    }
+
+    free(tail);
+    if (entry->Count == 0) dropMapEntry(cache, idx);
+    pthread_mutex_unlock(&cache->Lock);
+}
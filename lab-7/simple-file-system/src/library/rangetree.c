@@ -0,0 +1,251 @@
+// rangetree.c: Index of free block extents
+
+#include "sfs/rangetree.h"
+
+/**
+ * Free extents are kept in a treap ordered by start block. Every node also
+ * records the longest extent below it, so the first extent after a goal that
+ * is long enough for a request is found in O(log n) without visiting the
+ * short ones. Freed blocks are merged with the extents on either side of
+ * them, so the tree holds one node per run of free blocks.
+ */
+
+uint32_t nextPriority(RangeTree *tree) {
+    // xorshift32
+    uint32_t x = tree->Seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    tree->Seed = x;
+    return x;
+}
+
+uint32_t maxLength(RangeNode *node) {
+    return node == NULL ? 0 : node->MaxLength;
+}
+
+void updateNode(RangeNode *node) {
+    uint32_t longest = node->Length;
+    if (maxLength(node->Left) > longest) longest = maxLength(node->Left);
+    if (maxLength(node->Right) > longest) longest = maxLength(node->Right);
+    node->MaxLength = longest;
+}
+
+// Join two trees, every extent of "left" starting before those of "right"
+RangeNode *mergeNodes(RangeNode *left, RangeNode *right) {
+    if (left == NULL) return right;
+    if (right == NULL) return left;
+
+    if (left->Priority > right->Priority) {
+        left->Right = mergeNodes(left->Right, right);
+        updateNode(left);
+        return left;
+    }
+    right->Left = mergeNodes(left, right->Left);
+    updateNode(right);
+    return right;
+}
+
+// Split a tree into the extents that start before "start" and the rest
+void splitNodes(RangeNode *node, uint32_t start, RangeNode **left, RangeNode **right) {
+    if (node == NULL) {
+        *left = *right = NULL;
+        return;
+    }
+
+    if (node->Start < start) {
+        splitNodes(node->Right, start, &node->Right, right);
+        *left = node;
+    } else {
+        splitNodes(node->Left, start, left, &node->Left);
+        *right = node;
+    }
+    updateNode(node);
+}
+
+void destroyNodes(RangeNode *node) {
+    if (node == NULL) return;
+    destroyNodes(node->Left);
+    destroyNodes(node->Right);
+    free(node);
+}
+
+void rangeTreeInit(RangeTree *tree) {
+    tree->Root = NULL;
+    tree->Count = 0;
+    tree->Free = 0;
+    tree->Seed = 2463534242u;
+}
+
+void rangeTreeDestroy(RangeTree *tree) {
+    destroyNodes(tree->Root);
+    rangeTreeInit(tree);
+}
+
+// Last extent that starts at or before "block"
+RangeNode *findAtOrBefore(RangeTree *tree, uint32_t block) {
+    RangeNode *found = NULL;
+    for (RangeNode *node = tree->Root; node != NULL;) {
+        if (node->Start <= block) {
+            found = node;
+            node = node->Right;
+        } else {
+            node = node->Left;
+        }
+    }
+    return found;
+}
+
+void addExtent(RangeTree *tree, uint32_t start, uint32_t length) {
+    RangeNode *node = malloc(sizeof(RangeNode));
+    node->Start = start;
+    node->Length = length;
+    node->MaxLength = length;
+    node->Priority = nextPriority(tree);
+    node->Left = node->Right = NULL;
+
+    RangeNode *left, *right;
+    splitNodes(tree->Root, start, &left, &right);
+    tree->Root = mergeNodes(mergeNodes(left, node), right);
+
+    tree->Count++;
+    tree->Free += length;
+}
+
+void removeExtent(RangeTree *tree, uint32_t start) {
+    RangeNode *left, *middle, *right;
+    splitNodes(tree->Root, start, &left, &right);
+    splitNodes(right, start + 1, &middle, &right);
+    tree->Root = mergeNodes(left, right);
+
+    if (middle != NULL) {
+        tree->Count--;
+        tree->Free -= middle->Length;
+        free(middle);
+    }
+}
+
+void rangeTreeInsert(RangeTree *tree, uint32_t start, uint32_t length) {
+    if (length == 0) return;
+
+    // Absorb the extents that end right before and start right after the range
+    RangeNode *before = findAtOrBefore(tree, start);
+    if (before != NULL && before->Start + before->Length == start) {
+        start = before->Start;
+        length += before->Length;
+        removeExtent(tree, start);
+    }
+
+    RangeNode *after = findAtOrBefore(tree, start + length);
+    if (after != NULL && after->Start == start + length) {
+        length += after->Length;
+        removeExtent(tree, after->Start);
+    }
+
+    addExtent(tree, start, length);
+}
+
+bool rangeTreeRemove(RangeTree *tree, uint32_t start, uint32_t length) {
+    RangeNode *holder = findAtOrBefore(tree, start);
+    if (holder == NULL || (uint64_t)start + length > (uint64_t)holder->Start + holder->Length)
+        return false;
+
+    uint32_t first = holder->Start;
+    uint32_t end = holder->Start + holder->Length;
+    removeExtent(tree, first);
+
+    if (first < start) addExtent(tree, first, start - first);
+    if (start + length < end) addExtent(tree, start + length, end - start - length);
+    return true;
+}
+
+// First extent that starts at or after "from" and holds at least "want" blocks
+RangeNode *findFit(RangeNode *node, uint64_t from, size_t want) {
+    if (node == NULL || node->MaxLength < want) return NULL;
+
+    if (node->Start < from) return findFit(node->Right, from, want);
+
+    RangeNode *found = findFit(node->Left, from, want);
+    if (found != NULL) return found;
+    if (node->Length >= want) return node;
+    return findFit(node->Right, from, want);
+}
+
+// Longest extent, the lowest one among equals
+RangeNode *findLongest(RangeNode *node) {
+    while (node != NULL) {
+        if (maxLength(node->Left) == node->MaxLength)
+            node = node->Left;
+        else if (node->Length == node->MaxLength)
+            return node;
+        else
+            node = node->Right;
+    }
+    return NULL;
+}
+
+// The longer of two extents, the lower one among equals
+RangeNode *longer(RangeNode *a, RangeNode *b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (a->Length != b->Length) return a->Length > b->Length ? a : b;
+    return a->Start < b->Start ? a : b;
+}
+
+// Longest extent that starts at or after "from"
+RangeNode *findLongestFrom(RangeNode *node, uint64_t from) {
+    if (node == NULL) return NULL;
+    if (node->Start < from) return findLongestFrom(node->Right, from);
+    return longer(longer(findLongestFrom(node->Left, from), node), findLongest(node->Right));
+}
+
+// Longest extent that starts before "limit"
+RangeNode *findLongestTo(RangeNode *node, uint64_t limit) {
+    if (node == NULL) return NULL;
+    if (node->Start >= limit) return findLongestTo(node->Left, limit);
+    return longer(longer(findLongest(node->Left), node), findLongestTo(node->Right, limit));
+}
+
+// Longest extent that starts in [from, limit)
+RangeNode *findLongestIn(RangeNode *node, uint64_t from, uint64_t limit) {
+    while (node != NULL && (node->Start < from || node->Start >= limit))
+        node = node->Start < from ? node->Right : node->Left;
+    if (node == NULL) return NULL;
+
+    return longer(longer(findLongestFrom(node->Left, from), node),
+                  findLongestTo(node->Right, limit));
+}
+
+// First extent that starts in [from, limit) and holds at least "want" blocks
+RangeNode *findFitIn(RangeTree *tree, uint64_t from, uint64_t limit, size_t want) {
+    RangeNode *fit = findFit(tree->Root, from, want);
+    return fit != NULL && fit->Start < limit ? fit : NULL;
+}
+
+ssize_t rangeTreeAlloc(RangeTree *tree, uint32_t goal, uint32_t first, uint32_t limit,
+                       size_t want, size_t *got) {
+    *got = 0;
+    if (tree->Root == NULL || want == 0 || first >= limit) return -1;
+    if (goal < first || goal >= limit) goal = first;
+
+    // Right at the goal, then the first long enough extent after it, then
+    // the first long enough extent before it, then whatever run is longest
+    uint32_t start;
+    RangeNode *holder = findAtOrBefore(tree, goal);
+    if (holder != NULL && (uint64_t)holder->Start + holder->Length >= (uint64_t)goal + want) {
+        start = goal;
+    } else {
+        RangeNode *fit = findFitIn(tree, (uint64_t)goal + 1, limit, want);
+        if (fit == NULL) fit = findFitIn(tree, first, limit, want);
+        if (fit == NULL) {
+            fit = findLongestIn(tree->Root, first, limit);
+            if (fit == NULL) return -1;
+            if (want > fit->Length) want = fit->Length;
+        }
+        start = fit->Start;
+    }
+
+    rangeTreeRemove(tree, start, want);
+    *got = want;
+    return start;
+}
@@ -0,0 +1,307 @@
+// uring.c: io_uring disk backend
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// <linux/io_uring.h> pulls in <linux/fs.h>, whose BLOCK_SIZE is not ours
+#undef BLOCK_SIZE
+
+#include "sfs/disk.h"
+
+// Number of requests that may be in flight at once
+#define URING_DEPTH 64
+
+// Error reporting shared with disk.c
+extern char signal_msg[256];
+extern char what[256];
+void handle_sigint(int sig);
+
+void openDisk(struct Disk *self, const char *path, size_t nblocks);
+void DiskDestructor(struct Disk *self);
+void readDisk(struct Disk *self, int blocknum, char *data);
+void writeDisk(struct Disk *self, int blocknum, char *data);
+void readBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count);
+void writeBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count);
+void sanity_check_run(struct Disk *self, int blocknum, struct iovec *iov, int count);
+
+/**
+ * Requests are queued on the submission ring without entering the kernel and
+ * submitted as one batch when the caller waits (or when the ring fills up).
+ * Every request gets a ticket, a sequence number carried in the user data of
+ * its completion. Tickets below "Oldest" are known to be complete, so a slot
+ * of "Done" can be reused once the ticket that owned it has been retired.
+ * Tickets start at 1, so ticket 0 is complete as on every other disk.
+ * Queueing and waiting hold the ring lock, so threads may share the ring;
+ * a thread waiting for everything also waits for the requests of the others.
+ */
+typedef struct UringDisk {
+    int RingFd;             // io_uring file descriptor
+    unsigned Entries;       // Number of submission ring entries
+
+    void *SqRing;           // Submission ring mapping
+    size_t SqRingSize;
+    unsigned *SqHead;
+    unsigned *SqTail;
+    unsigned *SqMask;
+    unsigned *SqArray;
+    struct io_uring_sqe *Sqes;
+    size_t SqesSize;
+
+    void *CqRing;           // Completion ring mapping
+    size_t CqRingSize;
+    unsigned *CqHead;
+    unsigned *CqTail;
+    unsigned *CqMask;
+    struct io_uring_cqe *Cqes;
+
+    unsigned Pending;       // Requests queued but not yet submitted
+    size_t NextTicket;      // Ticket of the next request
+    size_t Oldest;          // Oldest ticket that has not completed
+    bool *Done;             // Completion flags, indexed by ticket % Entries
+    int *Counts;            // Blocks moved by each ticket, indexed the same way
+    pthread_mutex_t Lock;   // Held while the rings are used
+} UringDisk;
+
+UringDisk *uringOf(struct Disk *self) {
+    return (UringDisk *)self->Private;
+}
+
+void uringFail(const char *message) {
+    snprintf(what, sizeof(what), "io_uring: %s", strerror(errno));
+    strcpy(signal_msg, message);
+    signal(SIGINT, handle_sigint);
+    raise(SIGINT);
+}
+
+void submitUring(UringDisk *ring, unsigned minComplete) {
+    unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (ring->Pending > 0 || minComplete > 0) {
+        int ret = syscall(__NR_io_uring_enter, ring->RingFd, ring->Pending,
+                          minComplete, flags, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            uringFail("ERROR: unable to submit disk requests.");
+        }
+        ring->Pending -= ret;
+        minComplete = 0;
+        flags = 0;
+    }
+}
+
+void reapUring(struct Disk *self) {
+    UringDisk *ring = uringOf(self);
+    unsigned head = *ring->CqHead;
+    unsigned tail = __atomic_load_n(ring->CqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->Cqes[head & *ring->CqMask];
+        size_t ticket = cqe->user_data >> 1;
+        bool isWrite = cqe->user_data & 1;
+
+        int count = ring->Counts[ticket % ring->Entries];
+
+        if (cqe->res != count * BLOCK_SIZE) {
+            errno = cqe->res < 0 ? -cqe->res : EIO;
+            uringFail(isWrite ? "ERROR: unable to write blocknum."
+                              : "ERROR: unable to read blocknum.");
+        }
+
+        if (isWrite)
+            __atomic_fetch_add(&self->Writes, count, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_add(&self->Reads, count, __ATOMIC_RELAXED);
+
+        ring->Done[ticket % ring->Entries] = true;
+        head++;
+    }
+    __atomic_store_n(ring->CqHead, head, __ATOMIC_RELEASE);
+
+    while (ring->Oldest < ring->NextTicket &&
+           ring->Done[ring->Oldest % ring->Entries]) {
+        ring->Oldest++;
+    }
+}
+
+void waitUring(struct Disk *self, ssize_t ticket) {
+    UringDisk *ring = uringOf(self);
+    pthread_mutex_lock(&ring->Lock);
+    size_t last = ticket < 0 ? ring->NextTicket : (size_t)ticket + 1;
+
+    submitUring(ring, 0);
+    reapUring(self);
+    while (ring->Oldest < last) {
+        submitUring(ring, 1);
+        reapUring(self);
+    }
+    pthread_mutex_unlock(&ring->Lock);
+}
+
+ssize_t queueUring(struct Disk *self, int blocknum, struct iovec *iov, int count, bool isWrite) {
+    UringDisk *ring = uringOf(self);
+    sanity_check_run(self, blocknum, iov, count);
+    pthread_mutex_lock(&ring->Lock);
+
+    // Retire the oldest request before its ticket slot is reused
+    while (ring->NextTicket - ring->Oldest >= ring->Entries) {
+        submitUring(ring, 1);
+        reapUring(self);
+    }
+
+    unsigned tail = *ring->SqTail;
+    unsigned idx = tail & *ring->SqMask;
+    struct io_uring_sqe *sqe = &ring->Sqes[idx];
+    size_t ticket = ring->NextTicket++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = isWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = self->FileDescriptor;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = count;
+    sqe->off = (off_t)blocknum * BLOCK_SIZE;
+    sqe->user_data = (ticket << 1) | isWrite;
+
+    ring->SqArray[idx] = idx;
+    ring->Done[ticket % ring->Entries] = false;
+    ring->Counts[ticket % ring->Entries] = count;
+    __atomic_store_n(ring->SqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->Pending++;
+    pthread_mutex_unlock(&ring->Lock);
+
+    return ticket;
+}
+
+ssize_t readUringAsync(struct Disk *self, int blocknum, struct iovec *iov, int count) {
+    return queueUring(self, blocknum, iov, count, false);
+}
+
+ssize_t writeUringAsync(struct Disk *self, int blocknum, struct iovec *iov, int count) {
+    return queueUring(self, blocknum, iov, count, true);
+}
+
+// Synchronous transfers are ordered after everything queued before them
+void readUring(struct Disk *self, int blocknum, char *data) {
+    waitUring(self, -1);
+    readDisk(self, blocknum, data);
+}
+
+void writeUring(struct Disk *self, int blocknum, char *data) {
+    waitUring(self, -1);
+    writeDisk(self, blocknum, data);
+}
+
+void readUringBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count) {
+    waitUring(self, -1);
+    readBlocks(self, blocknum, iov, count);
+}
+
+void writeUringBlocks(struct Disk *self, int blocknum, struct iovec *iov, int count) {
+    waitUring(self, -1);
+    writeBlocks(self, blocknum, iov, count);
+}
+
+void flushUring(struct Disk *self) {
+    waitUring(self, -1);
+    if (self->FileDescriptor > 0)
+        fdatasync(self->FileDescriptor);
+}
+
+struct Disk *concurrentUring(struct Disk *self) {
+    return self;
+}
+
+void UringDiskDestructor(struct Disk *self) {
+    UringDisk *ring = uringOf(self);
+    if (ring != NULL) {
+        waitUring(self, -1);
+
+        munmap(ring->Sqes, ring->SqesSize);
+        if (ring->CqRing != ring->SqRing)
+            munmap(ring->CqRing, ring->CqRingSize);
+        munmap(ring->SqRing, ring->SqRingSize);
+        close(ring->RingFd);
+        pthread_mutex_destroy(&ring->Lock);
+        free(ring->Done);
+        free(ring->Counts);
+        free(ring);
+        self->Private = NULL;
+    }
+
+    DiskDestructor(self);
+}
+
+void UringDiskConstructor(struct Disk *self) {
+    DiskConstructor(self);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    UringDisk *ring = calloc(1, sizeof(UringDisk));
+    ring->RingFd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (ring->RingFd < 0)
+        uringFail("ERROR: unable to set up io_uring.");
+
+    ring->Entries = params.sq_entries;
+    ring->SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->CqRingSize > ring->SqRingSize)
+            ring->SqRingSize = ring->CqRingSize;
+        ring->CqRingSize = ring->SqRingSize;
+    }
+
+    ring->SqRing = mmap(NULL, ring->SqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->RingFd, IORING_OFF_SQ_RING);
+    if (ring->SqRing == MAP_FAILED)
+        uringFail("ERROR: unable to map io_uring.");
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->CqRing = ring->SqRing;
+    } else {
+        ring->CqRing = mmap(NULL, ring->CqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->RingFd, IORING_OFF_CQ_RING);
+        if (ring->CqRing == MAP_FAILED)
+            uringFail("ERROR: unable to map io_uring.");
+    }
+
+    ring->SqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->Sqes = mmap(NULL, ring->SqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->RingFd, IORING_OFF_SQES);
+    if (ring->Sqes == MAP_FAILED)
+        uringFail("ERROR: unable to map io_uring.");
+
+    char *sq = ring->SqRing;
+    ring->SqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->SqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->SqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->SqArray = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = ring->CqRing;
+    ring->CqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->CqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->CqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->Cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring->Done = calloc(ring->Entries, sizeof(bool));
+    ring->NextTicket = ring->Oldest = 1;
+    ring->Counts = calloc(ring->Entries, sizeof(int));
+    pthread_mutex_init(&ring->Lock, NULL);
+    self->Private = ring;
+
+    self->DiskDestructor = UringDiskDestructor;
+    self->readDisk = readUring;
+    self->writeDisk = writeUring;
+    self->readBlocks = readUringBlocks;
+    self->writeBlocks = writeUringBlocks;
+    self->readDiskAsync = readUringAsync;
+    self->writeDiskAsync = writeUringAsync;
+    self->waitDisk = waitUring;
+    self->flush = flushUring;
+    self->concurrent = concurrentUring;
+}
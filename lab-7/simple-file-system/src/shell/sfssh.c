@@ -1,18 +1,22 @@
 // sfssh.cpp: Simple file system shell
 
+#include "sfs/bufpool.h"
+#include "sfs/cache.h"
 #include "sfs/disk.h"
 #include "sfs/fs.h"
-#include "../library/disk.c"
-#include "../library/fs.c"
+#include "sfs/icache.h"
+#include "sfs/mapcache.h"
 
 // #include <sstream>
 #include <string.h>
 // #include <stdexcept>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 // Macros
 
 #define streq(a, b) (strcmp((a), (b)) == 0)
@@ -22,15 +26,21 @@
 void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_unmount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_cat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_copyjump(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_createmany(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_removemany(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_statmany(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem *fs, size_t inumber, const char *path);
+bool copyjump(FileSystem *fs, size_t inumber, const char *path);
 bool copyin(FileSystem *fs, const char *path, size_t inumber);
 
 // Main execution
@@ -38,44 +48,111 @@ bool copyin(FileSystem *fs, const char *path, size_t inumber);
 int main(int argc, char *argv[])
 {
 	Disk diskIni;
-	diskIni.FileDescriptor = 0;
-	diskIni.Blocks = 0;
-	diskIni.Reads = 0;
-	diskIni.Writes = 0;
-	diskIni.Mounts = 0;
-	diskIni.size = size;
-	diskIni.mount = mountDisk;
-	diskIni.mounted = mountedDisk;
-	diskIni.unmount = unmountDisk;
-	diskIni.readDisk = readDisk;
-	diskIni.writeDisk = writeDisk;
-	diskIni.open = openDisk;
-	diskIni.DiskDestructor = DiskDestructor;
-	diskIni.sanity_check = sanity_check;
 
 	Disk *disk;
 	disk = &diskIni;
 
 	FileSystem fsIni;
-	fsIni.debug = debug;
-	fsIni.mount = mount;
-	fsIni.format = format;
-	fsIni.create = create;
-	fsIni.removeInode = removeInode;
-	fsIni.stat = stat;
-	fsIni.readInode = readInode;
-	fsIni.writeInode = writeInode;
+	FileSystemConstructor(&fsIni);
 
 	FileSystem *fs;
 	fs = &fsIni;
 
-	if (argc != 3)
+	ssize_t cacheBlocks = -1;
+	bool mapped = false;
+	bool uring = false;
+	bool direct = false;
+	bool memory = false;
+	bool hugePages = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "a:c:d:ei:mr:t:uDHM")) != -1)
 	{
-		fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+		switch (opt)
+		{
+		case 'a':
+			setMagazineBlocks(fs, atoi(optarg));
+			break;
+		case 'c':
+			cacheBlocks = atoi(optarg);
+			break;
+		case 'd':
+			setDelayedBlocks(fs, atoi(optarg));
+			break;
+		case 'e':
+			setExtentInodes(fs, true);
+			break;
+		case 'i':
+			setInodeCacheCapacity(fs, atoi(optarg));
+			break;
+		case 'm':
+			mapped = true;
+			break;
+		case 'r':
+			setReadaheadBlocks(fs, atoi(optarg));
+			break;
+		case 't':
+			setMountThreads(fs, atoi(optarg));
+			break;
+		case 'u':
+			uring = true;
+			break;
+		case 'D':
+			direct = true;
+			break;
+		case 'H':
+			hugePages = true;
+			/* fall through */
+		case 'M':
+			memory = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a magazineblocks] [-c cacheblocks] [-d delayblocks] [-e] [-i inodes] [-r readahead] [-t mountthreads] [-m | -u | -D | -M | -H] <diskfile> <nblocks>\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "Usage: %s [-a magazineblocks] [-c cacheblocks] [-d delayblocks] [-e] [-i inodes] [-r readahead] [-t mountthreads] [-m | -u | -D | -M | -H] <diskfile> <nblocks>\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	disk->open(disk, argv[1], atoi(argv[2]));
+	// A mapped image or memory disk is already in memory, only cache it when asked to
+	if (memory)
+	{
+		MemoryDiskConstructor(&diskIni, hugePages);
+		if (cacheBlocks < 0)
+			cacheBlocks = 0;
+	}
+	else if (mapped)
+	{
+		MmapDiskConstructor(&diskIni);
+		if (cacheBlocks < 0)
+			cacheBlocks = 0;
+	}
+	else
+	{
+		if (uring)
+			UringDiskConstructor(&diskIni);
+		else if (direct)
+			DirectDiskConstructor(&diskIni);
+		else
+			DiskConstructor(&diskIni);
+		if (cacheBlocks < 0)
+			cacheBlocks = CACHE_DEFAULT_BLOCKS;
+	}
+
+	// Put the block cache in front of the disk image, "-c 0" disables it
+	Disk cacheIni;
+	BlockCache *cache = NULL;
+	if (cacheBlocks > 0)
+	{
+		CacheDiskConstructor(&cacheIni, disk, cacheBlocks);
+		cache = cacheOf(&cacheIni);
+		disk = &cacheIni;
+	}
+
+	disk->open(disk, argv[optind], atoi(argv[optind + 1]));
 
 	while (true)
 	{
@@ -97,11 +174,63 @@ int main(int argc, char *argv[])
 
 		if (streq(cmd, "pbm"))
 		{
-			printBitmaps();
+			printBitmaps(fs);
 		}
 		else if (streq(cmd, "rws"))
 		{
-			printf("reads:%d | writes:%d\n", Reads, Writes);
+			if (cache != NULL)
+			{
+				printf("reads:%zu | writes:%zu | hits:%zu | misses:%zu\n",
+					   diskIni.Reads, diskIni.Writes, cache->Hits, cache->Misses);
+			}
+			else
+			{
+				printf("reads:%zu | writes:%zu\n", diskIni.Reads, diskIni.Writes);
+			}
+
+			InodeCache *inodes = getInodeCache(fs);
+			if (inodes != NULL)
+			{
+				printf("inode hits:%zu | misses:%zu | evictions:%zu | writebacks:%zu\n",
+					   inodes->Hits, inodes->Misses, inodes->Evictions, inodes->WriteBacks);
+			}
+
+			if (diskIni.Buffers != NULL)
+			{
+				printf("buffer takes:%zu | overflows:%zu\n",
+					   diskIni.Buffers->Takes, diskIni.Buffers->Overflows);
+			}
+
+			MapCache *maps = getMapCache(fs);
+			if (maps != NULL)
+			{
+				printf("map hits:%zu | misses:%zu | extents:%zu | evictions:%zu\n",
+					   maps->Hits, maps->Misses, maps->Extents, maps->Evictions);
+			}
+		}
+		else if (streq(cmd, "snapshot"))
+		{
+			if (args != 2)
+			{
+				printf("Usage: snapshot <file>\n");
+			}
+			else if (!memory)
+			{
+				printf("snapshot needs a memory disk (-M or -H)\n");
+			}
+			else if (disk->mounted(disk))
+			{
+				// The file system keeps inodes and data in memory until unmounted
+				printf("unmount before taking a snapshot\n");
+			}
+			else
+			{
+				disk->flush(disk);
+				if (saveMemoryDisk(&diskIni, arg1))
+					printf("disk saved to %s.\n", arg1);
+				else
+					printf("snapshot failed!\n");
+			}
 		}
 		else if (streq(cmd, "debug"))
 		{
@@ -115,6 +244,10 @@ int main(int argc, char *argv[])
 		{
 			do_mount(disk, fs, args, arg1, arg2);
 		}
+		else if (streq(cmd, "unmount"))
+		{
+			do_unmount(disk, fs, args, arg1, arg2);
+		}
 		else if (streq(cmd, "cat"))
 		{
 			do_cat(disk, fs, args, arg1, arg2);
@@ -123,6 +256,10 @@ int main(int argc, char *argv[])
 		{
 			do_copyout(disk, fs, args, arg1, arg2);
 		}
+		else if (streq(cmd, "copyjump"))
+		{
+			do_copyjump(disk, fs, args, arg1, arg2);
+		}
 		else if (streq(cmd, "create"))
 		{
 			do_create(disk, fs, args, arg1, arg2);
@@ -135,6 +272,18 @@ int main(int argc, char *argv[])
 		{
 			do_stat(disk, fs, args, arg1, arg2);
 		}
+		else if (streq(cmd, "createmany"))
+		{
+			do_createmany(disk, fs, args, arg1, arg2);
+		}
+		else if (streq(cmd, "removemany"))
+		{
+			do_removemany(disk, fs, args, arg1, arg2);
+		}
+		else if (streq(cmd, "statmany"))
+		{
+			do_statmany(disk, fs, args, arg1, arg2);
+		}
 		else if (streq(cmd, "copyin"))
 		{
 			do_copyin(disk, fs, args, arg1, arg2);
@@ -153,6 +302,12 @@ int main(int argc, char *argv[])
 			printf("Type 'help' for a list of commands.\n");
 		}
 	}
+
+	if (disk->mounted(disk))
+	{
+		fs->unmount(fs, disk);
+	}
+	fs->FileSystemDestructor(fs);
 	disk->DiskDestructor(disk);
 	return EXIT_SUCCESS;
 }
@@ -167,7 +322,7 @@ void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 		return;
 	}
 
-	fs->debug(disk);
+	fs->debug(fs, disk);
 }
 
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
@@ -178,7 +333,7 @@ void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 		return;
 	}
 
-	if (fs->format(disk))
+	if (fs->format(fs, disk))
 	{
 		printf("disk formatted.\n");
 	}
@@ -196,7 +351,7 @@ void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 		return;
 	}
 
-	if (fs->mount(disk))
+	if (fs->mount(fs, disk))
 	{
 		printf("disk mounted.\n");
 	}
@@ -206,6 +361,24 @@ void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 	}
 }
 
+void do_unmount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
+{
+	if (args != 1)
+	{
+		printf("Usage: unmount\n");
+		return;
+	}
+
+	if (fs->unmount(fs, disk))
+	{
+		printf("disk unmounted.\n");
+	}
+	else
+	{
+		printf("unmount failed!\n");
+	}
+}
+
 void do_cat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 {
 	if (args != 2)
@@ -234,6 +407,20 @@ void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 	}
 }
 
+void do_copyjump(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
+{
+	if (args != 3)
+	{
+		printf("Usage: copyjump <inode> <file>\n");
+		return;
+	}
+
+	if (!copyjump(fs, atoi(arg1), arg2))
+	{
+		printf("copyjump failed!\n");
+	}
+}
+
 void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 {
 	if (args != 1)
@@ -242,7 +429,7 @@ void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 		return;
 	}
 
-	ssize_t inumber = fs->create();
+	ssize_t inumber = fs->create(fs);
 	if (inumber >= 0)
 	{
 		printf("created inode %ld.\n", inumber);
@@ -262,7 +449,7 @@ void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 	}
 
 	size_t inumber = atoi(arg1);
-	if (fs->removeInode(inumber))
+	if (fs->removeInode(fs, inumber))
 	{
 		printf("removed inode %ld.\n", inumber);
 	}
@@ -281,7 +468,7 @@ void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 	}
 
 	size_t inumber = atoi(arg1);
-	ssize_t bytes = fs->stat(inumber);
+	ssize_t bytes = fs->stat(fs, inumber);
 	if ((int)bytes >= 0)
 	{
 		printf("inode %ld has size %zd bytes.\n", inumber, bytes);
@@ -292,6 +479,91 @@ void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 	}
 }
 
+void do_createmany(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
+{
+	if (args != 2)
+	{
+		printf("Usage: createmany <count>\n");
+		return;
+	}
+
+	size_t count = atoi(arg1);
+	size_t *inumbers = malloc(count * sizeof(size_t));
+	ssize_t created = fs->createMany(fs, count, inumbers);
+	if (created >= 0)
+	{
+		printf("created %zd inodes.\n", created);
+	}
+	else
+	{
+		printf("createmany failed!\n");
+	}
+	free(inumbers);
+}
+
+// Fill "inumbers" with the inodes from "first" to "last", both included
+size_t inodeRange(char *first, char *last, size_t **inumbers)
+{
+	size_t from = atoi(first), to = atoi(last);
+	size_t count = to >= from ? to - from + 1 : 0;
+
+	*inumbers = malloc(count * sizeof(size_t));
+	for (size_t i = 0; i < count; i++)
+	{
+		(*inumbers)[i] = from + i;
+	}
+	return count;
+}
+
+void do_removemany(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
+{
+	if (args != 3)
+	{
+		printf("Usage: removemany <first> <last>\n");
+		return;
+	}
+
+	size_t *inumbers;
+	size_t count = inodeRange(arg1, arg2, &inumbers);
+	ssize_t removed = fs->removeMany(fs, inumbers, count);
+	if (removed >= 0)
+	{
+		printf("removed %zd inodes.\n", removed);
+	}
+	else
+	{
+		printf("removemany failed!\n");
+	}
+	free(inumbers);
+}
+
+void do_statmany(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
+{
+	if (args != 3)
+	{
+		printf("Usage: statmany <first> <last>\n");
+		return;
+	}
+
+	size_t *inumbers;
+	size_t count = inodeRange(arg1, arg2, &inumbers);
+	ssize_t *sizes = malloc(count * sizeof(ssize_t));
+	if (fs->statMany(fs, inumbers, count, sizes) >= 0)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (sizes[i] >= 0)
+				printf("inode %ld has size %zd bytes.\n", inumbers[i], sizes[i]);
+		}
+	}
+	else
+	{
+		printf("statmany failed!\n");
+	}
+	free(sizes);
+	free(inumbers);
+}
+
 void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 {
 	if (args != 3)
@@ -311,15 +583,21 @@ void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2)
 	printf("Commands are:\n");
 	printf("    format\n");
 	printf("    mount\n");
+	printf("    unmount\n");
 	printf("    debug\n");
 	printf("    create\n");
 	printf("    remove  <inode>\n");
 	printf("    cat     <inode>\n");
 	printf("    stat    <inode>\n");
+	printf("    createmany <count>\n");
+	printf("    removemany <first> <last>\n");
+	printf("    statmany   <first> <last>\n");
 	printf("    copyin  <file> <inode>\n");
 	printf("    copyout <inode> <file>\n");
+	printf("    copyjump <inode> <file>\n");
 	printf("    pbm\n");
 	printf("    rws\n");
+	printf("    snapshot <file>\n");
 	printf("    help\n");
 	printf("    quit\n");
 	printf("    exit\n");
@@ -334,11 +612,19 @@ bool copyout(FileSystem *fs, size_t inumber, const char *path)
 		return false;
 	}
 
+	FileHandle *file = fs->open(fs, inumber);
+	if (file == NULL)
+	{
+		printf("0 bytes copied\n");
+		fclose(stream);
+		return true;
+	}
+
 	char buffer[4 * BUFSIZ] = {0};
 	size_t offset = 0;
 	while (true)
 	{
-		ssize_t result = fs->readInode(inumber, buffer, sizeof(buffer), offset);
+		ssize_t result = fs->read(fs, file, buffer, sizeof(buffer));
 		if (result <= 0)
 		{
 			break;
@@ -346,12 +632,59 @@ bool copyout(FileSystem *fs, size_t inumber, const char *path)
 		fwrite(buffer, 1, result, stream);
 		offset += result;
 	}
+	fs->close(fs, file);
 
 	printf("%zd bytes copied\n", offset);
 	fclose(stream);
 	return true;
 }
 
+// Copy a file out a chunk at a time, alternating between the chunks left at
+// its front and at its back, so every read jumps across the file
+bool copyjump(FileSystem *fs, size_t inumber, const char *path)
+{
+	FILE *stream = fopen(path, "w");
+	if (stream == NULL)
+	{
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	ssize_t size = fs->stat(fs, inumber);
+	FileHandle *file = size > 0 ? fs->open(fs, inumber) : NULL;
+	if (file == NULL)
+	{
+		printf("0 bytes copied\n");
+		fclose(stream);
+		return true;
+	}
+
+	char buffer[4 * BUFSIZ] = {0};
+	size_t chunks = (size + sizeof(buffer) - 1) / sizeof(buffer);
+	size_t front = 0;
+	size_t back = chunks;
+	size_t copied = 0;
+	for (size_t i = 0; i < chunks; i++)
+	{
+		size_t chunk = i % 2 == 0 ? front++ : --back;
+		size_t offset = chunk * sizeof(buffer);
+		if (!fs->seek(fs, file, offset))
+			break;
+
+		ssize_t result = fs->read(fs, file, buffer, sizeof(buffer));
+		if (result <= 0)
+			break;
+		fseek(stream, offset, SEEK_SET);
+		fwrite(buffer, 1, result, stream);
+		copied += result;
+	}
+	fs->close(fs, file);
+
+	printf("%zu bytes copied\n", copied);
+	fclose(stream);
+	return true;
+}
+
 bool copyin(FileSystem *fs, const char *path, size_t inumber)
 {
 	FILE *stream = fopen(path, "r");
@@ -361,6 +694,15 @@ bool copyin(FileSystem *fs, const char *path, size_t inumber)
 		return false;
 	}
 
+	FileHandle *file = fs->open(fs, inumber);
+	if (file == NULL)
+	{
+		fprintf(stderr, "fs->open failed for inode %zu\n", inumber);
+		printf("0 bytes copied\n");
+		fclose(stream);
+		return true;
+	}
+
 	char buffer[4 * BUFSIZ] = {0};
 	size_t offset = 0;
 	while (true)
@@ -371,7 +713,7 @@ bool copyin(FileSystem *fs, const char *path, size_t inumber)
 			break;
 		}
 
-		ssize_t actual = fs->writeInode(inumber, buffer, result, offset);
+		ssize_t actual = fs->write(fs, file, buffer, result);
 		if (actual < 0)
 		{
 			fprintf(stderr, "fs->write returned invalid result %ld\n", actual);
@@ -384,6 +726,7 @@ bool copyin(FileSystem *fs, const char *path, size_t inumber)
 			break;
 		}
 	}
+	fs->close(fs, file);
 
 	printf("%zd bytes copied\n", offset);
 	fclose(stream);
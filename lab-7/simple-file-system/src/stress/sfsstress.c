@@ -0,0 +1,472 @@
+// sfsstress.c: Concurrent access stress test
+
+#include "sfs/cache.h"
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+// Files are rewritten by their own writer and read by every reader. Each
+// write stores a whole generation of a file: a header naming the generation
+// and its length, then bytes that depend on the volume, the file, the
+// generation and the offset. A reader that sees a mix of two generations, or
+// a file that does not come back after a remount, fails the test.
+//
+// Given a second image, both are formatted and mounted by two FileSystem
+// instances at once, each with its own set of threads. The files of both get
+// the same inode numbers but different data and lengths, and each image must
+// have as much free space after its files are removed as when it was fresh,
+// so neither instance may see or allocate from the other's blocks.
+//
+// With -f, a filler takes the place of the writers and readers: it writes a
+// file until the disk is full and removes it, over and over, while the churn
+// files are written, still buffered by delayed allocation, and read back. A
+// churn write may come up short while the disk is full, but one that went
+// through whole must read back intact.
+
+#define VOLUMES 2
+#define FILES 8
+#define WRITERS 2
+#define READERS 4
+#define ROUNDS 100
+#define MAX_LENGTH (64 * BLOCK_SIZE)
+
+typedef struct Header
+{
+	uint32_t Generation;
+	uint32_t Length;
+} Header;
+
+typedef struct Volume
+{
+	FileSystem Fs;
+	Disk DiskIni;
+	Disk CacheIni;
+	Disk *Disk;
+	const char *Path;
+	uint32_t Seed;           // Mixed into the data and lengths of the files
+	size_t Inumbers[FILES];
+	uint32_t Generations[FILES];
+	bool Writing;
+	bool Filling;            // Whether or not a filler runs instead of the writers and readers
+	size_t Capacity;         // Bytes a single file could hold when formatted
+	pthread_t Writers[WRITERS];
+	pthread_t Readers[READERS];
+	pthread_t Churn;
+	pthread_t Filler;
+	size_t Reads;
+	size_t Writes;
+	size_t Churns;
+	size_t Fills;
+} Volume;
+
+typedef struct Worker
+{
+	Volume *Volume;
+	size_t Index;
+} Worker;
+
+Volume volumes[VOLUMES];
+Worker writerArgs[VOLUMES][WRITERS];
+Worker readerArgs[VOLUMES][READERS];
+bool failed = false;
+
+char pattern(Volume *volume, size_t inumber, uint32_t generation, size_t offset)
+{
+	return (char)(volume->Seed * 17 + inumber * 131 + generation * 31 + offset * 7 + (offset >> 12));
+}
+
+size_t generationLength(Volume *volume, size_t file, uint32_t generation)
+{
+	return sizeof(Header) + (file * 5000 + generation * 3000 + volume->Seed * 1000) % MAX_LENGTH;
+}
+
+void fill(Volume *volume, char *buffer, size_t inumber, uint32_t generation, size_t length)
+{
+	Header header = {generation, length};
+	memcpy(buffer, &header, sizeof(Header));
+	for (size_t i = sizeof(Header); i < length; i++)
+		buffer[i] = pattern(volume, inumber, generation, i);
+}
+
+// Check that a buffer holds one whole generation
+bool check(Volume *volume, const char *buffer, ssize_t read, size_t inumber, uint32_t *generation)
+{
+	Header header;
+	if (read < (ssize_t)sizeof(Header))
+		return false;
+
+	memcpy(&header, buffer, sizeof(Header));
+	if (header.Length > (size_t)read || header.Length < sizeof(Header))
+		return false;
+
+	for (size_t i = sizeof(Header); i < header.Length; i++)
+	{
+		if (buffer[i] != pattern(volume, inumber, header.Generation, i))
+			return false;
+	}
+
+	if (generation != NULL)
+		*generation = header.Generation;
+	return true;
+}
+
+void fail(Volume *volume, const char *what, size_t inumber)
+{
+	fprintf(stdout, "%s failed on inode %zu of %s.\n", what, inumber, volume->Path);
+	__atomic_store_n(&failed, true, __ATOMIC_RELAXED);
+}
+
+// Whether or not to go on, until the writers are done if "volume" is given
+bool running(Volume *volume)
+{
+	if (__atomic_load_n(&failed, __ATOMIC_RELAXED))
+		return false;
+	return volume == NULL || __atomic_load_n(&volume->Writing, __ATOMIC_RELAXED);
+}
+
+void *writer(void *arg)
+{
+	Worker *worker = arg;
+	Volume *volume = worker->Volume;
+	FileSystem *fs = &volume->Fs;
+	char *buffer = malloc(MAX_LENGTH + sizeof(Header));
+
+	for (uint32_t round = 1; round <= ROUNDS && running(NULL); round++)
+	{
+		for (size_t file = worker->Index; file < FILES; file += WRITERS)
+		{
+			size_t inumber = volume->Inumbers[file];
+			size_t length = generationLength(volume, file, round);
+			fill(volume, buffer, inumber, round, length);
+			if (fs->writeInode(fs, inumber, buffer, length, 0) != (ssize_t)length)
+				fail(volume, "write", inumber);
+			volume->Generations[file] = round;
+			__atomic_fetch_add(&volume->Writes, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+void *reader(void *arg)
+{
+	Worker *worker = arg;
+	Volume *volume = worker->Volume;
+	FileSystem *fs = &volume->Fs;
+	size_t seed = worker->Index + 1;
+	char *buffer = malloc(2 * MAX_LENGTH);
+
+	while (running(volume))
+	{
+		seed = seed * 1103515245 + 12345;
+		size_t file = (seed >> 16) % FILES;
+		size_t inumber = volume->Inumbers[file];
+
+		// Alternate between one-shot reads and reads through a handle
+		ssize_t read;
+		if (seed & 0x10000)
+		{
+			read = fs->readInode(fs, inumber, buffer, 2 * MAX_LENGTH, 0);
+		}
+		else
+		{
+			FileHandle *handle = fs->open(fs, inumber);
+			read = fs->read(fs, handle, buffer, 2 * MAX_LENGTH);
+			fs->close(fs, handle);
+		}
+
+		if (!check(volume, buffer, read, inumber, NULL))
+			fail(volume, "read", inumber);
+		__atomic_fetch_add(&volume->Reads, 1, __ATOMIC_RELAXED);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+// Create, write, read back and remove files while the others are in use
+void *churner(void *arg)
+{
+	Volume *volume = arg;
+	FileSystem *fs = &volume->Fs;
+	char *buffer = malloc(4 * BLOCK_SIZE);
+	char *back = malloc(4 * BLOCK_SIZE);
+
+	while (running(volume))
+	{
+		ssize_t inumber = fs->create(fs);
+		if (inumber < 0)
+		{
+			fail(volume, "create", 0);
+			break;
+		}
+
+		size_t length = sizeof(Header) + (volume->Churns * 1000) % (3 * BLOCK_SIZE);
+		fill(volume, buffer, inumber, volume->Churns, length);
+		ssize_t written = fs->writeInode(fs, inumber, buffer, length, 0);
+		if (written == (ssize_t)length)
+		{
+			ssize_t read = fs->readInode(fs, inumber, back, 4 * BLOCK_SIZE, 0);
+			if (read != (ssize_t)length || memcmp(buffer, back, length) != 0)
+				fail(volume, "churn read", inumber);
+		}
+		else if (!volume->Filling)
+		{
+			fail(volume, "churn write", inumber);
+		}
+		if (!fs->removeInode(fs, inumber))
+			fail(volume, "remove", inumber);
+
+		volume->Churns++;
+	}
+
+	free(back);
+	free(buffer);
+	return NULL;
+}
+
+// Fill the disk up with one file and remove it again, ROUNDS times
+void *filler(void *arg)
+{
+	Volume *volume = arg;
+	FileSystem *fs = &volume->Fs;
+	char *buffer = calloc(1, MAX_LENGTH);
+
+	for (size_t round = 0; round < ROUNDS && running(NULL); round++)
+	{
+		ssize_t inumber = fs->create(fs);
+		if (inumber < 0)
+		{
+			fail(volume, "fill create", 0);
+			break;
+		}
+
+		size_t size = 0;
+		ssize_t written;
+		while ((written = fs->writeInode(fs, inumber, buffer, MAX_LENGTH, size)) == MAX_LENGTH)
+			size += written;
+		if (written > 0)
+			size += written;
+		if (fs->stat(fs, inumber) != (ssize_t)size)
+			fail(volume, "fill", inumber);
+		if (!fs->removeInode(fs, inumber))
+			fail(volume, "fill remove", inumber);
+
+		volume->Fills++;
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+// Return how many bytes one file can hold, leaving no file behind
+size_t capacity(Volume *volume)
+{
+	FileSystem *fs = &volume->Fs;
+	char *buffer = calloc(1, MAX_LENGTH);
+	ssize_t inumber = fs->create(fs);
+	size_t size = 0;
+
+	while (inumber >= 0)
+	{
+		ssize_t written = fs->writeInode(fs, inumber, buffer, MAX_LENGTH, size);
+		if (written <= 0)
+			break;
+		size += written;
+	}
+
+	if (inumber >= 0)
+		fs->removeInode(fs, inumber);
+	free(buffer);
+	return size;
+}
+
+bool openVolume(Volume *volume, const char *path, size_t nblocks, ssize_t cacheBlocks, bool uring, bool direct)
+{
+	volume->Path = path;
+	volume->Disk = &volume->DiskIni;
+	if (uring)
+		UringDiskConstructor(&volume->DiskIni);
+	else if (direct)
+		DirectDiskConstructor(&volume->DiskIni);
+	else
+		DiskConstructor(&volume->DiskIni);
+	if (cacheBlocks > 0)
+	{
+		CacheDiskConstructor(&volume->CacheIni, volume->Disk, cacheBlocks);
+		volume->Disk = &volume->CacheIni;
+	}
+	volume->Disk->open(volume->Disk, path, nblocks);
+
+	FileSystem *fs = &volume->Fs;
+	if (!fs->format(fs, volume->Disk) || !fs->mount(fs, volume->Disk))
+	{
+		fprintf(stdout, "could not format and mount %s.\n", path);
+		return false;
+	}
+	volume->Capacity = capacity(volume);
+
+	// Start every file with its first generation
+	char *buffer = malloc(2 * MAX_LENGTH);
+	for (size_t file = 0; file < FILES; file++)
+	{
+		volume->Inumbers[file] = fs->create(fs);
+		size_t length = generationLength(volume, file, 0);
+		fill(volume, buffer, volume->Inumbers[file], 0, length);
+		fs->writeInode(fs, volume->Inumbers[file], buffer, length, 0);
+	}
+	free(buffer);
+
+	volume->Writing = true;
+	return true;
+}
+
+void startVolume(Volume *volume, size_t v)
+{
+	pthread_create(&volume->Churn, NULL, churner, volume);
+	if (volume->Filling)
+	{
+		pthread_create(&volume->Filler, NULL, filler, volume);
+		return;
+	}
+
+	for (size_t i = 0; i < WRITERS; i++)
+	{
+		writerArgs[v][i] = (Worker){volume, i};
+		pthread_create(&volume->Writers[i], NULL, writer, &writerArgs[v][i]);
+	}
+	for (size_t i = 0; i < READERS; i++)
+	{
+		readerArgs[v][i] = (Worker){volume, i};
+		pthread_create(&volume->Readers[i], NULL, reader, &readerArgs[v][i]);
+	}
+}
+
+void joinVolume(Volume *volume)
+{
+	if (volume->Filling)
+	{
+		pthread_join(volume->Filler, NULL);
+		__atomic_store_n(&volume->Writing, false, __ATOMIC_RELAXED);
+		pthread_join(volume->Churn, NULL);
+		return;
+	}
+
+	for (size_t i = 0; i < WRITERS; i++)
+		pthread_join(volume->Writers[i], NULL);
+	__atomic_store_n(&volume->Writing, false, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < READERS; i++)
+		pthread_join(volume->Readers[i], NULL);
+	pthread_join(volume->Churn, NULL);
+}
+
+// Every file must come back with its last generation, and removing them all
+// must give back every block
+void checkVolume(Volume *volume)
+{
+	FileSystem *fs = &volume->Fs;
+	char *buffer = malloc(2 * MAX_LENGTH);
+
+	fs->unmount(fs, volume->Disk);
+	fs->mount(fs, volume->Disk);
+	for (size_t file = 0; file < FILES && !failed; file++)
+	{
+		uint32_t generation;
+		size_t inumber = volume->Inumbers[file];
+		ssize_t read = fs->readInode(fs, inumber, buffer, 2 * MAX_LENGTH, 0);
+		if (!check(volume, buffer, read, inumber, &generation) || generation != volume->Generations[file])
+			fail(volume, "remount", inumber);
+	}
+
+	if (!failed)
+	{
+		fs->removeMany(fs, volume->Inumbers, FILES);
+		if (capacity(volume) != volume->Capacity)
+			fail(volume, "free space", 0);
+	}
+	fs->unmount(fs, volume->Disk);
+	free(buffer);
+}
+
+int main(int argc, char *argv[])
+{
+	for (size_t v = 0; v < VOLUMES; v++)
+	{
+		FileSystemConstructor(&volumes[v].Fs);
+		volumes[v].Seed = v;
+	}
+
+	ssize_t cacheBlocks = CACHE_DEFAULT_BLOCKS;
+	bool uring = false;
+	bool direct = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:Defu")) != -1)
+	{
+		switch (opt)
+		{
+		case 'c':
+			cacheBlocks = atoi(optarg);
+			break;
+		case 'D':
+			direct = true;
+			break;
+		case 'e':
+			for (size_t v = 0; v < VOLUMES; v++)
+				setExtentInodes(&volumes[v].Fs, true);
+			break;
+		case 'f':
+			for (size_t v = 0; v < VOLUMES; v++)
+				volumes[v].Filling = true;
+			break;
+		case 'u':
+			uring = true;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+
+	size_t nvolumes = (argc - optind) / 2;
+	if ((argc - optind) % 2 != 0 || nvolumes < 1 || nvolumes > VOLUMES)
+	{
+		fprintf(stderr, "Usage: %s [-c cacheblocks] [-e] [-f] [-D | -u] <diskfile> <nblocks> [<diskfile> <nblocks>]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t v = 0; v < nvolumes; v++)
+	{
+		char **image = &argv[optind + 2 * v];
+		if (!openVolume(&volumes[v], image[0], atoi(image[1]), cacheBlocks, uring, direct))
+			return EXIT_FAILURE;
+	}
+
+	for (size_t v = 0; v < nvolumes; v++)
+		startVolume(&volumes[v], v);
+	for (size_t v = 0; v < nvolumes; v++)
+		joinVolume(&volumes[v]);
+	for (size_t v = 0; v < nvolumes; v++)
+		checkVolume(&volumes[v]);
+
+	if (failed)
+		return EXIT_FAILURE;
+
+	for (size_t v = 0; v < nvolumes; v++)
+	{
+		Volume *volume = &volumes[v];
+		fprintf(stderr, "%s: %zu reads, %zu writes, %zu churned files, %zu fills\n",
+				volume->Path, volume->Reads, volume->Writes, volume->Churns, volume->Fills);
+		volume->Fs.FileSystemDestructor(&volume->Fs);
+		volume->Disk->DiskDestructor(volume->Disk);
+	}
+	fprintf(stdout, "stress test passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+format
+mount
+create
+copyin $SCRATCH/input 0
+stat 0
+copyout 0 $SCRATCH/output
+unmount
+mount
+copyout 0 $SCRATCH/remount
+EOF
+}
+
+test-binary() {
+    SIZE=$1
+    FLAGS=$2
+
+    # Data full of NUL bytes that ends in the middle of a block
+    head -c $SIZE /dev/urandom > $SCRATCH/input
+    rm -f $SCRATCH/output $SCRATCH/remount $SCRATCH/reopen
+    truncate -s 0 $SCRATCH/image.200
+
+    echo -n "Testing binary copy of $SIZE bytes with flags '$FLAGS' on $SCRATCH/image.200 ... "
+    test-input | ./bin/sfssh $FLAGS $SCRATCH/image.200 200 > $SCRATCH/test.log 2> /dev/null
+
+    # The image file itself must hold the data once the shell is gone
+    printf "mount\ncopyout 0 $SCRATCH/reopen\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+    if grep -q "inode 0 has size $SIZE bytes." $SCRATCH/test.log &&
+       cmp -s $SCRATCH/input $SCRATCH/output &&
+       cmp -s $SCRATCH/input $SCRATCH/remount &&
+       cmp -s $SCRATCH/input $SCRATCH/reopen; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+# The read/write backend, the mapped image, whose writes reach the file
+# through msync, and io_uring, with and without the block cache in front
+for flags in "" "-m" "-u" "-u -c 0"; do
+    test-binary 1000 "$flags"
+    test-binary 40000 "$flags"
+    test-binary 300000 "$flags"
+done
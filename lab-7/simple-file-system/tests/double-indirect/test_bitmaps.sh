@@ -0,0 +1,66 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+setup-input() {
+    cat <<EOF
+format
+mount
+create
+create
+remove 0
+unmount
+EOF
+}
+
+remount-input() {
+    cat <<EOF
+mount
+stat 0
+stat 1
+EOF
+}
+
+clean-output() {
+    cat <<EOF
+disk mounted.
+stat failed!
+inode 1 has size 0 bytes.
+3 disk block reads
+0 disk block writes
+EOF
+}
+
+unclean-output() {
+    cat <<EOF
+disk mounted.
+stat failed!
+inode 1 has size 0 bytes.
+21 disk block reads
+2 disk block writes
+EOF
+}
+
+test-remount() {
+    NAME=$1
+    OUTPUT=$2
+
+    echo -n "Testing $NAME remount on $SCRATCH/image.200 ... "
+    if diff -u <(remount-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <($OUTPUT) > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+cp data/image.200 $SCRATCH/image.200
+setup-input | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+
+# A clean image is mounted from its bitmaps alone
+test-remount clean clean-output
+
+# Clearing the clean flag forces the full scan, and unmount saves the bitmaps again
+printf '\x00' | dd of=$SCRATCH/image.200 bs=1 seek=24 conv=notrunc 2> /dev/null
+test-remount unclean unclean-output
@@ -0,0 +1,95 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+
+# Test 0
+
+test-0-input() {
+    cat <<EOF
+mount
+createmany 3
+statmany 0 5
+removemany 2 3
+statmany 0 5
+removemany 0 1
+debug
+EOF
+}
+
+test-0-output() {
+    cat <<EOF
+disk mounted.
+created 3 inodes.
+inode 0 has size 0 bytes.
+inode 1 has size 0 bytes.
+inode 2 has size 27160 bytes.
+inode 3 has size 9546 bytes.
+inode 4 has size 0 bytes.
+removed 2 inodes.
+inode 0 has size 0 bytes.
+inode 1 has size 0 bytes.
+inode 4 has size 0 bytes.
+removed 2 inodes.
+SuperBlock:
+    magic number is valid
+    20 blocks
+    2 inode blocks
+    226 inodes
+Inode 4:
+    size: 0 bytes
+    direct blocks:
+4 disk block reads
+2 disk block writes
+EOF
+}
+
+cp data/image.di.20 $SCRATCH/image.di.20
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+echo -n "Testing bulk operations in $SCRATCH/image.di.20 ... "
+if diff -u <(test-0-input | ./bin/sfssh $SCRATCH/image.di.20 20 2> /dev/null) <(test-0-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "False"
+    cat $SCRATCH/test.log
+fi
+
+# Test 1
+
+test-1-input() {
+    cat <<EOF
+mount
+remove 2
+create
+createmany 2
+unmount
+mount
+statmany 0 4
+EOF
+}
+
+test-1-output() {
+    cat <<EOF
+disk mounted.
+removed inode 2.
+created inode 0.
+created 2 inodes.
+disk unmounted.
+disk mounted.
+inode 0 has size 0 bytes.
+inode 1 has size 0 bytes.
+inode 2 has size 0 bytes.
+inode 3 has size 9546 bytes.
+4 disk block reads
+2 disk block writes
+EOF
+}
+
+cp data/image.di.20 $SCRATCH/image.di.20
+echo -n "Testing bulk operations in $SCRATCH/image.di.20 ... "
+if diff -u <(test-1-input | ./bin/sfssh $SCRATCH/image.di.20 20 2> /dev/null) <(test-1-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "False"
+    cat $SCRATCH/test.log
+fi
@@ -11,7 +11,7 @@ image-5-output() {
 
 
 0 disk block writes
-5 disk block reads
+3 disk block reads
 965 bytes copied
 All mimsy were the borogoves,
 All mimsy were the borogoves,
@@ -219,7 +219,7 @@ image-20-output() {
 
 0 bytes copied
 0 disk block writes
-20 disk block reads
+14 disk block reads
 27160 bytes copied
 9546 bytes copied
    Abraham Clark
@@ -477,8 +477,8 @@ Inode 111:
 Inode 112:
     size: 0 bytes
     direct blocks:
-230 disk block reads
-112 disk block writes
+2 disk block reads
+1 disk block writes
 EOF
 }
 
@@ -35,6 +35,26 @@ Inode 3:
 EOF
 }
 
+image-double-output() {
+    cat <<EOF
+SuperBlock:
+    magic number is valid
+    1200 blocks
+    120 inode blocks
+    13560 inodes
+Inode 0:
+    size: 4239360 bytes
+    direct blocks: 121 122 123 124 125
+    indirect block: 126
+    indirect data blocks: $(seq -s ' ' 127 1150)
+    double indirect block: 1151
+    double indirect pointer blocks: 1152
+    doubly directed indirect data blocks: 1153 1154 1155 1156 1157 1158
+124 disk block reads
+0 disk block writes
+EOF
+}
+
 test-debug() {
     DISK=$1
     BLOCKS=$2
@@ -52,3 +72,13 @@ test-debug() {
 
 test-debug data/image.di.5   5   image-5-output
 test-debug data/image.di.20  20  image-20-output
+
+# A file reaching into its double indirect block, written on a fresh image
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+head -c $((1035 * 4096)) /dev/zero > $SCRATCH/input
+printf "format\nmount\ncreate\ncopyin $SCRATCH/input 0\nunmount\n" |
+    ./bin/sfssh $SCRATCH/image.1200 1200 > /dev/null 2>&1
+test-debug $SCRATCH/image.1200 1200 image-double-output
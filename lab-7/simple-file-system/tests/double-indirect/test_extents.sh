@@ -0,0 +1,112 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+head -c 30000 /dev/urandom > $SCRATCH/30000.bin
+head -c 9000 /dev/urandom > $SCRATCH/9000.bin
+head -c 40000 /dev/urandom > $SCRATCH/40000.bin
+truncate -s 0 $SCRATCH/image.200
+
+# Test 0: files written as they arrive on a fresh image each take one extent
+
+test-0-input() {
+    cat <<EOF
+format
+mount
+create
+copyin $SCRATCH/30000.bin 0
+create
+copyin $SCRATCH/9000.bin 1
+remove 0
+create
+copyin $SCRATCH/9000.bin 0
+debug
+unmount
+EOF
+}
+
+test-0-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+30000 bytes copied
+created inode 1.
+9000 bytes copied
+removed inode 0.
+created inode 0.
+9000 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2260 inodes
+    extent inodes
+Inode 0:
+    size: 9000 bytes
+    extents: 21-23
+Inode 1:
+    size: 9000 bytes
+    extents: 29-31
+disk unmounted.
+EOF
+}
+
+echo -n "Testing extents in $SCRATCH/image.200 ... "
+if diff -u <(test-0-input | ./bin/sfssh -d 0 -e $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-0-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "False"
+    cat $SCRATCH/test.log
+fi
+
+# Test 1: without saved bitmaps, mount finds the blocks in use from the extents
+
+test-1-input() {
+    cat <<EOF
+mount
+create
+copyin $SCRATCH/40000.bin 2
+copyout 1 $SCRATCH/9000.out
+copyout 2 $SCRATCH/40000.out
+debug
+EOF
+}
+
+test-1-output() {
+    cat <<EOF
+disk mounted.
+created inode 2.
+40000 bytes copied
+9000 bytes copied
+40000 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2260 inodes
+    extent inodes
+Inode 0:
+    size: 9000 bytes
+    extents: 21-23
+Inode 1:
+    size: 9000 bytes
+    extents: 29-31
+Inode 2:
+    size: 40000 bytes
+    extents: 32-41
+EOF
+}
+
+# Clear the Clean flag of the superblock
+printf '\x00' | dd of=$SCRATCH/image.200 bs=1 seek=24 conv=notrunc 2> /dev/null
+
+echo -n "Testing extents in $SCRATCH/image.200 ... "
+if diff -u <(test-1-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-1-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/9000.bin $SCRATCH/9000.out && cmp -s $SCRATCH/40000.bin $SCRATCH/40000.out; then
+    echo "Success"
+else
+    echo "False"
+    cat $SCRATCH/test.log
+fi
@@ -8,7 +8,7 @@ SuperBlock:
     5 blocks
     1 inode blocks
     113 inodes
-2 disk block reads
+0 disk block reads
 5 disk block writes
 EOF
 }
@@ -21,7 +21,7 @@ SuperBlock:
     20 blocks
     2 inode blocks
     226 inodes
-3 disk block reads
+0 disk block reads
 20 disk block writes
 EOF
 }
@@ -0,0 +1,33 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Fill a memory disk, snapshot it, and read the snapshot back from a file disk
+
+test-input() {
+    cat <<EOF
+format
+mount
+create
+copyin $SCRATCH/input 0
+unmount
+snapshot $SCRATCH/image.200
+EOF
+}
+
+for flags in "-M" "-H"; do
+    head -c 300000 /dev/urandom > $SCRATCH/input
+    rm -f $SCRATCH/image.200 $SCRATCH/output
+
+    echo -n "Testing memory disk snapshot with flags '$flags' to $SCRATCH/image.200 ... "
+    test-input | ./bin/sfssh $flags $SCRATCH/memory.200 200 > $SCRATCH/test.log 2> /dev/null
+    printf "mount\ncopyout 0 $SCRATCH/output\n" | ./bin/sfssh $SCRATCH/image.200 200 >> $SCRATCH/test.log 2> /dev/null
+    if grep -q "disk saved to $SCRATCH/image.200." $SCRATCH/test.log &&
+       cmp -s $SCRATCH/input $SCRATCH/output; then
+        echo "Success"
+    else
+        echo "Failure"
+        cat $SCRATCH/test.log
+    fi
+done
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Sequential reads, and reads jumping between the front and the back of a
+# file, must return the same bytes with readahead off, small or at its
+# default, before and after the file is rewritten and remounted
+
+test-input() {
+    cat <<EOF
+format
+mount
+create
+create
+copyin $SCRATCH/input.0 0
+copyin $SCRATCH/input.1 1
+copyout 0 $SCRATCH/output.0
+copyjump 1 $SCRATCH/jump.1
+copyout 1 $SCRATCH/output.1
+copyjump 0 $SCRATCH/jump.0
+copyin $SCRATCH/input.2 0
+copyout 0 $SCRATCH/output.2
+unmount
+mount
+copyjump 0 $SCRATCH/jump.2
+EOF
+}
+
+test-readahead() {
+    FLAGS=$1
+
+    rm -f $SCRATCH/output.* $SCRATCH/jump.*
+    truncate -s 0 $SCRATCH/image.2000
+
+    echo -n "Testing readahead with flags '$FLAGS' on $SCRATCH/image.2000 ... "
+    test-input | ./bin/sfssh $FLAGS $SCRATCH/image.2000 2000 > $SCRATCH/test.log 2> /dev/null
+    if cmp -s $SCRATCH/input.0 $SCRATCH/output.0 &&
+       cmp -s $SCRATCH/input.0 $SCRATCH/jump.0 &&
+       cmp -s $SCRATCH/input.1 $SCRATCH/output.1 &&
+       cmp -s $SCRATCH/input.1 $SCRATCH/jump.1 &&
+       cmp -s $SCRATCH/input.2 $SCRATCH/output.2 &&
+       cmp -s $SCRATCH/input.2 $SCRATCH/jump.2; then
+        echo "Success"
+    else
+        echo "Failure"
+        cat $SCRATCH/test.log
+    fi
+}
+
+# Files reaching into their indirect and double indirect blocks, and a
+# rewrite of the first one, all ending in the middle of a block
+head -c 700000 /dev/urandom > $SCRATCH/input.0
+head -c 4400000 /dev/urandom > $SCRATCH/input.1
+head -c 700000 /dev/urandom > $SCRATCH/input.2
+
+test-readahead ""
+test-readahead "-r 0"
+test-readahead "-r 4"
+test-readahead "-r 4 -c 0"
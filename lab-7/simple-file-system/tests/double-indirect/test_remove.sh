@@ -62,8 +62,8 @@ SuperBlock:
 Inode 2:
     size: 0 bytes
     direct blocks:
-21 disk block reads
-8 disk block writes
+2 disk block reads
+1 disk block writes
 EOF
 }
 
@@ -156,8 +156,8 @@ Inode 1:
 Inode 2:
     size: 965 bytes
     direct blocks: 4
-23 disk block reads
-10 disk block writes
+3 disk block reads
+4 disk block writes
 EOF
 }
 
@@ -230,8 +230,8 @@ Inode 2:
     direct blocks: 3 4 5 6 7
     indirect block: 8
     indirect data blocks: 9 10
-34 disk block reads
-11 disk block writes
+11 disk block reads
+9 disk block writes
 EOF
 }
 
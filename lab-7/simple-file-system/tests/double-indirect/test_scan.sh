@@ -0,0 +1,60 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Files spread over the inode blocks, some reaching into their indirect and
+# double indirect blocks, with a few removed again
+setup-input() {
+    cat <<EOF
+format
+mount
+createmany 1500
+copyin $SCRATCH/input.small 3
+copyin $SCRATCH/input.large 700
+copyin $SCRATCH/input.huge 1400
+removemany 100 199
+remove 3
+copyin $SCRATCH/input.small 1499
+unmount
+EOF
+}
+
+# Every inode and block in use, and the files, as the mount finds them
+check-input() {
+    cat <<EOF
+mount
+pbm
+debug
+EOF
+}
+
+test-scan() {
+    NAME=$1
+    FLAGS=$2
+
+    # Clearing the clean flag forces the full scan of the inode blocks
+    printf '\x00' | dd of=$SCRATCH/image.4000 bs=1 seek=24 conv=notrunc 2> /dev/null
+
+    echo -n "Testing $NAME mount scan with flags '$FLAGS' on $SCRATCH/image.4000 ... "
+    check-input | ./bin/sfssh $FLAGS $SCRATCH/image.4000 4000 2> /dev/null | grep -v "disk block" > $SCRATCH/$NAME.log
+    if diff -u $SCRATCH/clean.log $SCRATCH/$NAME.log > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+head -c 20000 /dev/urandom > $SCRATCH/input.small
+head -c 600000 /dev/urandom > $SCRATCH/input.large
+head -c 4300000 /dev/urandom > $SCRATCH/input.huge
+truncate -s 0 $SCRATCH/image.4000
+setup-input | ./bin/sfssh $SCRATCH/image.4000 4000 > /dev/null 2>&1
+
+# The bitmaps saved by a clean unmount are the reference
+check-input | ./bin/sfssh $SCRATCH/image.4000 4000 2> /dev/null | grep -v "disk block" > $SCRATCH/clean.log
+
+test-scan single "-t 1"
+test-scan threaded "-t 4"
+test-scan threaded "-t 4 -c 0"
@@ -15,7 +15,7 @@ disk mounted.
 inode 1 has size 965 bytes.
 stat failed!
 stat failed!
-3 disk block reads
+2 disk block reads
 0 disk block writes
 EOF
 }
@@ -35,7 +35,7 @@ disk mounted.
 stat failed!
 inode 2 has size 27160 bytes.
 inode 3 has size 9546 bytes.
-6 disk block reads
+4 disk block reads
 0 disk block writes
 EOF
 }
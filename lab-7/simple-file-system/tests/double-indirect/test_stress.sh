@@ -0,0 +1,40 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Readers, writers and create/remove churn on one image at the same time
+
+for flags in "" "-e" "-c 0" "-D" "-u" "-u -c 0"; do
+    echo -n "Testing concurrent access with flags '$flags' in $SCRATCH/image.4000 ... "
+    truncate -s 0 $SCRATCH/image.4000
+    if ./bin/sfsstress $flags $SCRATCH/image.4000 4000 2> /dev/null | grep -q "^stress test passed.$"; then
+        echo "Success"
+    else
+        echo "False"
+    fi
+done
+
+# Two images mounted at once, the same inode numbers written on each
+
+for flags in "" "-e"; do
+    echo -n "Testing two mounted images with flags '$flags' in $SCRATCH ... "
+    truncate -s 0 $SCRATCH/image.4000 $SCRATCH/image.3000
+    if ./bin/sfsstress $flags $SCRATCH/image.4000 4000 $SCRATCH/image.3000 3000 2> /dev/null | grep -q "^stress test passed.$"; then
+        echo "Success"
+    else
+        echo "False"
+    fi
+done
+
+# Buffered files written and read back while another file fills the disk
+
+for flags in "-f" "-f -e"; do
+    echo -n "Testing delayed writes on a full disk with flags '$flags' in $SCRATCH ... "
+    truncate -s 0 $SCRATCH/image.4000 $SCRATCH/image.3000
+    if ./bin/sfsstress $flags $SCRATCH/image.4000 4000 $SCRATCH/image.3000 3000 2> /dev/null | grep -q "^stress test passed.$"; then
+        echo "Success"
+    else
+        echo "False"
+    fi
+done